@@ -0,0 +1,66 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+typedef struct arena {
+    size_t capacity;
+    size_t used;
+
+    void* data;
+} arena_t;
+
+arena_t* arena_alloc(size_t capacity) {
+    NV_LOG_DEBUG("allocating %zu byte arena", capacity);
+
+    /* arena + data in one block, with room to align the start of the data */
+    arena_t* arena = nv_alloc(sizeof(arena_t) + ARENA_ALIGNMENT - 1 + capacity);
+    if (!arena) {
+        return NULL;
+    }
+
+    uintptr_t data = (uintptr_t)arena + sizeof(arena_t);
+    data = (data + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->data = (void*)data;
+
+    return arena;
+}
+
+void arena_free(arena_t* arena) {
+    if (!arena) {
+        return;
+    }
+
+    nv_free(arena);
+}
+
+static void* arena_alloc_callback(void* user, size_t size) {
+    arena_t* arena = user;
+
+    size_t footprint = arena_get_footprint(size);
+    if (footprint > arena->capacity - arena->used) {
+        NV_LOG_ERROR("arena exhausted! (%zu of %zu bytes used, %zu requested)", arena->used,
+                     arena->capacity, size);
+
+        return NULL;
+    }
+
+    void* ptr = arena->data + arena->used;
+    arena->used += footprint;
+
+    return ptr;
+}
+
+void arena_get_allocator(arena_t* arena, struct nv_allocator* alloc) {
+    memset(alloc, 0, sizeof(struct nv_allocator));
+
+    alloc->user = arena;
+    alloc->alloc = arena_alloc_callback;
+    alloc->free = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* every allocation is aligned to this many bytes */
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena arena_t;
+
+/* bump allocator over a single preallocated block, sized up front with arena_get_footprint. frees
+ * are no-ops; everything is returned at once by arena_free */
+arena_t* arena_alloc(size_t capacity);
+void arena_free(arena_t* arena);
+
+struct nv_allocator;
+
+/* fills alloc with callbacks that allocate from arena. free is left NULL, which mat_free and
+ * friends treat as nothing to do */
+void arena_get_allocator(arena_t* arena, struct nv_allocator* alloc);
+
+/* bytes a request of size takes out of an arena, for sizing one up front */
+static inline size_t arena_get_footprint(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include "checkpoint.h"
+
+#include "model.h"
+#include "optim.h"
+
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+typedef struct checkpointer {
+    char* path;
+    model_t* snapshot;
+
+    /* NULL unless optimizer state is saved too */
+    char* optim_path;
+    optimizer_t* optim_snapshot;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    /* the snapshot is the writer's until it clears this */
+    bool pending;
+    bool failed;
+    bool shutdown;
+} checkpointer_t;
+
+static void* writer_main(void* arg) {
+    checkpointer_t* checkpointer = arg;
+
+    pthread_mutex_lock(&checkpointer->mutex);
+    while (true) {
+        while (!checkpointer->shutdown && !checkpointer->pending) {
+            pthread_cond_wait(&checkpointer->start_cond, &checkpointer->mutex);
+        }
+
+        /* shutdown only follows a wait, so nothing is pending */
+        if (checkpointer->shutdown) {
+            break;
+        }
+
+        pthread_mutex_unlock(&checkpointer->mutex);
+
+        bool written = model_write_to_path(checkpointer->snapshot, checkpointer->path);
+        if (written && checkpointer->optim_snapshot) {
+            written = optim_write_to_path(checkpointer->optim_snapshot, checkpointer->optim_path);
+        }
+
+        pthread_mutex_lock(&checkpointer->mutex);
+
+        if (!written) {
+            NV_LOG_ERROR("failed to write checkpoint to %s", checkpointer->path);
+            checkpointer->failed = true;
+        }
+
+        checkpointer->pending = false;
+        pthread_cond_broadcast(&checkpointer->done_cond);
+    }
+
+    pthread_mutex_unlock(&checkpointer->mutex);
+    return NULL;
+}
+
+void checkpointer_get_optim_path(const char* model_path, char* path) {
+    size_t length = strlen(model_path);
+
+    memcpy(path, model_path, length);
+    memcpy(path + length, CHECKPOINT_OPTIM_SUFFIX, sizeof(CHECKPOINT_OPTIM_SUFFIX));
+}
+
+checkpointer_t* checkpointer_alloc(const model_t* model, const optimizer_t* optimizer,
+                                   const char* path) {
+    checkpointer_t* checkpointer = nv_alloc(sizeof(checkpointer_t));
+    assert(checkpointer);
+    memset(checkpointer, 0, sizeof(checkpointer_t));
+
+    size_t path_size = strlen(path) + 1;
+    checkpointer->path = nv_alloc(path_size);
+    assert(checkpointer->path);
+    memcpy(checkpointer->path, path, path_size);
+
+    checkpointer->snapshot = model_clone(NULL, model);
+    assert(checkpointer->snapshot);
+
+    if (optimizer) {
+        checkpointer->optim_path = nv_alloc(path_size + sizeof(CHECKPOINT_OPTIM_SUFFIX) - 1);
+        assert(checkpointer->optim_path);
+        checkpointer_get_optim_path(path, checkpointer->optim_path);
+
+        checkpointer->optim_snapshot = optim_alloc(model, optim_get_params(optimizer));
+    }
+
+    pthread_mutex_init(&checkpointer->mutex, NULL);
+    pthread_cond_init(&checkpointer->start_cond, NULL);
+    pthread_cond_init(&checkpointer->done_cond, NULL);
+
+    if (pthread_create(&checkpointer->thread, NULL, writer_main, checkpointer) != 0) {
+        NV_LOG_ERROR("failed to spawn checkpoint writer!");
+
+        pthread_cond_destroy(&checkpointer->done_cond);
+        pthread_cond_destroy(&checkpointer->start_cond);
+        pthread_mutex_destroy(&checkpointer->mutex);
+
+        optim_free(checkpointer->optim_snapshot);
+        nv_free(checkpointer->optim_path);
+
+        model_free(checkpointer->snapshot);
+        nv_free(checkpointer->path);
+        nv_free(checkpointer);
+
+        return NULL;
+    }
+
+    return checkpointer;
+}
+
+void checkpointer_free(checkpointer_t* checkpointer) {
+    if (!checkpointer) {
+        return;
+    }
+
+    checkpointer_wait(checkpointer);
+
+    pthread_mutex_lock(&checkpointer->mutex);
+    checkpointer->shutdown = true;
+    pthread_cond_signal(&checkpointer->start_cond);
+    pthread_mutex_unlock(&checkpointer->mutex);
+
+    pthread_join(checkpointer->thread, NULL);
+
+    pthread_cond_destroy(&checkpointer->done_cond);
+    pthread_cond_destroy(&checkpointer->start_cond);
+    pthread_mutex_destroy(&checkpointer->mutex);
+
+    optim_free(checkpointer->optim_snapshot);
+    nv_free(checkpointer->optim_path);
+
+    model_free(checkpointer->snapshot);
+    nv_free(checkpointer->path);
+    nv_free(checkpointer);
+}
+
+bool checkpointer_save(checkpointer_t* checkpointer, const model_t* model,
+                       const optimizer_t* optimizer) {
+    pthread_mutex_lock(&checkpointer->mutex);
+    bool busy = checkpointer->pending;
+    pthread_mutex_unlock(&checkpointer->mutex);
+
+    if (busy) {
+        return false;
+    }
+
+    /* the writer is idle, so the snapshot is ours until pending is set */
+    model_copy(checkpointer->snapshot, model);
+    if (checkpointer->optim_snapshot) {
+        optim_copy(checkpointer->optim_snapshot, optimizer);
+    }
+
+    pthread_mutex_lock(&checkpointer->mutex);
+    checkpointer->pending = true;
+    pthread_cond_signal(&checkpointer->start_cond);
+    pthread_mutex_unlock(&checkpointer->mutex);
+
+    return true;
+}
+
+bool checkpointer_wait(checkpointer_t* checkpointer) {
+    pthread_mutex_lock(&checkpointer->mutex);
+    while (checkpointer->pending) {
+        pthread_cond_wait(&checkpointer->done_cond, &checkpointer->mutex);
+    }
+
+    bool succeeded = !checkpointer->failed;
+    checkpointer->failed = false;
+
+    pthread_mutex_unlock(&checkpointer->mutex);
+    return succeeded;
+}
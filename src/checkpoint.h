@@ -0,0 +1,41 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdbool.h>
+
+/* from model.h */
+typedef struct model model_t;
+
+/* from optim.h */
+typedef struct optimizer optimizer_t;
+
+/* optimizer state is written beside the model, at its path with this appended */
+#define CHECKPOINT_OPTIM_SUFFIX ".optim"
+
+/* path (with room for the suffix) receives model_path + CHECKPOINT_OPTIM_SUFFIX */
+void checkpointer_get_optim_path(const char* model_path, char* path);
+
+typedef struct checkpointer checkpointer_t;
+
+/* writes snapshots of a model to path from a background thread, so training only ever pays for a
+ * copy of the parameters. the snapshot buffer is allocated once, shaped like model; at most one
+ * snapshot is in flight. if optimizer is not NULL, its state is snapshotted and written alongside
+ * (after the model; each file is replaced atomically, not the pair) */
+checkpointer_t* checkpointer_alloc(const model_t* model, const optimizer_t* optimizer,
+                                   const char* path);
+
+/* waits for the snapshot in flight, if any */
+void checkpointer_free(checkpointer_t* checkpointer);
+
+/* copies model's parameters (and optimizer's state, if the checkpointer was given one) into the
+ * snapshot and hands it to the writer, which streams it to a temporary file, syncs it and renames
+ * it over path. returns false without copying anything if the previous snapshot is still being
+ * written */
+bool checkpointer_save(checkpointer_t* checkpointer, const model_t* model,
+                       const optimizer_t* optimizer);
+
+/* blocks until the snapshot in flight (if any) is on disk. returns false if any write since the
+ * last call failed */
+bool checkpointer_wait(checkpointer_t* checkpointer);
+
+#endif
@@ -0,0 +1,258 @@
+#include "compile.h"
+
+#include "matrix.h"
+#include "model.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* independent partial sums per dot product. the inner loop over them has a constant trip count
+ * and no dependencies between iterations, so compilers unroll and vectorize it without needing
+ * -ffast-math to reassociate the sum */
+#define COMPILE_LANES 16
+
+static bool is_identifier(const char* name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+        return false;
+    }
+
+    for (const char* c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* hex float literals round-trip exactly */
+static bool emit_floats(FILE* f, const float* values, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!isfinite(values[i])) {
+            NV_LOG_ERROR("cannot compile a model with non-finite parameters!");
+            return false;
+        }
+
+        fprintf(f, "%s%af,", i % 4 == 0 ? "\n    " : " ", values[i]);
+    }
+
+    return true;
+}
+
+static bool emit_layer_data(FILE* f, const char* name, uint32_t index,
+                            const struct model_layer* layer) {
+    uint32_t rows = layer->weights->rows;
+    uint32_t columns = layer->weights->columns;
+
+    /* half precision weights are widened row by row */
+    matrix_t* widened = mat_alloc(NULL, 1, columns);
+    assert(widened);
+
+    fprintf(f, "static const float %s_w%u[%u][%u] __attribute__((aligned(64))) = {\n", name,
+            index, rows, columns);
+
+    bool success = true;
+    for (uint32_t y = 0; y < rows && success; y++) {
+        matrix_t source = *layer->weights;
+        source.rows = 1;
+        source.data = mat_row_data(layer->weights, y);
+
+        mat_copy(widened, &source);
+
+        fprintf(f, "{");
+        success = emit_floats(f, widened->data, columns);
+        fprintf(f, "\n},\n");
+    }
+
+    fprintf(f, "};\n\n");
+
+    if (success) {
+        fprintf(f, "static const float %s_b%u[%u] __attribute__((aligned(64))) = {", name, index,
+                rows);
+
+        success = emit_floats(f, layer->biases->data, rows);
+        fprintf(f, "\n};\n\n");
+    }
+
+    mat_free(NULL, widened);
+
+    return success;
+}
+
+static void emit_activation(FILE* f, uint32_t op, uint32_t rows) {
+    switch (op) {
+    case LAYER_OP_RELU:
+        fprintf(f, "    for (int r = 0; r < %u; r++) {\n", rows);
+        fprintf(f, "        out[r] = out[r] > 0.f ? out[r] : 0.f;\n");
+        fprintf(f, "    }\n");
+        break;
+    case LAYER_OP_SIGMOID:
+        fprintf(f, "    for (int r = 0; r < %u; r++) {\n", rows);
+        fprintf(f, "        out[r] = 1.f / (1.f + expf(-out[r]));\n");
+        fprintf(f, "    }\n");
+        break;
+    case LAYER_OP_SOFTMAX:
+        /* shifted by the max, as mat_softmax does */
+        fprintf(f, "    float max = out[0];\n");
+        fprintf(f, "    for (int r = 1; r < %u; r++) {\n", rows);
+        fprintf(f, "        max = out[r] > max ? out[r] : max;\n");
+        fprintf(f, "    }\n\n");
+        fprintf(f, "    float sum = 0.f;\n");
+        fprintf(f, "    for (int r = 0; r < %u; r++) {\n", rows);
+        fprintf(f, "        out[r] = expf(out[r] - max);\n");
+        fprintf(f, "        sum += out[r];\n");
+        fprintf(f, "    }\n\n");
+        fprintf(f, "    for (int r = 0; r < %u; r++) {\n", rows);
+        fprintf(f, "        out[r] /= sum;\n");
+        fprintf(f, "    }\n");
+        break;
+    default:
+        break;
+    }
+}
+
+/* out = A(w * in + b). the tail loop is only emitted when the width needs one */
+static void emit_layer_kernel(FILE* f, const char* name, uint32_t index,
+                              const struct model_layer* layer) {
+    uint32_t rows = layer->weights->rows;
+    uint32_t columns = layer->weights->columns;
+    uint32_t body = columns / COMPILE_LANES * COMPILE_LANES;
+
+    fprintf(f, "static void %s_layer%u(const float* restrict in, float* restrict out) {\n", name,
+            index);
+
+    fprintf(f, "    for (int r = 0; r < %u; r++) {\n", rows);
+    fprintf(f, "        const float* w = %s_w%u[r];\n\n", name, index);
+    fprintf(f, "        float acc[%u] = { 0.f };\n", COMPILE_LANES);
+
+    if (body > 0) {
+        fprintf(f, "        for (int c = 0; c < %u; c += %u) {\n", body, COMPILE_LANES);
+        fprintf(f, "            for (int l = 0; l < %u; l++) {\n", COMPILE_LANES);
+        fprintf(f, "                acc[l] += w[c + l] * in[c + l];\n");
+        fprintf(f, "            }\n");
+        fprintf(f, "        }\n\n");
+    }
+
+    if (body < columns) {
+        fprintf(f, "        for (int c = %u; c < %u; c++) {\n", body, columns);
+        fprintf(f, "            acc[c - %u] += w[c] * in[c];\n", body);
+        fprintf(f, "        }\n\n");
+    }
+
+    /* fixed pairwise reduction */
+    for (uint32_t width = COMPILE_LANES / 2; width > 0; width /= 2) {
+        fprintf(f, "        for (int l = 0; l < %u; l++) {\n", width);
+        fprintf(f, "            acc[l] += acc[l + %u];\n", width);
+        fprintf(f, "        }\n\n");
+    }
+
+    fprintf(f, "        out[r] = acc[0] + %s_b%u[r];\n", name, index);
+    fprintf(f, "    }\n");
+
+    if (layer->op != LAYER_OP_NONE) {
+        fprintf(f, "\n");
+        emit_activation(f, layer->op, rows);
+    }
+
+    fprintf(f, "}\n\n");
+}
+
+static void emit_infer(FILE* f, const char* name, const model_t* model) {
+    fprintf(f, "void %s_infer(const float* restrict input, float* restrict output) {\n", name);
+
+    /* two scratch buffers, ping-ponged as model_infer does */
+    uint32_t widest = 0;
+    for (uint32_t i = 0; i + 1 < model->num_layers; i++) {
+        uint32_t size = model->layers[i].weights->rows;
+        widest = size > widest ? size : widest;
+    }
+
+    if (widest > 0) {
+        fprintf(f, "    float scratch[2][%u] __attribute__((aligned(64)));\n\n", widest);
+    }
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        char in[32], out[32];
+        snprintf(in, sizeof(in), i > 0 ? "scratch[%u]" : "input", (i + 1) % 2);
+        snprintf(out, sizeof(out), i + 1 < model->num_layers ? "scratch[%u]" : "output", i % 2);
+
+        fprintf(f, "    %s_layer%u(%s, %s);\n", name, i, in, out);
+    }
+
+    fprintf(f, "}\n");
+}
+
+static bool emit_model(FILE* f, const model_t* model, const char* name) {
+    char upper[strlen(name) + 1];
+    for (size_t i = 0; i <= strlen(name); i++) {
+        upper[i] = (char)toupper((unsigned char)name[i]);
+    }
+
+    fprintf(f, "/* generated by ml compile; do not edit. shape: %u", model_get_input_size(model));
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        fprintf(f, "-%u", model->layers[i].weights->rows);
+    }
+
+    fprintf(f, " */\n\n");
+    fprintf(f, "#include <math.h>\n\n");
+
+    fprintf(f, "#define %s_INPUT_SIZE %u\n", upper, model_get_input_size(model));
+    fprintf(f, "#define %s_OUTPUT_SIZE %u\n\n", upper, model_get_output_size(model));
+
+    fprintf(f, "void %s_infer(const float* restrict input, float* restrict output);\n\n", name);
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        if (!emit_layer_data(f, name, i, &model->layers[i])) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        emit_layer_kernel(f, name, i, &model->layers[i]);
+    }
+
+    emit_infer(f, name, model);
+    return true;
+}
+
+bool compile_model_to_path(const model_t* model, const char* name, const char* path) {
+    if (!is_identifier(name)) {
+        NV_LOG_ERROR("%s is not a valid c identifier", name);
+        return false;
+    }
+
+    if (model_has_sparse_layers(model)) {
+        NV_LOG_ERROR("cannot compile a model with sparse layers!");
+        return false;
+    }
+
+    if (model_has_low_rank_layers(model)) {
+        NV_LOG_ERROR("cannot compile a model with low-rank layers!");
+        return false;
+    }
+
+    NV_LOG_DEBUG("compiling model to path: %s", path);
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        NV_LOG_ERROR("failed to open %s for writing", path);
+        return false;
+    }
+
+    bool success = emit_model(f, model, name);
+    success = !ferror(f) && success;
+    success = fclose(f) == 0 && success;
+
+    if (!success) {
+        NV_LOG_ERROR("failed to compile model to %s", path);
+        remove(path);
+    }
+
+    return success;
+}
@@ -0,0 +1,19 @@
+#ifndef _COMPILE_H
+#define _COMPILE_H
+
+#include <stdbool.h>
+
+/* from model.h */
+typedef struct model model_t;
+
+/* writes a standalone c file implementing inference for model, one sample at a time:
+ *
+ *     void <name>_infer(const float* input, float* output);
+ *
+ * with <NAME>_INPUT_SIZE and <NAME>_OUTPUT_SIZE defined. every dimension is a compile-time
+ * constant, the weights are embedded as aligned static const arrays (widened to fp32) and each
+ * layer is its own kernel with the activation inlined. the only dependency is libm (expf) for
+ * sigmoid and softmax. name must be a valid c identifier */
+bool compile_model_to_path(const model_t* model, const char* name, const char* path);
+
+#endif
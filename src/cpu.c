@@ -0,0 +1,89 @@
+#include "cpu.h"
+
+#include <pthread.h>
+
+#include <nyoravim/log.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+static uint64_t read_xcr0() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+static uint32_t query_features() {
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    uint32_t features = 0;
+    if (edx & bit_SSE2) {
+        features |= CPU_FEATURE_SSE2;
+    }
+
+    /* the os has to save ymm/zmm state for any of the avx paths to be usable */
+    bool has_osxsave = ecx & bit_OSXSAVE;
+    uint64_t xcr0 = has_osxsave ? read_xcr0() : 0;
+
+    bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+    bool zmm_enabled = (xcr0 & 0xE6) == 0xE6;
+
+    if (!ymm_enabled) {
+        return features;
+    }
+
+    if (ecx & bit_FMA) {
+        features |= CPU_FEATURE_FMA;
+    }
+
+    if (ecx & bit_F16C) {
+        features |= CPU_FEATURE_F16C;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return features;
+    }
+
+    if (ebx & bit_AVX2) {
+        features |= CPU_FEATURE_AVX2;
+    }
+
+    if (zmm_enabled && (ebx & bit_AVX512F)) {
+        features |= CPU_FEATURE_AVX512F;
+
+        if (ebx & bit_AVX512BW) {
+            features |= CPU_FEATURE_AVX512BW;
+        }
+
+        if (ecx & bit_AVX512VNNI) {
+            features |= CPU_FEATURE_AVX512VNNI;
+        }
+    }
+
+    return features;
+}
+#else
+static uint32_t query_features() { return 0; }
+#endif
+
+static pthread_once_t s_features_once = PTHREAD_ONCE_INIT;
+static uint32_t s_features;
+
+static void init_features() {
+    s_features = query_features();
+
+    NV_LOG_DEBUG("cpu features: sse2 %d, avx2 %d, fma %d, f16c %d, avx512f %d, avx512bw %d, "
+                 "avx512vnni %d",
+                 (s_features & CPU_FEATURE_SSE2) != 0, (s_features & CPU_FEATURE_AVX2) != 0,
+                 (s_features & CPU_FEATURE_FMA) != 0, (s_features & CPU_FEATURE_F16C) != 0,
+                 (s_features & CPU_FEATURE_AVX512F) != 0, (s_features & CPU_FEATURE_AVX512BW) != 0,
+                 (s_features & CPU_FEATURE_AVX512VNNI) != 0);
+}
+
+uint32_t cpu_get_features() {
+    pthread_once(&s_features_once, init_features);
+    return s_features;
+}
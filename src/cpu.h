@@ -0,0 +1,25 @@
+#ifndef _CPU_H
+#define _CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+    CPU_FEATURE_SSE2 = (1 << 0),
+    CPU_FEATURE_AVX2 = (1 << 1),
+    CPU_FEATURE_FMA = (1 << 2),
+    CPU_FEATURE_F16C = (1 << 3),
+    CPU_FEATURE_AVX512F = (1 << 4),
+    CPU_FEATURE_AVX512BW = (1 << 5),
+    CPU_FEATURE_AVX512VNNI = (1 << 6),
+};
+
+/* queried once via cpuid (and xgetbv for os support of the wider register files). always 0 on
+ * non-x86 targets */
+uint32_t cpu_get_features();
+
+static inline bool cpu_has_features(uint32_t features) {
+    return (cpu_get_features() & features) == features;
+}
+
+#endif
@@ -115,6 +115,10 @@ void dataset_free(dataset_t* data) {
 uint32_t dataset_get_image_count(const dataset_t* data) { return data->images.num; }
 uint32_t dataset_get_label_count(const dataset_t* data) { return data->labels.num; }
 
+uint32_t dataset_get_image_size(const dataset_t* data) {
+    return data->images.width * data->images.height;
+}
+
 uint32_t dataset_get_entry(const dataset_t* data, uint32_t index, const struct nv_allocator* alloc,
                            struct dataset_entry* entry) {
     uint32_t flags = 0;
@@ -126,9 +130,13 @@ uint32_t dataset_get_entry(const dataset_t* data, uint32_t index, const struct n
         entry->image = mat_alloc(alloc, data->images.height, data->images.width);
         assert(entry->image);
 
-        uint32_t total = data->images.width * data->images.height;
-        for (uint32_t i = 0; i < total; i++) {
-            entry->image->data[i] = (float)image[i] / 255;
+        for (uint32_t y = 0; y < data->images.height; y++) {
+            float* row = mat_row(entry->image, y);
+            const uint8_t* src = image + y * data->images.width;
+
+            for (uint32_t x = 0; x < data->images.width; x++) {
+                row[x] = (float)src[x] / 255;
+            }
         }
 
         flags |= DATASET_ENTRY_HAS_IMAGE;
@@ -141,3 +149,55 @@ uint32_t dataset_get_entry(const dataset_t* data, uint32_t index, const struct n
 
     return flags;
 }
+
+bool dataset_get_batch(const dataset_t* data, const uint32_t* indices, uint32_t count,
+                       matrix_t* images, uint8_t* labels) {
+    uint32_t image_size = dataset_get_image_size(data);
+    assert(images->rows == image_size);
+    assert(images->columns == count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = indices[i];
+        if (index >= data->images.num || (labels && index >= data->labels.num)) {
+            NV_LOG_ERROR("dataset index %u out of range!", index);
+            return false;
+        }
+
+        uint32_t offsets[] = { index, 0, 0 };
+        const uint8_t* image = mnist_get_data(data->images.data, offsets);
+
+        /* column i */
+        for (uint32_t j = 0; j < image_size; j++) {
+            mat_row(images, j)[i] = (float)image[j] / 255;
+        }
+
+        if (labels) {
+            labels[i] = data->labels.data->data[index];
+        }
+    }
+
+    return true;
+}
+
+bool dataset_get_pixels(const dataset_t* data, const uint32_t* indices, uint32_t count,
+                        uint8_t* pixels, size_t stride, uint8_t* labels) {
+    uint32_t image_size = dataset_get_image_size(data);
+    assert(stride >= image_size);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = indices[i];
+        if (index >= data->images.num || (labels && index >= data->labels.num)) {
+            NV_LOG_ERROR("dataset index %u out of range!", index);
+            return false;
+        }
+
+        uint32_t offsets[] = { index, 0, 0 };
+        memcpy(pixels + i * stride, mnist_get_data(data->images.data, offsets), image_size);
+
+        if (labels) {
+            labels[i] = data->labels.data->data[index];
+        }
+    }
+
+    return true;
+}
@@ -1,6 +1,7 @@
 #ifndef _DATASET_H
 #define _DATASET_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -20,6 +21,9 @@ void dataset_free(dataset_t* data);
 uint32_t dataset_get_image_count(const dataset_t* data);
 uint32_t dataset_get_label_count(const dataset_t* data);
 
+/* pixels per image */
+uint32_t dataset_get_image_size(const dataset_t* data);
+
 enum {
     DATASET_ENTRY_HAS_IMAGE = (1 << 0),
     DATASET_ENTRY_HAS_LABEL = (1 << 1),
@@ -33,4 +37,14 @@ struct nv_allocator;
 uint32_t dataset_get_entry(const dataset_t* data, uint32_t index, const struct nv_allocator* alloc,
                            struct dataset_entry* entry);
 
+/* fills images (image_size x count, one image per column, scaled to [0, 1]) and labels (count
+ * entries, may be NULL) for the given indices. returns false if an index has no image or label */
+bool dataset_get_batch(const dataset_t* data, const uint32_t* indices, uint32_t count,
+                       matrix_t* images, uint8_t* labels);
+
+/* like dataset_get_batch, but copies the raw pixels of each image (unscaled, one image every
+ * stride bytes) instead of converting them */
+bool dataset_get_pixels(const dataset_t* data, const uint32_t* indices, uint32_t count,
+                        uint8_t* pixels, size_t stride, uint8_t* labels);
+
 #endif
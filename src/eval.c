@@ -0,0 +1,262 @@
+#include "eval.h"
+
+#include "matrix.h"
+#include "model.h"
+#include "pool.h"
+
+#include "data/dataset.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* one per pool thread, whichever batches it ends up pulling */
+struct eval_worker {
+    struct model_inference* inference;
+
+    uint8_t* pixels;
+    uint8_t* labels;
+    uint32_t* indices;
+
+    uint32_t correct;
+    uint32_t confusion[EVAL_MAX_CLASSES][EVAL_MAX_CLASSES];
+
+    bool loaded;
+};
+
+typedef struct evaluator {
+    const model_t* model;
+    thread_pool_t* pool;
+
+    uint32_t batch_size;
+    uint32_t image_size;
+    uint32_t classes;
+
+    uint32_t worker_count;
+    struct eval_worker* workers;
+
+    /* the pass in flight. per-batch results are kept by batch, so summing them does not depend on
+     * which thread ran what */
+    const dataset_t* data;
+    uint32_t count;
+    double* losses;
+    double* latencies;
+} evaluator_t;
+
+static double get_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+evaluator_t* evaluator_alloc(const model_t* model, thread_pool_t* pool, uint32_t batch_size,
+                             uint32_t image_size) {
+    assert(batch_size > 0);
+    assert(image_size == model_get_input_size(model));
+
+    uint32_t classes = model_get_output_size(model);
+    if (classes > EVAL_MAX_CLASSES) {
+        NV_LOG_ERROR("cannot evaluate a model with %u outputs; at most %u are supported", classes,
+                     EVAL_MAX_CLASSES);
+        return NULL;
+    }
+
+    evaluator_t* evaluator = nv_alloc(sizeof(evaluator_t));
+    assert(evaluator);
+    memset(evaluator, 0, sizeof(evaluator_t));
+
+    evaluator->model = model;
+    evaluator->pool = pool;
+    evaluator->batch_size = batch_size;
+    evaluator->image_size = image_size;
+    evaluator->classes = classes;
+
+    evaluator->worker_count = pool ? pool_get_thread_count(pool) : 1;
+    evaluator->workers = nv_alloc(evaluator->worker_count * sizeof(struct eval_worker));
+    assert(evaluator->workers);
+
+    for (uint32_t i = 0; i < evaluator->worker_count; i++) {
+        struct eval_worker* worker = &evaluator->workers[i];
+        memset(worker, 0, sizeof(struct eval_worker));
+
+        worker->inference = model_alloc_inference(model, NULL, batch_size);
+        worker->pixels = nv_alloc((size_t)image_size * batch_size);
+        worker->labels = nv_alloc(batch_size);
+        worker->indices = nv_alloc(batch_size * sizeof(uint32_t));
+        assert(worker->inference && worker->pixels && worker->labels && worker->indices);
+    }
+
+    return evaluator;
+}
+
+void evaluator_free(evaluator_t* evaluator) {
+    if (!evaluator) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < evaluator->worker_count; i++) {
+        struct eval_worker* worker = &evaluator->workers[i];
+
+        model_free_inference(NULL, worker->inference);
+        nv_free(worker->pixels);
+        nv_free(worker->labels);
+        nv_free(worker->indices);
+    }
+
+    nv_free(evaluator->workers);
+    nv_free(evaluator);
+}
+
+static void run_batch(void* user, uint32_t index, uint32_t worker_index) {
+    evaluator_t* evaluator = user;
+    struct eval_worker* worker = &evaluator->workers[worker_index];
+
+    uint32_t offset = index * evaluator->batch_size;
+    uint32_t count = evaluator->count - offset;
+    count = count < evaluator->batch_size ? count : evaluator->batch_size;
+
+    for (uint32_t i = 0; i < count; i++) {
+        worker->indices[i] = offset + i;
+    }
+
+    size_t stride = evaluator->image_size;
+    if (!dataset_get_pixels(evaluator->data, worker->indices, count, worker->pixels, stride,
+                            worker->labels)) {
+        worker->loaded = false;
+        return;
+    }
+
+    double start = get_seconds();
+    const matrix_t* output = model_infer_pixels(evaluator->model, worker->pixels, stride, count,
+                                                worker->inference);
+    evaluator->latencies[index] = get_seconds() - start;
+
+    double loss = 0.0;
+    for (uint32_t x = 0; x < count; x++) {
+        uint32_t best = 0;
+        for (uint32_t y = 1; y < output->rows; y++) {
+            if (mat_row(output, y)[x] > mat_row(output, best)[x]) {
+                best = y;
+            }
+        }
+
+        uint8_t label = worker->labels[x];
+        if (label >= evaluator->classes) {
+            continue;
+        }
+
+        worker->correct += best == label ? 1 : 0;
+        worker->confusion[label][best]++;
+
+        /* the output is already softmaxed; a confidently wrong one would otherwise be infinite */
+        float probability = mat_row(output, label)[x];
+        loss -= log(probability > FLT_MIN ? probability : FLT_MIN);
+    }
+
+    evaluator->losses[index] = loss;
+}
+
+static int compare_doubles(const void* lhs, const void* rhs) {
+    double a = *(const double*)lhs;
+    double b = *(const double*)rhs;
+
+    return (a > b) - (a < b);
+}
+
+/* nearest-rank percentile p of sorted (count entries) */
+static double get_percentile(const double* sorted, uint32_t count, double p) {
+    uint32_t rank = (uint32_t)ceil(p * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+bool evaluator_run(evaluator_t* evaluator, const dataset_t* data, struct eval_report* report) {
+    uint32_t images = dataset_get_image_count(data);
+    uint32_t labels = dataset_get_label_count(data);
+
+    uint32_t count = images < labels ? images : labels;
+    uint32_t batches = (count + evaluator->batch_size - 1) / evaluator->batch_size;
+
+    memset(report, 0, sizeof(struct eval_report));
+    report->classes = evaluator->classes;
+
+    if (batches == 0) {
+        return true;
+    }
+
+    evaluator->data = data;
+    evaluator->count = count;
+    evaluator->losses = nv_alloc(batches * sizeof(double));
+    evaluator->latencies = nv_alloc(batches * sizeof(double));
+    assert(evaluator->losses && evaluator->latencies);
+
+    for (uint32_t i = 0; i < evaluator->worker_count; i++) {
+        struct eval_worker* worker = &evaluator->workers[i];
+
+        worker->correct = 0;
+        worker->loaded = true;
+        memset(worker->confusion, 0, sizeof(worker->confusion));
+    }
+
+    double start = get_seconds();
+    if (evaluator->pool) {
+        pool_run(evaluator->pool, batches, run_batch, evaluator);
+    } else {
+        for (uint32_t i = 0; i < batches; i++) {
+            run_batch(evaluator, i, 0);
+        }
+    }
+
+    report->seconds = get_seconds() - start;
+
+    bool loaded = true;
+    for (uint32_t i = 0; i < evaluator->worker_count; i++) {
+        const struct eval_worker* worker = &evaluator->workers[i];
+        loaded = loaded && worker->loaded;
+
+        report->correct += worker->correct;
+        for (uint32_t y = 0; y < evaluator->classes; y++) {
+            for (uint32_t x = 0; x < evaluator->classes; x++) {
+                report->confusion[y][x] += worker->confusion[y][x];
+            }
+        }
+    }
+
+    if (loaded) {
+        for (uint32_t y = 0; y < evaluator->classes; y++) {
+            for (uint32_t x = 0; x < evaluator->classes; x++) {
+                report->total += report->confusion[y][x];
+            }
+        }
+
+        for (uint32_t i = 0; i < batches; i++) {
+            report->loss += evaluator->losses[i];
+        }
+
+        report->loss = report->total > 0 ? report->loss / report->total : 0.0;
+
+        qsort(evaluator->latencies, batches, sizeof(double), compare_doubles);
+
+        report->batches = batches;
+        report->latency_p50 = get_percentile(evaluator->latencies, batches, 0.5);
+        report->latency_p90 = get_percentile(evaluator->latencies, batches, 0.9);
+        report->latency_p99 = get_percentile(evaluator->latencies, batches, 0.99);
+        report->latency_max = evaluator->latencies[batches - 1];
+    } else {
+        NV_LOG_ERROR("failed to load a batch to evaluate!");
+    }
+
+    nv_free(evaluator->latencies);
+    nv_free(evaluator->losses);
+
+    evaluator->losses = NULL;
+    evaluator->latencies = NULL;
+
+    return loaded;
+}
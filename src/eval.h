@@ -0,0 +1,51 @@
+#ifndef _EVAL_H
+#define _EVAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* from model.h */
+typedef struct model model_t;
+
+/* from pool.h */
+typedef struct thread_pool thread_pool_t;
+
+/* from data/dataset.h */
+typedef struct dataset dataset_t;
+
+/* the widest output layer an evaluator can keep a confusion matrix for */
+#define EVAL_MAX_CLASSES 10
+
+struct eval_report {
+    uint32_t correct, total;
+
+    /* mean cross-entropy of the output against the label */
+    double loss;
+
+    /* classes x classes (the output size) of it is used: [label][predicted] */
+    uint32_t classes;
+    uint32_t confusion[EVAL_MAX_CLASSES][EVAL_MAX_CLASSES];
+
+    /* wall time of the whole pass, loading included */
+    double seconds;
+
+    /* of each batch's forward pass alone, nearest-rank */
+    uint32_t batches;
+    double latency_p50, latency_p90, latency_p99, latency_max;
+};
+
+typedef struct evaluator evaluator_t;
+
+/* batched inference over a whole dataset. the dataset is cut into batches of batch_size (the last
+ * may be short), which the pool's threads pull one at a time, each running them through its own
+ * inference buffers (see model_alloc_inference). everything per thread is allocated here, once.
+ * pool may be NULL. NULL if the model's output is wider than EVAL_MAX_CLASSES */
+evaluator_t* evaluator_alloc(const model_t* model, thread_pool_t* pool, uint32_t batch_size,
+                             uint32_t image_size);
+
+void evaluator_free(evaluator_t* evaluator);
+
+/* evaluates every labelled image of data. false if a batch could not be loaded */
+bool evaluator_run(evaluator_t* evaluator, const dataset_t* data, struct eval_report* report);
+
+#endif
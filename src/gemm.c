@@ -0,0 +1,907 @@
+#include "gemm.h"
+
+#include "cpu.h"
+#include "pool.h"
+#include "vec.h"
+#include "half.h"
+#include "jit.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+/* kernels are only generated for x86-64 */
+#ifdef __x86_64__
+#define GEMM_JIT
+#endif
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* goto/blis-style blocking. op(a) is packed into mc x kc blocks of mr-row panels and op(b) into
+ * kc x nc blocks of nr-column panels, so the micro-kernel only ever streams two contiguous buffers
+ * regardless of the transpose flags. the transpose combinations are handled by the four packing
+ * routines below rather than by the micro-kernel */
+
+#define GEMM_MC_MAX 144
+#define GEMM_KC_MAX 256
+#define GEMM_NC_MAX 1024
+#define GEMM_MR_MAX 12
+#define GEMM_NR_MAX 32
+
+/* of the packing buffers */
+#define GEMM_ALIGNMENT 64
+
+/* elements of the smaller packing buffer, which bounds the special-cased shapes */
+#define GEMM_SCRATCH_SIZE (GEMM_MC_MAX * GEMM_KC_MAX)
+
+/* below this many multiply-adds a product is not worth waking the pool for */
+#define GEMM_PARALLEL_MIN_WORK (1 << 20)
+
+/* target number of multiply-adds per parallel block */
+#define GEMM_PARALLEL_BLOCK_WORK (1 << 19)
+
+/* computes one mr x nr tile from packed panels into a tile buffer with a row stride of nr */
+typedef void (*gemm_micro_kernel_t)(uint32_t kc, const float* a, const float* b, float* tile);
+
+struct gemm_kernel {
+    const char* name;
+    gemm_micro_kernel_t micro;
+
+    /* for the final k block of a product, when it is shorter than kc. the same as micro unless
+     * the kernel was generated for a particular k */
+    gemm_micro_kernel_t micro_tail;
+
+    uint32_t mr, nr;
+    uint32_t mc, kc, nc;
+};
+
+/* the packing buffers, over a megabyte. each thread gets its own on its first product rather than
+ * as static tls, so threads that never multiply (connection readers, the checkpoint writer) carry
+ * none. they are freed when the thread exits */
+struct gemm_buffers {
+    float packed_a[GEMM_MC_MAX * GEMM_KC_MAX] __attribute__((aligned(GEMM_ALIGNMENT)));
+    float packed_b[GEMM_KC_MAX * GEMM_NC_MAX] __attribute__((aligned(GEMM_ALIGNMENT)));
+
+    /* as allocated, before aligning */
+    void* block;
+};
+
+static _Thread_local struct gemm_buffers* s_buffers;
+
+static pthread_once_t s_buffers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t s_buffers_key;
+static bool s_buffers_keyed;
+
+static void free_buffers(void* buffers) { nv_free(((struct gemm_buffers*)buffers)->block); }
+
+static void create_buffers_key() {
+    s_buffers_keyed = pthread_key_create(&s_buffers_key, free_buffers) == 0;
+    if (!s_buffers_keyed) {
+        NV_LOG_ERROR("failed to create gemm buffer key; buffers will outlive their threads");
+    }
+}
+
+static struct gemm_buffers* get_buffers() {
+    if (s_buffers) {
+        return s_buffers;
+    }
+
+    pthread_once(&s_buffers_once, create_buffers_key);
+
+    void* block = nv_alloc(sizeof(struct gemm_buffers) + GEMM_ALIGNMENT - 1);
+    assert(block);
+
+    uintptr_t aligned = ((uintptr_t)block + GEMM_ALIGNMENT - 1) & ~(uintptr_t)(GEMM_ALIGNMENT - 1);
+    s_buffers = (struct gemm_buffers*)aligned;
+    s_buffers->block = block;
+
+    if (s_buffers_keyed) {
+        pthread_setspecific(s_buffers_key, s_buffers);
+    }
+
+    return s_buffers;
+}
+
+static void micro_generic(uint32_t kc, const float* restrict a, const float* restrict b,
+                          float* restrict tile) {
+    float acc[4][8];
+    memset(acc, 0, sizeof(acc));
+
+    for (uint32_t p = 0; p < kc; p++) {
+        for (uint32_t i = 0; i < 4; i++) {
+            for (uint32_t j = 0; j < 8; j++) {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+
+        a += 4;
+        b += 8;
+    }
+
+    memcpy(tile, acc, sizeof(acc));
+}
+
+#ifdef GEMM_X86
+__attribute__((target("avx2,fma"))) static void micro_avx2(uint32_t kc, const float* a,
+                                                            const float* b, float* tile) {
+    __m256 acc[6][2];
+    for (uint32_t i = 0; i < 6; i++) {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+
+    for (uint32_t p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+
+        for (uint32_t i = 0; i < 6; i++) {
+            __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+
+        a += 6;
+        b += 16;
+    }
+
+    for (uint32_t i = 0; i < 6; i++) {
+        _mm256_store_ps(tile + i * 16, acc[i][0]);
+        _mm256_store_ps(tile + i * 16 + 8, acc[i][1]);
+    }
+}
+
+__attribute__((target("avx512f"))) static void micro_avx512(uint32_t kc, const float* a,
+                                                             const float* b, float* tile) {
+    __m512 acc[12][2];
+    for (uint32_t i = 0; i < 12; i++) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+
+    for (uint32_t p = 0; p < kc; p++) {
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+
+        for (uint32_t i = 0; i < 12; i++) {
+            __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+
+        a += 12;
+        b += 32;
+    }
+
+    for (uint32_t i = 0; i < 12; i++) {
+        _mm512_store_ps(tile + i * 32, acc[i][0]);
+        _mm512_store_ps(tile + i * 32 + 16, acc[i][1]);
+    }
+}
+#endif
+
+static const struct gemm_kernel s_generic_kernel = {
+    "generic", micro_generic, micro_generic, 4, 8, 128, 256, 1024,
+};
+
+#ifdef GEMM_X86
+static const struct gemm_kernel s_avx2_kernel = {
+    "avx2", micro_avx2, micro_avx2, 6, 16, 144, 256, 1024,
+};
+
+static const struct gemm_kernel s_avx512_kernel = {
+    "avx512", micro_avx512, micro_avx512, 12, 32, 144, 256, 1024,
+};
+#endif
+
+static pthread_once_t s_kernel_once = PTHREAD_ONCE_INIT;
+static const struct gemm_kernel* s_kernel;
+
+static void select_kernel() {
+    s_kernel = &s_generic_kernel;
+
+#ifdef GEMM_X86
+    if (cpu_has_features(CPU_FEATURE_AVX512F)) {
+        s_kernel = &s_avx512_kernel;
+    } else if (cpu_has_features(CPU_FEATURE_AVX2 | CPU_FEATURE_FMA)) {
+        s_kernel = &s_avx2_kernel;
+    }
+#endif
+
+    NV_LOG_DEBUG("gemm: using %s micro-kernel (%ux%u)", s_kernel->name, s_kernel->mr,
+                 s_kernel->nr);
+}
+
+static const struct gemm_kernel* get_kernel() {
+    pthread_once(&s_kernel_once, select_kernel);
+    return s_kernel;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b) { return a < b ? a : b; }
+
+static size_t get_type_size(uint32_t type) {
+    return type == GEMM_TYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+/* element `index` of an operand stored as `type` */
+static const void* offset_operand(const void* base, uint32_t type, size_t index) {
+    return (const char*)base + index * get_type_size(type);
+}
+
+/* count contiguous elements of an operand as fp32. fp32 operands are read in place; half precision
+ * ones are widened into scratch */
+static const float* load_run(const void* src, uint32_t type, size_t count, float* scratch) {
+    switch (type) {
+    case GEMM_TYPE_BF16:
+        half_bf16_to_floats(scratch, src, count);
+        return scratch;
+    case GEMM_TYPE_F16:
+        half_f16_to_floats(scratch, src, count);
+        return scratch;
+    default:
+        return src;
+    }
+}
+
+static float load_element(const void* src, uint32_t type, size_t index) {
+    switch (type) {
+    case GEMM_TYPE_BF16:
+        return half_bf16_to_float(((const uint16_t*)src)[index]);
+    case GEMM_TYPE_F16:
+        return half_f16_to_float(((const uint16_t*)src)[index]);
+    default:
+        return ((const float*)src)[index];
+    }
+}
+
+/* a stored m x k; panel element (i, p) at dst[p * mr + i] */
+static void pack_a_rows(const void* a, size_t lda, uint32_t type, uint32_t rows, uint32_t kc,
+                        uint32_t mr, float* dst) {
+    float scratch[GEMM_KC_MAX];
+
+    for (uint32_t i = 0; i < mr; i++) {
+        if (i >= rows) {
+            for (uint32_t p = 0; p < kc; p++) {
+                dst[p * mr + i] = 0.f;
+            }
+
+            continue;
+        }
+
+        const float* row = load_run(offset_operand(a, type, i * lda), type, kc, scratch);
+        for (uint32_t p = 0; p < kc; p++) {
+            dst[p * mr + i] = row[p];
+        }
+    }
+}
+
+/* a stored k x m (transposed); each k step of the panel is already contiguous */
+static void pack_a_columns(const void* a, size_t lda, uint32_t type, uint32_t rows, uint32_t kc,
+                           uint32_t mr, float* dst) {
+    float scratch[GEMM_MR_MAX];
+
+    for (uint32_t p = 0; p < kc; p++) {
+        const float* src = load_run(offset_operand(a, type, p * lda), type, rows, scratch);
+
+        uint32_t i = 0;
+        for (; i < rows; i++) {
+            dst[i] = src[i];
+        }
+
+        for (; i < mr; i++) {
+            dst[i] = 0.f;
+        }
+
+        dst += mr;
+    }
+}
+
+/* b stored k x n; panel element (p, j) at dst[p * nr + j] */
+static void pack_b_rows(const void* b, size_t ldb, uint32_t type, uint32_t columns, uint32_t kc,
+                        uint32_t nr, float* dst) {
+    float scratch[GEMM_NR_MAX];
+
+    for (uint32_t p = 0; p < kc; p++) {
+        const float* src = load_run(offset_operand(b, type, p * ldb), type, columns, scratch);
+
+        uint32_t j = 0;
+        for (; j < columns; j++) {
+            dst[j] = src[j];
+        }
+
+        for (; j < nr; j++) {
+            dst[j] = 0.f;
+        }
+
+        dst += nr;
+    }
+}
+
+/* b stored n x k (transposed) */
+static void pack_b_columns(const void* b, size_t ldb, uint32_t type, uint32_t columns, uint32_t kc,
+                           uint32_t nr, float* dst) {
+    float scratch[GEMM_KC_MAX];
+
+    for (uint32_t j = 0; j < nr; j++) {
+        if (j >= columns) {
+            for (uint32_t p = 0; p < kc; p++) {
+                dst[p * nr + j] = 0.f;
+            }
+
+            continue;
+        }
+
+        const float* column = load_run(offset_operand(b, type, j * ldb), type, kc, scratch);
+        for (uint32_t p = 0; p < kc; p++) {
+            dst[p * nr + j] = column[p];
+        }
+    }
+}
+
+static void pack_a_block(const struct gemm_params* params, const struct gemm_kernel* kernel,
+                         uint32_t i0, uint32_t mc, uint32_t p0, uint32_t kc, float* dst) {
+    bool transposed = params->flags & GEMM_TRANSPOSE_A;
+    uint32_t type = params->a_type;
+
+    for (uint32_t ir = 0; ir < mc; ir += kernel->mr) {
+        uint32_t rows = min_u32(kernel->mr, mc - ir);
+        uint32_t i = i0 + ir;
+
+        size_t start = transposed ? p0 * params->lda + i : i * params->lda + p0;
+        const void* a = offset_operand(params->a, type, start);
+
+        if (transposed) {
+            pack_a_columns(a, params->lda, type, rows, kc, kernel->mr, dst);
+        } else {
+            pack_a_rows(a, params->lda, type, rows, kc, kernel->mr, dst);
+        }
+
+        dst += kernel->mr * kc;
+    }
+}
+
+static void pack_b_block(const struct gemm_params* params, const struct gemm_kernel* kernel,
+                         uint32_t p0, uint32_t kc, uint32_t j0, uint32_t nc, float* dst) {
+    bool transposed = params->flags & GEMM_TRANSPOSE_B;
+    uint32_t type = params->b_type;
+
+    for (uint32_t jr = 0; jr < nc; jr += kernel->nr) {
+        uint32_t columns = min_u32(kernel->nr, nc - jr);
+        uint32_t j = j0 + jr;
+
+        size_t start = transposed ? j * params->ldb + p0 : p0 * params->ldb + j;
+        const void* b = offset_operand(params->b, type, start);
+
+        if (transposed) {
+            pack_b_columns(b, params->ldb, type, columns, kc, kernel->nr, dst);
+        } else {
+            pack_b_rows(b, params->ldb, type, columns, kc, kernel->nr, dst);
+        }
+
+        dst += kernel->nr * kc;
+    }
+}
+
+static void apply_activation(uint32_t activation, float* values, size_t count) {
+    switch (activation) {
+    case GEMM_ACTIVATION_RELU:
+        for (size_t i = 0; i < count; i++) {
+            values[i] = values[i] > 0.f ? values[i] : 0.f;
+        }
+
+        break;
+    case GEMM_ACTIVATION_SIGMOID:
+        vec_get_kernels()->sigmoid(values, values, count);
+        break;
+    default:
+        break;
+    }
+}
+
+/* writes count finished values of output row `row` starting at `column`. on the final k block the
+ * epilogue runs here, while the values are still in the (l1-resident) tile buffer */
+static void finish_row(const struct gemm_params* params, uint32_t row, uint32_t column,
+                       float* values, uint32_t count, bool accumulate, bool last) {
+    float* dst = params->c + row * params->ldc + column;
+
+    if (accumulate) {
+        for (uint32_t j = 0; j < count; j++) {
+            values[j] += dst[j];
+        }
+    }
+
+    const struct gemm_epilogue* epilogue = params->epilogue;
+    if (last && epilogue) {
+        if (epilogue->bias) {
+            float bias = epilogue->bias[row];
+            for (uint32_t j = 0; j < count; j++) {
+                values[j] += bias;
+            }
+        }
+
+        if (epilogue->z) {
+            memcpy(epilogue->z + row * epilogue->ldz + column, values, count * sizeof(float));
+        }
+
+        apply_activation(epilogue->activation, values, count);
+    }
+
+    memcpy(dst, values, count * sizeof(float));
+}
+
+static void run_blocked(const struct gemm_params* params, const struct gemm_kernel* kernel) {
+    struct gemm_buffers* buffers = get_buffers();
+    float tile[GEMM_MR_MAX * GEMM_NR_MAX] __attribute__((aligned(64)));
+
+    for (uint32_t jc = 0; jc < params->n; jc += kernel->nc) {
+        uint32_t nc = min_u32(kernel->nc, params->n - jc);
+
+        for (uint32_t pc = 0; pc < params->k; pc += kernel->kc) {
+            uint32_t kc = min_u32(kernel->kc, params->k - pc);
+            bool accumulate = pc > 0 || !(params->flags & GEMM_OVERWRITE);
+            bool last = pc + kc >= params->k;
+
+            gemm_micro_kernel_t micro = kc < kernel->kc ? kernel->micro_tail : kernel->micro;
+
+            pack_b_block(params, kernel, pc, kc, jc, nc, buffers->packed_b);
+
+            for (uint32_t ic = 0; ic < params->m; ic += kernel->mc) {
+                uint32_t mc = min_u32(kernel->mc, params->m - ic);
+                pack_a_block(params, kernel, ic, mc, pc, kc, buffers->packed_a);
+
+                for (uint32_t jr = 0; jr < nc; jr += kernel->nr) {
+                    const float* b_panel = buffers->packed_b + jr * kc;
+                    uint32_t columns = min_u32(kernel->nr, nc - jr);
+
+                    for (uint32_t ir = 0; ir < mc; ir += kernel->mr) {
+                        const float* a_panel = buffers->packed_a + ir * kc;
+                        uint32_t rows = min_u32(kernel->mr, mc - ir);
+
+                        micro(kc, a_panel, b_panel, tile);
+
+                        for (uint32_t i = 0; i < rows; i++) {
+                            finish_row(params, ic + ir + i, jc + jr, tile + i * kernel->nr,
+                                       columns, accumulate, last);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* n == 1: matrix-vector product. packing would waste all but one column of every b panel */
+static void run_gemv(const struct gemm_params* params) {
+    struct gemm_buffers* buffers = get_buffers();
+
+    /* gather x contiguously; stored as a column unless b is transposed */
+    float* x = buffers->packed_b;
+    for (uint32_t p = 0; p < params->k; p++) {
+        size_t index = params->flags & GEMM_TRANSPOSE_B ? p : p * params->ldb;
+        x[p] = load_element(params->b, params->b_type, index);
+    }
+
+    /* rows of a half precision a are widened here, past the end of x */
+    float* scratch = buffers->packed_b + GEMM_MC_MAX * GEMM_KC_MAX;
+
+    float* y = buffers->packed_a;
+    if (params->flags & GEMM_TRANSPOSE_A) {
+        /* a stored k x m: y += sum over rows of a scaled by x */
+        memset(y, 0, params->m * sizeof(float));
+
+        for (uint32_t p = 0; p < params->k; p++) {
+            const void* src = offset_operand(params->a, params->a_type, p * params->lda);
+            const float* row = load_run(src, params->a_type, params->m, scratch);
+            float xp = x[p];
+
+            for (uint32_t i = 0; i < params->m; i++) {
+                y[i] += row[i] * xp;
+            }
+        }
+    } else {
+        /* a stored m x k: one dot product per row, split into independent lanes */
+        for (uint32_t i = 0; i < params->m; i++) {
+            const void* src = offset_operand(params->a, params->a_type, i * params->lda);
+            const float* row = load_run(src, params->a_type, params->k, scratch);
+
+            float lanes[8] = { 0.f };
+            uint32_t p = 0;
+
+            for (; p + 8 <= params->k; p += 8) {
+                for (uint32_t l = 0; l < 8; l++) {
+                    lanes[l] += row[p + l] * x[p + l];
+                }
+            }
+
+            for (; p < params->k; p++) {
+                lanes[0] += row[p] * x[p];
+            }
+
+            y[i] = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                   ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        }
+    }
+
+    if (!(params->flags & GEMM_OVERWRITE)) {
+        for (uint32_t i = 0; i < params->m; i++) {
+            y[i] += params->c[i * params->ldc];
+        }
+    }
+
+    /* the output is a single column, so run the epilogue over all of it at once */
+    const struct gemm_epilogue* epilogue = params->epilogue;
+    if (epilogue) {
+        if (epilogue->bias) {
+            for (uint32_t i = 0; i < params->m; i++) {
+                y[i] += epilogue->bias[i];
+            }
+        }
+
+        if (epilogue->z) {
+            for (uint32_t i = 0; i < params->m; i++) {
+                epilogue->z[i * epilogue->ldz] = y[i];
+            }
+        }
+
+        apply_activation(epilogue->activation, y, params->m);
+    }
+
+    for (uint32_t i = 0; i < params->m; i++) {
+        params->c[i * params->ldc] = y[i];
+    }
+}
+
+/* k == 1: rank-1 update, e.g. an outer product of two vectors */
+static void run_outer(const struct gemm_params* params) {
+    struct gemm_buffers* buffers = get_buffers();
+
+    /* gather the single row of op(b) contiguously */
+    float* y = buffers->packed_b;
+    for (uint32_t j = 0; j < params->n; j++) {
+        size_t index = params->flags & GEMM_TRANSPOSE_B ? j * params->ldb : j;
+        y[j] = load_element(params->b, params->b_type, index);
+    }
+
+    float* row = buffers->packed_a;
+    bool accumulate = !(params->flags & GEMM_OVERWRITE);
+
+    for (uint32_t i = 0; i < params->m; i++) {
+        size_t index = params->flags & GEMM_TRANSPOSE_A ? i : i * params->lda;
+        float xi = load_element(params->a, params->a_type, index);
+        for (uint32_t j = 0; j < params->n; j++) {
+            row[j] = xi * y[j];
+        }
+
+        finish_row(params, i, 0, row, params->n, accumulate, true);
+    }
+}
+
+/* splits the output into a grid of blocks aligned to the micro-tile. blocks are sized from the
+ * shape alone so the partition is the same whatever the thread count */
+struct gemm_partition {
+    const struct gemm_params* params;
+    const struct gemm_kernel* kernel;
+
+    uint32_t block_m, block_n;
+    uint32_t blocks_m, blocks_n;
+};
+
+static void run_partition_block(void* user, uint32_t index, uint32_t worker) {
+    const struct gemm_partition* partition = user;
+    const struct gemm_params* params = partition->params;
+
+    uint32_t i0 = (index / partition->blocks_n) * partition->block_m;
+    uint32_t j0 = (index % partition->blocks_n) * partition->block_n;
+
+    struct gemm_params block = *params;
+    block.m = min_u32(partition->block_m, params->m - i0);
+    block.n = min_u32(partition->block_n, params->n - j0);
+
+    size_t a_start = params->flags & GEMM_TRANSPOSE_A ? i0 : i0 * params->lda;
+    size_t b_start = params->flags & GEMM_TRANSPOSE_B ? j0 * params->ldb : j0;
+
+    block.a = offset_operand(params->a, params->a_type, a_start);
+    block.b = offset_operand(params->b, params->b_type, b_start);
+    block.c += i0 * params->ldc + j0;
+
+    struct gemm_epilogue epilogue;
+    if (params->epilogue) {
+        epilogue = *params->epilogue;
+        if (epilogue.bias) {
+            epilogue.bias += i0;
+        }
+
+        if (epilogue.z) {
+            epilogue.z += i0 * epilogue.ldz + j0;
+        }
+
+        block.epilogue = &epilogue;
+    }
+
+    run_blocked(&block, partition->kernel);
+}
+
+static uint32_t round_up(uint32_t value, uint32_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static void run_parallel(const struct gemm_params* params, const struct gemm_kernel* kernel) {
+    uint64_t work = (uint64_t)params->m * params->n * params->k;
+    uint64_t blocks = (work + GEMM_PARALLEL_BLOCK_WORK - 1) / GEMM_PARALLEL_BLOCK_WORK;
+
+    struct gemm_partition partition;
+    partition.params = params;
+    partition.kernel = kernel;
+
+    /* split the longer output dimension first, keeping blocks whole micro-tiles */
+    if (params->n >= params->m) {
+        partition.block_m = params->m;
+        partition.block_n = round_up((uint32_t)((params->n + blocks - 1) / blocks), kernel->nr);
+    } else {
+        partition.block_n = params->n;
+        partition.block_m = round_up((uint32_t)((params->m + blocks - 1) / blocks), kernel->mr);
+    }
+
+    partition.blocks_m = (params->m + partition.block_m - 1) / partition.block_m;
+    partition.blocks_n = (params->n + partition.block_n - 1) / partition.block_n;
+
+    uint32_t task_count = partition.blocks_m * partition.blocks_n;
+    pool_run(params->pool, task_count, run_partition_block, &partition);
+}
+
+/* products that gemm_run handles without packing, and so without a micro-kernel */
+static bool is_gemv(uint32_t m, uint32_t n, uint32_t k) {
+    return n == 1 && k <= GEMM_SCRATCH_SIZE && m <= GEMM_SCRATCH_SIZE;
+}
+
+static bool is_outer(uint32_t n, uint32_t k) { return k == 1 && n <= GEMM_SCRATCH_SIZE; }
+
+struct gemm_plan {
+    uint32_t flags;
+    uint32_t m, n, k;
+
+    /* the detected kernel's blocking, with generated micro-kernels */
+    struct gemm_kernel kernel;
+    jit_code_t* code;
+};
+
+#ifdef GEMM_JIT
+/* steps of the k loop per iteration of a generated loop. blocks of up to GEMM_JIT_FULL_UNROLL steps
+ * are unrolled entirely */
+#define GEMM_JIT_UNROLL 4
+#define GEMM_JIT_FULL_UNROLL 16
+
+/* register allocation: accumulators for row i in 2i and 2i + 1, then the two b vectors, then (for
+ * avx2) the broadcast a element. rsi walks a and rdx walks b, as passed */
+static void emit_step(jit_code_t* code, const struct gemm_kernel* kernel, uint32_t width,
+                      uint32_t step) {
+    uint32_t lanes = width == JIT_WIDTH_512 ? 16 : 8;
+    uint32_t b0 = kernel->mr * 2;
+    uint32_t b1 = b0 + 1;
+
+    int32_t a = (int32_t)(step * kernel->mr * sizeof(float));
+    int32_t b = (int32_t)(step * kernel->nr * sizeof(float));
+
+    jit_vec_load(code, width, b0, JIT_RDX, b);
+    jit_vec_load(code, width, b1, JIT_RDX, b + (int32_t)(lanes * sizeof(float)));
+
+    /* the same multiply-adds in the same order as the intrinsic kernels, so results match them
+     * bit for bit */
+    for (uint32_t i = 0; i < kernel->mr; i++) {
+        int32_t element = a + (int32_t)(i * sizeof(float));
+
+        if (width == JIT_WIDTH_512) {
+            jit_vec_fmadd_broadcast(code, width, i * 2, b0, JIT_RSI, element);
+            jit_vec_fmadd_broadcast(code, width, i * 2 + 1, b1, JIT_RSI, element);
+        } else {
+            uint32_t ai = b1 + 1;
+
+            jit_vec_broadcast(code, width, ai, JIT_RSI, element);
+            jit_vec_fmadd(code, width, i * 2, ai, b0);
+            jit_vec_fmadd(code, width, i * 2 + 1, ai, b1);
+        }
+    }
+}
+
+/* a micro-kernel for exactly kc steps; the kc argument is ignored. returns its offset in code */
+static size_t emit_micro(jit_code_t* code, const struct gemm_kernel* kernel, uint32_t width,
+                         uint32_t kc) {
+    uint32_t lanes = width == JIT_WIDTH_512 ? 16 : 8;
+    assert(kernel->nr == lanes * 2);
+
+    size_t entry = jit_get_offset(code);
+    for (uint32_t i = 0; i < kernel->mr * 2; i++) {
+        jit_vec_zero(code, width, i);
+    }
+
+    if (kc <= GEMM_JIT_FULL_UNROLL) {
+        for (uint32_t p = 0; p < kc; p++) {
+            emit_step(code, kernel, width, p);
+        }
+    } else {
+        jit_mov_imm(code, JIT_RAX, kc / GEMM_JIT_UNROLL);
+
+        size_t loop = jit_get_offset(code);
+        for (uint32_t p = 0; p < GEMM_JIT_UNROLL; p++) {
+            emit_step(code, kernel, width, p);
+        }
+
+        jit_add_imm(code, JIT_RSI, (int32_t)(GEMM_JIT_UNROLL * kernel->mr * sizeof(float)));
+        jit_add_imm(code, JIT_RDX, (int32_t)(GEMM_JIT_UNROLL * kernel->nr * sizeof(float)));
+        jit_loop(code, JIT_RAX, loop);
+
+        for (uint32_t p = 0; p < kc % GEMM_JIT_UNROLL; p++) {
+            emit_step(code, kernel, width, p);
+        }
+    }
+
+    for (uint32_t i = 0; i < kernel->mr * 2; i++) {
+        int32_t offset = (int32_t)((i / 2 * kernel->nr + i % 2 * lanes) * sizeof(float));
+        jit_vec_store(code, width, JIT_RCX, offset, i);
+    }
+
+    jit_vzeroupper(code);
+    jit_ret(code);
+
+    return entry;
+}
+
+static size_t get_micro_code_size(const struct gemm_kernel* kernel) {
+    uint32_t steps = GEMM_JIT_FULL_UNROLL > GEMM_JIT_UNROLL * 2 ? GEMM_JIT_FULL_UNROLL
+                                                                : GEMM_JIT_UNROLL * 2;
+
+    /* zeroing and stores, at most three instructions per row per step, and the loop */
+    size_t instructions = kernel->mr * 4 + steps * (2 + kernel->mr * 3) + 8;
+    return instructions * JIT_MAX_INSTRUCTION_SIZE;
+}
+
+static bool generate_kernels(gemm_plan_t* plan, const struct gemm_kernel* base, uint32_t width) {
+    plan->code = jit_alloc(get_micro_code_size(base) * 2);
+    if (!plan->code) {
+        return false;
+    }
+
+    uint32_t tail_kc = plan->k % base->kc;
+
+    size_t micro = 0, tail = 0;
+    if (plan->k >= base->kc) {
+        micro = emit_micro(plan->code, base, width, base->kc);
+    }
+
+    if (tail_kc > 0) {
+        tail = emit_micro(plan->code, base, width, tail_kc);
+    }
+
+    if (!jit_finalize(plan->code)) {
+        return false;
+    }
+
+    /* a product shorter than kc only ever runs its tail */
+    gemm_micro_kernel_t micro_entry = jit_get_entry(plan->code, plan->k >= base->kc ? micro : tail);
+    gemm_micro_kernel_t tail_entry = tail_kc > 0 ? jit_get_entry(plan->code, tail) : micro_entry;
+
+    plan->kernel = *base;
+    plan->kernel.name = "jit";
+    plan->kernel.micro = micro_entry;
+    plan->kernel.micro_tail = tail_entry;
+
+    return true;
+}
+#endif
+
+gemm_plan_t* gemm_plan_alloc(uint32_t flags, uint32_t m, uint32_t n, uint32_t k) {
+#ifdef GEMM_JIT
+    if (m == 0 || n == 0 || k == 0 || is_gemv(m, n, k) || is_outer(n, k)) {
+        return NULL;
+    }
+
+    const struct gemm_kernel* base = get_kernel();
+
+    uint32_t width;
+    if (base == &s_avx512_kernel) {
+        width = JIT_WIDTH_512;
+    } else if (base == &s_avx2_kernel) {
+        width = JIT_WIDTH_256;
+    } else {
+        return NULL;
+    }
+
+    gemm_plan_t* plan = nv_alloc(sizeof(gemm_plan_t));
+    assert(plan);
+
+    plan->flags = flags & (GEMM_TRANSPOSE_A | GEMM_TRANSPOSE_B);
+    plan->m = m;
+    plan->n = n;
+    plan->k = k;
+
+    if (!generate_kernels(plan, base, width)) {
+        gemm_plan_free(plan);
+        return NULL;
+    }
+
+    NV_LOG_TRACE("gemm: generated %s kernels for %ux%ux%u%s%s", base->name, m, n, k,
+                 (flags & GEMM_TRANSPOSE_A) ? " (a transposed)" : "",
+                 (flags & GEMM_TRANSPOSE_B) ? " (b transposed)" : "");
+
+    return plan;
+#else
+    (void)flags;
+    (void)m;
+    (void)n;
+    (void)k;
+
+    return NULL;
+#endif
+}
+
+void gemm_plan_free(gemm_plan_t* plan) {
+    if (!plan) {
+        return;
+    }
+
+    jit_free(plan->code);
+    nv_free(plan);
+}
+
+static const struct gemm_kernel* get_plan_kernel(const struct gemm_params* params) {
+    const gemm_plan_t* plan = params->plan;
+    if (!plan) {
+        return get_kernel();
+    }
+
+    uint32_t transposes = params->flags & (GEMM_TRANSPOSE_A | GEMM_TRANSPOSE_B);
+    if (plan->flags != transposes || plan->m != params->m || plan->n != params->n ||
+        plan->k != params->k) {
+        return get_kernel();
+    }
+
+    return &plan->kernel;
+}
+
+void gemm_run(const struct gemm_params* params) {
+    if (params->m == 0 || params->n == 0) {
+        return;
+    }
+
+    if (params->k == 0) {
+        /* nothing to multiply; finish the rows so that the epilogue still applies */
+        float* row = get_buffers()->packed_a;
+        bool accumulate = !(params->flags & GEMM_OVERWRITE);
+
+        for (uint32_t i = 0; i < params->m; i++) {
+            for (uint32_t j = 0; j < params->n; j += GEMM_NC_MAX) {
+                uint32_t count = min_u32(GEMM_NC_MAX, params->n - j);
+
+                memset(row, 0, count * sizeof(float));
+                finish_row(params, i, j, row, count, accumulate, true);
+            }
+        }
+
+        return;
+    }
+
+    if (is_gemv(params->m, params->n, params->k)) {
+        run_gemv(params);
+        return;
+    }
+
+    if (is_outer(params->n, params->k)) {
+        run_outer(params);
+        return;
+    }
+
+    const struct gemm_kernel* kernel = get_plan_kernel(params);
+
+    uint64_t work = (uint64_t)params->m * params->n * params->k;
+    if (params->pool && work >= GEMM_PARALLEL_MIN_WORK) {
+        run_parallel(params, kernel);
+    } else {
+        run_blocked(params, kernel);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef _GEMM_H
+#define _GEMM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    GEMM_TRANSPOSE_A = (1 << 0),
+    GEMM_TRANSPOSE_B = (1 << 1),
+
+    /* c = op(a) * op(b) instead of c += op(a) * op(b) */
+    GEMM_OVERWRITE = (1 << 2),
+};
+
+enum {
+    GEMM_ACTIVATION_NONE = 0,
+    GEMM_ACTIVATION_RELU,
+    GEMM_ACTIVATION_SIGMOID,
+};
+
+/* storage of a and b. half precision operands are widened to fp32 as they are packed, so the
+ * product always accumulates in fp32 */
+enum {
+    GEMM_TYPE_F32 = 0,
+    GEMM_TYPE_BF16,
+    GEMM_TYPE_F16,
+};
+
+/* applied to each finished output tile before it is written back: c = A(product + bias). bias has
+ * one entry per row of c and is broadcast across columns. z, if not NULL, receives the values
+ * before the activation */
+struct gemm_epilogue {
+    const float* bias;
+    uint32_t activation;
+
+    float* z;
+    size_t ldz;
+};
+
+/* from pool.h */
+struct thread_pool;
+
+/* a product shape specialized at runtime. on x86-64 with avx2 or avx-512 the micro-kernels are
+ * generated into executable memory for exactly this k (no loop bounds to test beyond a constant
+ * trip count, unrolled, with the detected kernel's tile), and run in place of the built-in ones.
+ * results are bit-identical to the built-in kernels */
+typedef struct gemm_plan gemm_plan_t;
+
+/* flags are GEMM_TRANSPOSE_*. NULL when no code can be generated (another architecture, an older
+ * cpu, executable memory refused) or the shape never reaches a micro-kernel; gemm_run then uses
+ * the built-in kernels, which is always correct */
+gemm_plan_t* gemm_plan_alloc(uint32_t flags, uint32_t m, uint32_t n, uint32_t k);
+void gemm_plan_free(gemm_plan_t* plan);
+
+/* row-major product of an m x k and a k x n matrix into fp32 c. a and b are stored transposed
+ * (k x m and n x k respectively) when the matching GEMM_TRANSPOSE_* flag is set, in the GEMM_TYPE_*
+ * given by a_type and b_type. lda, ldb and ldc are the distance in elements between consecutive
+ * stored rows. large products are split into output blocks across pool if one is given; the split
+ * only depends on the shape, and every output element is reduced in the same order, so results do
+ * not depend on the thread count */
+struct gemm_params {
+    uint32_t flags;
+    uint32_t m, n, k;
+
+    const void* a;
+    size_t lda;
+    uint32_t a_type;
+
+    const void* b;
+    size_t ldb;
+    uint32_t b_type;
+
+    float* c;
+    size_t ldc;
+
+    /* NULL for a plain product */
+    const struct gemm_epilogue* epilogue;
+
+    /* used when its shape and transposes match this product exactly; otherwise (or NULL) the
+     * built-in kernels run */
+    const gemm_plan_t* plan;
+
+    struct thread_pool* pool;
+};
+
+void gemm_run(const struct gemm_params* params);
+
+#endif
@@ -0,0 +1,137 @@
+#include "half.h"
+
+#include "cpu.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HALF_X86
+#endif
+
+float half_f16_to_float(uint16_t value) {
+    uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0) {
+        /* zero or subnormal: mantissa * 2^-24 is exact in fp32 */
+        float magnitude = ldexpf((float)mantissa, -24);
+        return sign ? -magnitude : magnitude;
+    } else if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+uint16_t half_float_to_f16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    if (bits >= 0x7f800000) {
+        /* inf stays inf, nan stays a (quiet) nan */
+        return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+    }
+
+    if (bits >= 0x47800000) {
+        /* 2^16 and up overflows */
+        return sign | 0x7c00;
+    }
+
+    if (bits < 0x38800000) {
+        /* below the smallest normal f16: adding 0.5 lines the f16 subnormal unit up with the fp32
+         * ulp, so the fpu does the rounding */
+        static const uint32_t magic_bits = 126u << 23;
+
+        float magic, magnitude;
+        memcpy(&magic, &magic_bits, sizeof(float));
+        memcpy(&magnitude, &bits, sizeof(float));
+
+        magnitude += magic;
+        memcpy(&bits, &magnitude, sizeof(float));
+
+        return sign | (uint16_t)(bits - magic_bits);
+    }
+
+    /* rebias the exponent and round the 13 dropped mantissa bits to nearest even. a carry out of
+     * the mantissa correctly bumps the exponent, up to infinity */
+    uint32_t odd = (bits >> 13) & 1;
+    bits += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+
+    return sign | (uint16_t)(bits >> 13);
+}
+
+#ifdef HALF_X86
+__attribute__((target("avx,f16c"))) static size_t f16_to_floats_f16c(float* dst,
+                                                                     const uint16_t* src,
+                                                                     size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx,f16c"))) static size_t floats_to_f16_f16c(uint16_t* dst,
+                                                                     const float* src,
+                                                                     size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(dst + i), h);
+    }
+
+    return i;
+}
+#endif
+
+void half_bf16_to_floats(float* dst, const uint16_t* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = half_bf16_to_float(src[i]);
+    }
+}
+
+void half_f16_to_floats(float* dst, const uint16_t* src, size_t count) {
+    size_t i = 0;
+
+#ifdef HALF_X86
+    if (cpu_has_features(CPU_FEATURE_F16C)) {
+        i = f16_to_floats_f16c(dst, src, count);
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = half_f16_to_float(src[i]);
+    }
+}
+
+void half_floats_to_bf16(uint16_t* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = half_float_to_bf16(src[i]);
+    }
+}
+
+void half_floats_to_f16(uint16_t* dst, const float* src, size_t count) {
+    size_t i = 0;
+
+#ifdef HALF_X86
+    if (cpu_has_features(CPU_FEATURE_F16C)) {
+        i = floats_to_f16_f16c(dst, src, count);
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = half_float_to_f16(src[i]);
+    }
+}
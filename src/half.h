@@ -0,0 +1,42 @@
+#ifndef _HALF_H
+#define _HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* 16-bit float storage. bf16 is the upper half of an fp32 (same range, 8 bits of mantissa); f16 is
+ * ieee binary16 (5 bit exponent, 11 bits of mantissa). narrowing rounds to nearest even */
+
+static inline float half_bf16_to_float(uint16_t value) {
+    uint32_t bits = (uint32_t)value << 16;
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+static inline uint16_t half_float_to_bf16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    /* keep nans quiet instead of letting rounding carry them into infinity */
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (uint16_t)((bits >> 16) | 0x40);
+    }
+
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+float half_f16_to_float(uint16_t value);
+uint16_t half_float_to_f16(float value);
+
+/* bulk conversions. the f16 ones use f16c where the cpu has it */
+void half_bf16_to_floats(float* dst, const uint16_t* src, size_t count);
+void half_f16_to_floats(float* dst, const uint16_t* src, size_t count);
+
+void half_floats_to_bf16(uint16_t* dst, const float* src, size_t count);
+void half_floats_to_f16(uint16_t* dst, const float* src, size_t count);
+
+#endif
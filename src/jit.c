@@ -0,0 +1,291 @@
+#include "jit.h"
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+struct jit_code {
+    uint8_t* buffer;
+    size_t size, capacity;
+
+    /* the executable copy, once finalized */
+    void* pages;
+    size_t pages_size;
+};
+
+jit_code_t* jit_alloc(size_t capacity) {
+#ifndef __x86_64__
+    (void)capacity;
+    return NULL;
+#else
+    jit_code_t* code = nv_alloc(sizeof(jit_code_t) + capacity);
+    assert(code);
+
+    code->buffer = (void*)code + sizeof(jit_code_t);
+    code->size = 0;
+    code->capacity = capacity;
+
+    code->pages = NULL;
+    code->pages_size = 0;
+
+    return code;
+#endif
+}
+
+void jit_free(jit_code_t* code) {
+    if (!code) {
+        return;
+    }
+
+    if (code->pages) {
+        munmap(code->pages, code->pages_size);
+    }
+
+    nv_free(code);
+}
+
+size_t jit_get_offset(const jit_code_t* code) { return code->size; }
+
+static void emit_byte(jit_code_t* code, uint8_t value) {
+    assert(!code->pages);
+    assert(code->size < code->capacity);
+
+    code->buffer[code->size++] = value;
+}
+
+static void emit_u32(jit_code_t* code, uint32_t value) {
+    for (uint32_t i = 0; i < 4; i++) {
+        emit_byte(code, (uint8_t)(value >> (i * 8)));
+    }
+}
+
+/* opcode maps and mandatory prefixes, as vex and evex encode them */
+enum {
+    MAP_0F = 1,
+    MAP_0F38 = 2,
+};
+
+enum {
+    PREFIX_NONE = 0,
+    PREFIX_66 = 1,
+};
+
+/* the modrm (and displacement) of either a register or a [base + disp32] operand. rsp and r12 as a
+ * base would need a sib byte, which nothing here uses */
+struct operand {
+    bool memory;
+    uint32_t reg;
+    int32_t disp;
+};
+
+static struct operand reg_operand(uint32_t reg) {
+    struct operand operand = { false, reg, 0 };
+    return operand;
+}
+
+static struct operand mem_operand(uint32_t base, int32_t disp) {
+    assert((base & 7) != 4);
+
+    struct operand operand = { true, base, disp };
+    return operand;
+}
+
+static void emit_modrm(jit_code_t* code, uint32_t reg, const struct operand* rm) {
+    uint8_t mod = rm->memory ? 2 : 3;
+    emit_byte(code, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm->reg & 7)));
+
+    if (rm->memory) {
+        emit_u32(code, (uint32_t)rm->disp);
+    }
+}
+
+/* always the three byte form, which encodes every map */
+static void emit_vex(jit_code_t* code, uint32_t map, uint32_t prefix, uint8_t opcode,
+                     uint32_t reg, uint32_t vvvv, const struct operand* rm) {
+    assert(reg < 16 && vvvv < 16 && rm->reg < 16);
+
+    /* r, x and b are stored inverted. x would extend an index register */
+    uint8_t r = (reg & 8) ? 0 : 0x80;
+    uint8_t b = (rm->reg & 8) ? 0 : 0x20;
+
+    emit_byte(code, 0xc4);
+    emit_byte(code, (uint8_t)(r | 0x40 | b | map));
+
+    /* w = 0, l = 1 (256 bits) */
+    emit_byte(code, (uint8_t)((~vvvv & 0xf) << 3 | 0x04 | prefix));
+    emit_byte(code, opcode);
+
+    emit_modrm(code, reg, rm);
+}
+
+static void emit_evex(jit_code_t* code, uint32_t map, uint32_t prefix, uint8_t opcode,
+                      uint32_t reg, uint32_t vvvv, const struct operand* rm, bool broadcast) {
+    assert(reg < 32 && vvvv < 32);
+    assert(rm->memory ? rm->reg < 16 : rm->reg < 32);
+    assert(!broadcast || rm->memory);
+
+    /* p0: r x b r' 0 0 m m, inverted. with a register operand x holds its fifth bit */
+    uint8_t p0 = (uint8_t)map;
+    p0 |= (reg & 8) ? 0 : 0x80;
+    p0 |= (!rm->memory && (rm->reg & 16)) ? 0 : 0x40;
+    p0 |= (rm->reg & 8) ? 0 : 0x20;
+    p0 |= (reg & 16) ? 0 : 0x10;
+
+    /* p1: w vvvv 1 p p, vvvv inverted */
+    uint8_t p1 = (uint8_t)((~vvvv & 0xf) << 3 | 0x04 | prefix);
+
+    /* p2: z l'l b v' a a a. l'l = 2 (512 bits), v' inverted, no masking */
+    uint8_t p2 = 0x40;
+    p2 |= broadcast ? 0x10 : 0;
+    p2 |= (vvvv & 16) ? 0 : 0x08;
+
+    emit_byte(code, 0x62);
+    emit_byte(code, p0);
+    emit_byte(code, p1);
+    emit_byte(code, p2);
+    emit_byte(code, opcode);
+
+    /* disp32 is never scaled, unlike the compressed disp8 */
+    emit_modrm(code, reg, rm);
+}
+
+static void emit_vector(jit_code_t* code, uint32_t width, uint32_t map, uint32_t prefix,
+                        uint8_t opcode, uint32_t reg, uint32_t vvvv, const struct operand* rm) {
+    if (width == JIT_WIDTH_512) {
+        emit_evex(code, map, prefix, opcode, reg, vvvv, rm, false);
+    } else {
+        emit_vex(code, map, prefix, opcode, reg, vvvv, rm);
+    }
+}
+
+void jit_vec_zero(jit_code_t* code, uint32_t width, uint32_t vector) {
+    struct operand rm = reg_operand(vector);
+
+    if (width == JIT_WIDTH_512) {
+        /* vpxord; vxorps on zmm needs avx512dq */
+        emit_evex(code, MAP_0F, PREFIX_66, 0xef, vector, vector, &rm, false);
+    } else {
+        /* vxorps */
+        emit_vex(code, MAP_0F, PREFIX_NONE, 0x57, vector, vector, &rm);
+    }
+}
+
+void jit_vec_load(jit_code_t* code, uint32_t width, uint32_t vector, uint32_t base, int32_t disp) {
+    /* vmovups */
+    struct operand rm = mem_operand(base, disp);
+    emit_vector(code, width, MAP_0F, PREFIX_NONE, 0x10, vector, 0, &rm);
+}
+
+void jit_vec_store(jit_code_t* code, uint32_t width, uint32_t base, int32_t disp, uint32_t vector) {
+    /* vmovups */
+    struct operand rm = mem_operand(base, disp);
+    emit_vector(code, width, MAP_0F, PREFIX_NONE, 0x11, vector, 0, &rm);
+}
+
+void jit_vec_broadcast(jit_code_t* code, uint32_t width, uint32_t vector, uint32_t base,
+                       int32_t disp) {
+    assert(width == JIT_WIDTH_256);
+
+    /* vbroadcastss */
+    struct operand rm = mem_operand(base, disp);
+    emit_vex(code, MAP_0F38, PREFIX_66, 0x18, vector, 0, &rm);
+}
+
+void jit_vec_fmadd(jit_code_t* code, uint32_t width, uint32_t dst, uint32_t lhs, uint32_t rhs) {
+    /* vfmadd231ps */
+    struct operand rm = reg_operand(rhs);
+    emit_vector(code, width, MAP_0F38, PREFIX_66, 0xb8, dst, lhs, &rm);
+}
+
+void jit_vec_fmadd_broadcast(jit_code_t* code, uint32_t width, uint32_t dst, uint32_t lhs,
+                             uint32_t base, int32_t disp) {
+    assert(width == JIT_WIDTH_512);
+
+    /* vfmadd231ps with a {1to16} memory operand */
+    struct operand rm = mem_operand(base, disp);
+    emit_evex(code, MAP_0F38, PREFIX_66, 0xb8, dst, lhs, &rm, true);
+}
+
+void jit_mov_imm(jit_code_t* code, uint32_t reg, uint32_t value) {
+    /* mov r32, imm32; zero extends */
+    if (reg & 8) {
+        emit_byte(code, 0x41);
+    }
+
+    emit_byte(code, (uint8_t)(0xb8 + (reg & 7)));
+    emit_u32(code, value);
+}
+
+void jit_add_imm(jit_code_t* code, uint32_t reg, int32_t value) {
+    /* add r64, imm32 */
+    emit_byte(code, (reg & 8) ? 0x49 : 0x48);
+    emit_byte(code, 0x81);
+    emit_byte(code, (uint8_t)(0xc0 | (reg & 7)));
+    emit_u32(code, (uint32_t)value);
+}
+
+void jit_loop(jit_code_t* code, uint32_t reg, size_t target) {
+    assert(target <= code->size);
+
+    /* dec r32 */
+    if (reg & 8) {
+        emit_byte(code, 0x41);
+    }
+
+    emit_byte(code, 0xff);
+    emit_byte(code, (uint8_t)(0xc8 | (reg & 7)));
+
+    /* jnz rel32, relative to the end of the jump */
+    emit_byte(code, 0x0f);
+    emit_byte(code, 0x85);
+
+    int64_t rel = (int64_t)target - (int64_t)(code->size + 4);
+    emit_u32(code, (uint32_t)(int32_t)rel);
+}
+
+void jit_vzeroupper(jit_code_t* code) {
+    emit_byte(code, 0xc5);
+    emit_byte(code, 0xf8);
+    emit_byte(code, 0x77);
+}
+
+void jit_ret(jit_code_t* code) { emit_byte(code, 0xc3); }
+
+bool jit_finalize(jit_code_t* code) {
+    assert(!code->pages);
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (code->size + page_size - 1) / page_size * page_size;
+
+    void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+        NV_LOG_WARN("jit: failed to map %zu bytes of code", size);
+        return false;
+    }
+
+    memcpy(pages, code->buffer, code->size);
+
+    /* may be refused, e.g. under a policy that forbids executable anonymous memory */
+    if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0) {
+        NV_LOG_WARN("jit: failed to make generated code executable");
+        munmap(pages, size);
+        return false;
+    }
+
+    code->pages = pages;
+    code->pages_size = size;
+
+    NV_LOG_TRACE("jit: finalized %zu bytes of code", code->size);
+    return true;
+}
+
+void* jit_get_entry(const jit_code_t* code, size_t offset) {
+    assert(code->pages);
+    assert(offset < code->size);
+
+    return (uint8_t*)code->pages + offset;
+}
@@ -0,0 +1,76 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* a minimal x86-64 assembler for generated kernels: just the instructions the gemm micro-kernels
+ * need. code is emitted into an ordinary buffer and only copied into fresh pages, which are then
+ * made executable, by jit_finalize; no page is ever writable and executable at once. every memory
+ * operand is [base + disp32] */
+
+/* general purpose registers, by encoding */
+enum {
+    JIT_RAX = 0,
+    JIT_RCX = 1,
+    JIT_RDX = 2,
+    JIT_RSI = 6,
+    JIT_RDI = 7,
+};
+
+/* vector register widths. 256-bit instructions are vex encoded (avx2 and fma, ymm0-15); 512-bit
+ * ones are evex encoded (avx-512f, zmm0-31) */
+enum {
+    JIT_WIDTH_256 = 0,
+    JIT_WIDTH_512,
+};
+
+/* the longest x86 instruction, for sizing buffers */
+#define JIT_MAX_INSTRUCTION_SIZE 15
+
+typedef struct jit_code jit_code_t;
+
+/* NULL where generated code cannot run, i.e. anywhere but x86-64. capacity bounds the bytes that
+ * may be emitted */
+jit_code_t* jit_alloc(size_t capacity);
+void jit_free(jit_code_t* code);
+
+/* where the next instruction goes, for entry points and branch targets */
+size_t jit_get_offset(const jit_code_t* code);
+
+/* vector = 0 */
+void jit_vec_zero(jit_code_t* code, uint32_t width, uint32_t vector);
+
+/* unaligned loads and stores */
+void jit_vec_load(jit_code_t* code, uint32_t width, uint32_t vector, uint32_t base, int32_t disp);
+void jit_vec_store(jit_code_t* code, uint32_t width, uint32_t base, int32_t disp, uint32_t vector);
+
+/* every lane of vector = the float at [base + disp]. JIT_WIDTH_256 only; evex code broadcasts in
+ * the fma instead */
+void jit_vec_broadcast(jit_code_t* code, uint32_t width, uint32_t vector, uint32_t base,
+                       int32_t disp);
+
+/* dst += lhs * rhs, rounded once */
+void jit_vec_fmadd(jit_code_t* code, uint32_t width, uint32_t dst, uint32_t lhs, uint32_t rhs);
+
+/* dst += lhs * (the float at [base + disp], broadcast). JIT_WIDTH_512 only */
+void jit_vec_fmadd_broadcast(jit_code_t* code, uint32_t width, uint32_t dst, uint32_t lhs,
+                             uint32_t base, int32_t disp);
+
+void jit_mov_imm(jit_code_t* code, uint32_t reg, uint32_t value);
+void jit_add_imm(jit_code_t* code, uint32_t reg, int32_t value);
+
+/* decrements reg (32 bits) and branches back to target, an earlier offset, unless it hit zero */
+void jit_loop(jit_code_t* code, uint32_t reg, size_t target);
+
+void jit_vzeroupper(jit_code_t* code);
+void jit_ret(jit_code_t* code);
+
+/* copies the code into executable pages. nothing may be emitted afterwards */
+bool jit_finalize(jit_code_t* code);
+
+/* the function at offset; code must be finalized */
+void* jit_get_entry(const jit_code_t* code, size_t offset);
+
+#endif
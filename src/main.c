@@ -2,13 +2,23 @@
 #include "model.h"
 
 #include "prng.h"
+#include "pool.h"
+#include "quant.h"
+#include "train.h"
+#include "checkpoint.h"
+#include "optim.h"
+#include "compile.h"
+#include "eval.h"
+#include "serve.h"
 
 #include "data/dataset.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <nyoravim/mem.h>
 #include <nyoravim/map.h>
@@ -27,7 +37,7 @@ static void draw_matrix(const matrix_t* mat) {
 
         /* over columns */
         for (uint32_t x = 0; x < mat->columns; x++) {
-            float value = mat->data[y * mat->columns + x];
+            float value = mat_row(mat, y)[x];
 
             /* 24 steps w/ offset of 232. see
              * https://gist.github.com/fnky/458719343aabd01cfb17a3a4f7296797 */
@@ -161,23 +171,80 @@ static model_t* create_model(const struct nv_allocator* alloc, const char* path)
     return model;
 }
 
-static model_t* open_model(const struct nv_allocator* alloc, const char* path) {
+/* existing models are mapped rather than read; flags are MODEL_MAP_* */
+static model_t* open_model(const struct nv_allocator* alloc, const char* path, uint32_t flags) {
     if (file_exists(path)) {
-        NV_LOG_INFO("file %s exists; reading", path);
-        return model_read_from_path(alloc, path);
+        NV_LOG_INFO("file %s exists; mapping", path);
+        return model_map_from_path(alloc, path, flags);
     } else {
         NV_LOG_INFO("file %s does not exist; creating new model and writing", path);
         return create_model(alloc, path);
     }
 }
 
-enum { MODE_TRAINING, MODE_EVAL };
+enum {
+    MODE_TRAINING,
+    MODE_EVAL,
+    MODE_CONVERT,
+    MODE_QUANTIZE,
+    MODE_COMPARE,
+    MODE_COMPILE,
+    MODE_PRUNE,
+    MODE_FACTORIZE,
+    MODE_SERVE,
+};
 
 struct program_params {
     uint32_t mode;
     char* model_path;
+    char* output_path;
     uint32_t cluster_size;
     float training_threshold;
+    float learning_rate;
+
+    /* MAT_TYPE_* to store weights as, if precision was given */
+    char* precision;
+    uint32_t weight_type;
+
+    /* OPTIM_* to train with */
+    char* optimizer;
+    uint32_t optimizer_type;
+    float momentum;
+
+    /* checkpoint optimizer state beside the model, and resume from it */
+    bool save_optimizer;
+
+    uint32_t thread_count;
+    bool deterministic;
+
+    /* images per forward pass when evaluating, and at most that when serving */
+    uint32_t eval_batch_size;
+
+    /* unix socket to serve on; stdin and stdout if not given */
+    char* socket_path;
+
+    /* microseconds a served image may take, waiting for its batch included */
+    uint32_t max_delay;
+    bool async;
+
+    /* clusters between checkpoints while training; 0 only checkpoints after each phase */
+    uint32_t checkpoint_interval;
+
+    /* test images used to calibrate activation ranges when quantizing */
+    uint32_t calibration_size;
+
+    /* prefix of everything a compiled model defines */
+    char* compile_name;
+
+    /* fraction of each hidden layer's weights to prune */
+    float sparsity;
+
+    /* rank to factorize layers to; 0 picks each layer's from energy */
+    uint32_t rank;
+    float energy;
+
+    /* comma-separated indices of the layers to factorize; every hidden layer if not given */
+    char* factor_layers;
 };
 
 static bool parse_program_mode(const char* name, uint32_t* mode) {
@@ -195,17 +262,215 @@ static bool parse_program_mode(const char* name, uint32_t* mode) {
         return true;
     }
 
+    if (strcmp(name, "convert") == 0) {
+        NV_LOG_DEBUG("convert selected");
+
+        *mode = MODE_CONVERT;
+        return true;
+    }
+
+    if (strcmp(name, "quantize") == 0) {
+        NV_LOG_DEBUG("quantize selected");
+
+        *mode = MODE_QUANTIZE;
+        return true;
+    }
+
+    if (strcmp(name, "compare") == 0) {
+        NV_LOG_DEBUG("compare selected");
+
+        *mode = MODE_COMPARE;
+        return true;
+    }
+
+    if (strcmp(name, "compile") == 0) {
+        NV_LOG_DEBUG("compile selected");
+
+        *mode = MODE_COMPILE;
+        return true;
+    }
+
+    if (strcmp(name, "prune") == 0) {
+        NV_LOG_DEBUG("prune selected");
+
+        *mode = MODE_PRUNE;
+        return true;
+    }
+
+    if (strcmp(name, "factorize") == 0) {
+        NV_LOG_DEBUG("factorize selected");
+
+        *mode = MODE_FACTORIZE;
+        return true;
+    }
+
+    if (strcmp(name, "serve") == 0) {
+        NV_LOG_DEBUG("serve selected");
+
+        *mode = MODE_SERVE;
+        return true;
+    }
+
     NV_LOG_ERROR("invalid mode: %s", name);
     return false;
 }
 
+static bool parse_weight_type(const char* name, uint32_t* type) {
+    if (strcmp(name, "fp32") == 0) {
+        *type = MAT_TYPE_F32;
+    } else if (strcmp(name, "bf16") == 0) {
+        *type = MAT_TYPE_BF16;
+    } else if (strcmp(name, "fp16") == 0) {
+        *type = MAT_TYPE_F16;
+    } else {
+        NV_LOG_ERROR("invalid precision: %s", name);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_optimizer_type(const char* name, uint32_t* type) {
+    if (strcmp(name, "sgd") == 0) {
+        *type = OPTIM_SGD;
+    } else if (strcmp(name, "momentum") == 0) {
+        *type = OPTIM_MOMENTUM;
+    } else if (strcmp(name, "adam") == 0) {
+        *type = OPTIM_ADAM;
+    } else {
+        NV_LOG_ERROR("invalid optimizer: %s", name);
+        return false;
+    }
+
+    return true;
+}
+
+enum { OPTION_UINT, OPTION_FLOAT, OPTION_STRING, OPTION_FLAG };
+
+struct program_option {
+    const char* short_name;
+    const char* long_name;
+    const char* description;
+
+    uint32_t type;
+    size_t offset;
+};
+
+static const struct program_option s_options[] = {
+    { "-c", "--cluster", "cluster size", OPTION_UINT,
+      offsetof(struct program_params, cluster_size) },
+    { "-m", "--model", "model path", OPTION_STRING, offsetof(struct program_params, model_path) },
+    { "-o", "--output", "path to write the converted or compiled model to", OPTION_STRING,
+      offsetof(struct program_params, output_path) },
+    { "-t", "--threshold", "training threshold", OPTION_FLOAT,
+      offsetof(struct program_params, training_threshold) },
+    { "-r", "--rate", "learning rate", OPTION_FLOAT,
+      offsetof(struct program_params, learning_rate) },
+    { NULL, "--optimizer", "sgd, momentum or adam", OPTION_STRING,
+      offsetof(struct program_params, optimizer) },
+    { NULL, "--momentum", "momentum coefficient", OPTION_FLOAT,
+      offsetof(struct program_params, momentum) },
+    { NULL, "--save-optimizer", "checkpoint optimizer state beside the model and resume from it",
+      OPTION_FLAG, offsetof(struct program_params, save_optimizer) },
+    { "-j", "--threads", "worker threads (0 for one per cpu)", OPTION_UINT,
+      offsetof(struct program_params, thread_count) },
+    { NULL, "--deterministic", "statically partition work across threads", OPTION_FLAG,
+      offsetof(struct program_params, deterministic) },
+    { "-b", "--batch", "images per forward pass when evaluating or serving", OPTION_UINT,
+      offsetof(struct program_params, eval_batch_size) },
+    { NULL, "--socket", "unix socket to serve on (stdin and stdout if not given)", OPTION_STRING,
+      offsetof(struct program_params, socket_path) },
+    { NULL, "--max-delay", "microseconds a served image may take, batching included",
+      OPTION_UINT, offsetof(struct program_params, max_delay) },
+    { NULL, "--async", "train without synchronizing threads (hogwild)", OPTION_FLAG,
+      offsetof(struct program_params, async) },
+    { "-k", "--checkpoint", "clusters between checkpoints (0 for once per phase)", OPTION_UINT,
+      offsetof(struct program_params, checkpoint_interval) },
+    { "-p", "--precision", "weight storage: fp32, bf16 or fp16", OPTION_STRING,
+      offsetof(struct program_params, precision) },
+    { NULL, "--calibration", "images to calibrate quantization with", OPTION_UINT,
+      offsetof(struct program_params, calibration_size) },
+    { NULL, "--name", "prefix of the compiled model's symbols", OPTION_STRING,
+      offsetof(struct program_params, compile_name) },
+    { NULL, "--sparsity", "fraction of each hidden layer's weights to prune", OPTION_FLOAT,
+      offsetof(struct program_params, sparsity) },
+    { NULL, "--rank", "rank to factorize layers to (0 to pick from --energy)", OPTION_UINT,
+      offsetof(struct program_params, rank) },
+    { NULL, "--energy", "fraction of each layer's spectral energy to keep when factorizing",
+      OPTION_FLOAT, offsetof(struct program_params, energy) },
+    { NULL, "--layers", "comma-separated layers to factorize (every hidden layer by default)",
+      OPTION_STRING, offsetof(struct program_params, factor_layers) },
+};
+
+static const size_t s_option_count = sizeof(s_options) / sizeof(s_options[0]);
+
 static void print_help(const char* program) {
-    printf("usage: %s [training|eval] [options]\n"
-           "options:\n"
-           "\t-c, --cluster\tcluster size\n"
-           "\t-m, --model\tmodel path\n"
-           "\t-t, --threshold\ttraining threshold\n",
+    printf("usage: %s "
+           "[training|eval|convert|quantize|compare|compile|prune|factorize|serve] [options]\n"
+           "options:\n",
            program);
+
+    for (size_t i = 0; i < s_option_count; i++) {
+        const struct program_option* option = &s_options[i];
+        if (option->short_name) {
+            printf("\t%s, %s\t%s\n", option->short_name, option->long_name, option->description);
+        } else {
+            printf("\t%s\t%s\n", option->long_name, option->description);
+        }
+    }
+}
+
+static const struct program_option* find_option(const char* name) {
+    for (size_t i = 0; i < s_option_count; i++) {
+        const struct program_option* option = &s_options[i];
+
+        bool short_match = option->short_name && strcmp(option->short_name, name) == 0;
+        if (short_match || strcmp(option->long_name, name) == 0) {
+            return option;
+        }
+    }
+
+    return NULL;
+}
+
+static bool parse_option_value(const struct program_option* option, const char* value,
+                               struct program_params* params) {
+    void* field = (void*)params + option->offset;
+    char* end;
+
+    switch (option->type) {
+    case OPTION_UINT: {
+        unsigned long parsed = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || parsed > UINT32_MAX) {
+            return false;
+        }
+
+        *(uint32_t*)field = (uint32_t)parsed;
+        return true;
+    }
+    case OPTION_FLOAT: {
+        float parsed = strtof(value, &end);
+        if (*value == '\0' || *end != '\0') {
+            return false;
+        }
+
+        *(float*)field = parsed;
+        return true;
+    }
+    case OPTION_STRING: {
+        char** str = field;
+        nv_free(*str);
+
+        size_t size = strlen(value) + 1;
+        *str = nv_alloc(size);
+        assert(*str);
+
+        memcpy(*str, value, size);
+        return true;
+    }
+    default:
+        return false;
+    }
 }
 
 static bool parse_params(int argc, const char** argv, struct program_params* params) {
@@ -214,20 +479,112 @@ static bool parse_params(int argc, const char** argv, struct program_params* par
         exit(0);
     }
 
-    struct nv_list arguments;
-    nv_list_init(&arguments);
-
-    for (int i = 1; i < argc; i++) {
-        const char* param = argv[i];
-    }
-    if (argc < 2) {
+    params->cluster_size = 64;
+    params->training_threshold = 0.95f;
+    params->learning_rate = 0.1f;
+    params->optimizer_type = OPTIM_SGD;
+    params->momentum = 0.9f;
+    params->thread_count = 0;
+    params->eval_batch_size = 64;
+    params->max_delay = 1000;
+    params->calibration_size = 1000;
+    params->sparsity = 0.9f;
+    params->energy = 0.9f;
+
+    int first_option = 1;
+    if (argc < 2 || argv[1][0] == '-') {
         NV_LOG_DEBUG("no mode passed; assuming training");
         params->mode = MODE_TRAINING;
     } else if (!parse_program_mode(argv[1], &params->mode)) {
         return false;
+    } else {
+        first_option = 2;
+    }
+
+    for (int i = first_option; i < argc; i++) {
+        const struct program_option* option = find_option(argv[i]);
+        if (!option) {
+            NV_LOG_ERROR("unknown option: %s", argv[i]);
+            return false;
+        }
+
+        if (option->type == OPTION_FLAG) {
+            *(bool*)((void*)params + option->offset) = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            NV_LOG_ERROR("option %s requires a value", argv[i]);
+            return false;
+        }
+
+        const char* value = argv[++i];
+        if (!parse_option_value(option, value, params)) {
+            NV_LOG_ERROR("invalid value for %s: %s", option->long_name, value);
+            return false;
+        }
+    }
+
+    if (params->cluster_size == 0) {
+        NV_LOG_ERROR("cluster size must be nonzero!");
+        return false;
+    }
+
+    if (params->eval_batch_size == 0) {
+        NV_LOG_ERROR("batch size must be nonzero!");
+        return false;
+    }
+
+    if (params->precision && !parse_weight_type(params->precision, &params->weight_type)) {
+        return false;
+    }
+
+    if (params->mode == MODE_TRAINING && params->precision &&
+        params->weight_type != MAT_TYPE_F32) {
+        NV_LOG_ERROR("training needs fp32 weights; convert the model once it is trained");
+        return false;
+    }
+
+    if (params->optimizer && !parse_optimizer_type(params->optimizer, &params->optimizer_type)) {
+        return false;
+    }
+
+    if ((params->async || params->mode == MODE_COMPARE) &&
+        params->optimizer_type != OPTIM_SGD) {
+        NV_LOG_ERROR("asynchronous training only supports sgd");
+        return false;
+    }
+
+    if (params->mode == MODE_CONVERT && !params->output_path) {
+        NV_LOG_ERROR("convert requires an output path");
+        return false;
+    }
+
+    if (params->mode == MODE_COMPILE && !params->output_path) {
+        NV_LOG_ERROR("compile requires an output path");
+        return false;
+    }
+
+    if (params->mode == MODE_PRUNE && !params->output_path) {
+        NV_LOG_ERROR("prune requires an output path");
+        return false;
+    }
+
+    if (params->sparsity < 0.f || params->sparsity > 1.f) {
+        NV_LOG_ERROR("sparsity must be between 0 and 1!");
+        return false;
+    }
+
+    if (params->mode == MODE_FACTORIZE && !params->output_path) {
+        NV_LOG_ERROR("factorize requires an output path");
+        return false;
+    }
+
+    if (!(params->energy > 0.f && params->energy <= 1.f)) {
+        NV_LOG_ERROR("energy must be above 0 and at most 1!");
+        return false;
     }
 
-    nv_list_clear(&arguments, NULL, NULL);
     return true;
 }
 
@@ -237,24 +594,45 @@ struct model_context {
     model_t* model;
     const char* model_path;
 
+    thread_pool_t* pool;
+
+    /* shards each cluster across the pool; allocated on the first training phase */
+    trainer_t* trainer;
+    optimizer_t* optimizer;
+
+    /* writes the model back to model_path in the background; only while training */
+    checkpointer_t* checkpointer;
+
     struct program_params params;
 };
 
 static void cleanup_context(const struct model_context* ctx) {
     nv_free(ctx->params.model_path);
+    nv_free(ctx->params.output_path);
+    nv_free(ctx->params.precision);
+    nv_free(ctx->params.optimizer);
+    nv_free(ctx->params.compile_name);
+    nv_free(ctx->params.factor_layers);
+    nv_free(ctx->params.socket_path);
+
+    mat_set_thread_pool(NULL);
+    pool_free(ctx->pool);
+
+    trainer_free(ctx->trainer);
+
+    /* lets the last checkpoint finish */
+    checkpointer_free(ctx->checkpointer);
+    optim_free(ctx->optimizer);
 
     nv_map_free(ctx->datasets);
     model_free(ctx->model);
 }
 
-static float train_on_cluster(struct model_context* ctx, const dataset_t* data,
-                              const uint32_t* indices) {
-    struct model_layer* deltas = model_alloc_deltas(ctx->model);
-
-    NV_LOG_INFO("todo: train on cluster");
+static double get_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    model_free_deltas(deltas);
-    return 0.f;
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
 }
 
 /* generates a random uint32_t in the range [a, b) */
@@ -263,14 +641,166 @@ static uint32_t rand_between(uint32_t a, uint32_t b) {
     return (r % (b - a)) + a;
 }
 
-static float run_training_phase(struct model_context* ctx, const dataset_t* data) {
+static uint32_t get_entry_count(const dataset_t* data) {
     uint32_t num_images = dataset_get_image_count(data);
     uint32_t num_labels = dataset_get_label_count(data);
-    uint32_t num_entries = num_images < num_labels ? num_images : num_labels;
 
-    uint32_t num_clusters = num_entries / ctx->params.cluster_size;
+    return num_images < num_labels ? num_images : num_labels;
+}
+
+/* number of columns whose largest row is the label */
+static uint32_t count_correct(const matrix_t* output, const uint8_t* labels) {
+    uint32_t correct = 0;
+
+    for (uint32_t x = 0; x < output->columns; x++) {
+        uint32_t best = 0;
+        for (uint32_t y = 1; y < output->rows; y++) {
+            if (mat_row(output, y)[x] > mat_row(output, best)[x]) {
+                best = y;
+            }
+        }
+
+        if (best == labels[x]) {
+            correct++;
+        }
+    }
+
+    return correct;
+}
+
+struct accuracy_report {
+    uint32_t correct, total;
+    double seconds;
+};
+
+/* runs the test set through the fp32 model (quant NULL) or the int8 one */
+static void measure_accuracy(const struct model_context* ctx, const dataset_t* data,
+                             const quant_model_t* quant, struct accuracy_report* report) {
+    uint32_t batch_size = ctx->params.cluster_size;
+    uint32_t image_size = dataset_get_image_size(data);
+    uint32_t entries = get_entry_count(data);
+    uint32_t batches = (entries + batch_size - 1) / batch_size;
+
+    matrix_t* output = mat_alloc(NULL, model_get_output_size(ctx->model), batch_size);
+    assert(output);
+
+    size_t pixel_stride = quant ? quant_model_get_input_stride(quant) : image_size;
+    uint8_t* pixels = nv_alloc(pixel_stride * batch_size);
+    assert(pixels);
+
+    /* the padding past each image is never written */
+    memset(pixels, 0, pixel_stride * batch_size);
+
+    struct model_inference* inference = model_alloc_inference(ctx->model, NULL, batch_size);
+    const matrix_t* predicted = output;
+
+    /* output narrowed to the batch at hand */
+    matrix_t quant_output;
+
+    uint32_t indices[batch_size];
+    uint8_t labels[batch_size];
+
+    memset(report, 0, sizeof(struct accuracy_report));
+    for (uint32_t i = 0; i < batches; i++) {
+        /* the last batch may be short */
+        uint32_t offset = i * batch_size;
+        uint32_t count = entries - offset < batch_size ? entries - offset : batch_size;
+
+        for (uint32_t j = 0; j < count; j++) {
+            indices[j] = offset + j;
+        }
+
+        /* loading is left out of the timing; converting the pixels is not, in either path */
+        if (!dataset_get_pixels(data, indices, count, pixels, pixel_stride, labels)) {
+            break;
+        }
+
+        double start = get_seconds();
+        if (quant) {
+            mat_init_view(&quant_output, output->data, output->rows, count, 0);
+            quant_model_forward(quant, pixels, count, &quant_output);
+
+            predicted = &quant_output;
+        } else {
+            predicted = model_infer_pixels(ctx->model, pixels, pixel_stride, count, inference);
+        }
+
+        report->seconds += get_seconds() - start;
+        report->correct += count_correct(predicted, labels);
+        report->total += count;
+    }
+
+    model_free_inference(NULL, inference);
+    nv_free(pixels);
+
+    mat_free(NULL, output);
+}
+
+static void log_accuracy(const char* name, const struct accuracy_report* report) {
+    float accuracy = report->total > 0 ? (float)report->correct / report->total : 0.f;
+    double rate = report->seconds > 0.0 ? report->total / report->seconds : 0.0;
+
+    NV_LOG_INFO("%s: %u/%u correct (%.2f%%), %.0f images/s", name, report->correct, report->total,
+                accuracy * 100.f, rate);
+}
+
+/* resumes from the state saved beside the model, if asked to and it matches */
+static optimizer_t* alloc_optimizer(const struct model_context* ctx) {
+    struct optim_params params;
+    optim_get_default_params(ctx->params.optimizer_type, &params);
+    params.momentum = ctx->params.momentum;
+
+    optimizer_t* optimizer = optim_alloc(ctx->model, &params);
+    if (!ctx->params.save_optimizer) {
+        return optimizer;
+    }
+
+    char path[strlen(ctx->model_path) + sizeof(CHECKPOINT_OPTIM_SUFFIX)];
+    checkpointer_get_optim_path(ctx->model_path, path);
+
+    if (file_exists(path)) {
+        if (optim_read_from_path(optimizer, path)) {
+            NV_LOG_INFO("resuming optimizer state from %s", path);
+        } else {
+            NV_LOG_WARN("ignoring optimizer state at %s", path);
+        }
+    }
+
+    return optimizer;
+}
+
+/* never blocks training: a checkpoint requested while the last is still being written is dropped */
+static void save_checkpoint(struct model_context* ctx) {
+    if (!ctx->checkpointer) {
+        return;
+    }
+
+    if (!checkpointer_save(ctx->checkpointer, ctx->model, ctx->optimizer)) {
+        NV_LOG_WARN("previous checkpoint still being written; skipping");
+    }
+}
+
+struct phase_report {
+    float cost;
+    uint32_t images;
+    double seconds;
+};
+
+static void run_training_phase(struct model_context* ctx, const dataset_t* data,
+                               struct phase_report* report) {
+    uint32_t num_clusters = get_entry_count(data) / ctx->params.cluster_size;
     NV_LOG_DEBUG("beginning training phase %ux%u", num_clusters, ctx->params.cluster_size);
 
+    /* everything a cluster needs is allocated up front, so steps never allocate */
+    if (!ctx->optimizer) {
+        ctx->optimizer = alloc_optimizer(ctx);
+    }
+
+    if (!ctx->trainer) {
+        ctx->trainer = trainer_alloc(ctx->model, ctx->optimizer, ctx->pool,
+                                     ctx->params.cluster_size, dataset_get_image_size(data));
+    }
+
     /* shuffle indices */
     uint32_t total_entries = num_clusters * ctx->params.cluster_size;
     uint32_t indices[total_entries];
@@ -279,7 +809,7 @@ static float run_training_phase(struct model_context* ctx, const dataset_t* data
         indices[i] = i;
     }
 
-    for (uint32_t i = 0; i < total_entries - 1; i++) {
+    for (uint32_t i = 0; i + 1 < total_entries; i++) {
         uint32_t j = rand_between(i + 1, total_entries);
 
         uint32_t swap = indices[i];
@@ -287,18 +817,35 @@ static float run_training_phase(struct model_context* ctx, const dataset_t* data
         indices[j] = swap;
     }
 
+    double start = get_seconds();
+    float rate = ctx->params.learning_rate;
+
     float avg = 0.f;
-    for (uint32_t i = 0; i < num_clusters; i++) {
-        NV_LOG_DEBUG("training on cluster %u", i);
+    if (ctx->params.async) {
+        avg = trainer_run_async(ctx->trainer, data, indices, total_entries, rate);
+    } else {
+        for (uint32_t i = 0; i < num_clusters; i++) {
+            NV_LOG_DEBUG("training on cluster %u", i);
 
-        uint32_t offset = i * ctx->params.cluster_size;
-        const uint32_t* cluster_indices = indices + offset;
+            uint32_t offset = i * ctx->params.cluster_size;
+            const uint32_t* cluster_indices = indices + offset;
 
-        float cost = train_on_cluster(ctx, data, cluster_indices);
-        avg += cost / num_clusters;
+            float cost = trainer_step(ctx->trainer, data, cluster_indices, rate);
+            avg += cost / num_clusters;
+
+            uint32_t interval = ctx->params.checkpoint_interval;
+            if (interval > 0 && (i + 1) % interval == 0) {
+                save_checkpoint(ctx);
+            }
+        }
     }
 
-    return avg;
+    report->cost = avg;
+    report->images = total_entries;
+    report->seconds = get_seconds() - start;
+
+    NV_LOG_INFO("trained on %u images in %.2fs (%.0f images/s)", report->images, report->seconds,
+                report->seconds > 0.0 ? report->images / report->seconds : 0.0);
 }
 
 static void train_for_threshold(struct model_context* ctx, const dataset_t* data) {
@@ -309,17 +856,415 @@ static void train_for_threshold(struct model_context* ctx, const dataset_t* data
 static void run_training(struct model_context* ctx) {
     NV_LOG_INFO("beginning training cycle");
 
+    ctx->optimizer = alloc_optimizer(ctx);
+
+    const optimizer_t* saved_optimizer = ctx->params.save_optimizer ? ctx->optimizer : NULL;
+    ctx->checkpointer = checkpointer_alloc(ctx->model, saved_optimizer, ctx->model_path);
+    if (!ctx->checkpointer) {
+        NV_LOG_WARN("training without checkpoints");
+    }
+
     while (true) {
         dataset_t* data;
         if (nv_map_get(ctx->datasets, (void*)DATASET_TRAINING, (void**)&data)) {
-            run_training_phase(ctx, data);
+            struct phase_report phase;
+            run_training_phase(ctx, data, &phase);
+
+            NV_LOG_INFO("training phase done; average cost %f", phase.cost);
+            save_checkpoint(ctx);
         } else {
             NV_LOG_INFO("no training dataset; exiting out of training cycle");
             break;
         }
 
-        /* todo: eval */
+        dataset_t* test_data;
+        if (nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&test_data)) {
+            struct accuracy_report accuracy;
+            measure_accuracy(ctx, test_data, NULL, &accuracy);
+            log_accuracy("test", &accuracy);
+        }
+    }
+}
+
+/* trains one phase synchronously and one asynchronously from the same starting weights */
+static void run_comparison(struct model_context* ctx) {
+    dataset_t* train_data;
+    dataset_t* test_data;
+
+    if (!nv_map_get(ctx->datasets, (void*)DATASET_TRAINING, (void**)&train_data) ||
+        !nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&test_data)) {
+        NV_LOG_ERROR("comparing training modes needs both datasets");
+        return;
+    }
+
+    model_t* initial = model_clone(NULL, ctx->model);
+    assert(initial);
+
+    static const char* const mode_names[] = { "sync", "async" };
+    for (uint32_t i = 0; i < 2; i++) {
+        model_copy(ctx->model, initial);
+        ctx->params.async = i > 0;
+
+        struct phase_report phase;
+        run_training_phase(ctx, train_data, &phase);
+
+        struct accuracy_report accuracy;
+        measure_accuracy(ctx, test_data, NULL, &accuracy);
+
+        double rate = phase.seconds > 0.0 ? phase.images / phase.seconds : 0.0;
+        float percent = accuracy.total > 0 ? 100.f * accuracy.correct / accuracy.total : 0.f;
+
+        NV_LOG_INFO("%s: cost %f, %.0f images/s, test accuracy %.2f%%", mode_names[i], phase.cost,
+                    rate, percent);
+    }
+
+    /* the comparison does not get to keep its training */
+    model_copy(ctx->model, initial);
+    model_free(initial);
+}
+
+/* quantizes the model to int8 and compares it against fp32 on the test set */
+static void run_quantization(struct model_context* ctx) {
+    dataset_t* data;
+    if (!nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&data)) {
+        NV_LOG_ERROR("no testing dataset to quantize against");
+        return;
+    }
+
+    uint32_t calibration_size = ctx->params.calibration_size;
+    uint32_t entries = get_entry_count(data);
+    calibration_size = calibration_size < entries ? calibration_size : entries;
+
+    if (calibration_size == 0) {
+        NV_LOG_ERROR("no images to calibrate with");
+        return;
+    }
+
+    matrix_t* calibration = mat_alloc(NULL, dataset_get_image_size(data), calibration_size);
+    assert(calibration);
+
+    uint32_t* indices = nv_alloc(calibration_size * sizeof(uint32_t));
+    assert(indices);
+
+    for (uint32_t i = 0; i < calibration_size; i++) {
+        indices[i] = i;
+    }
+
+    quant_model_t* quant = NULL;
+    if (dataset_get_batch(data, indices, calibration_size, calibration, NULL)) {
+        NV_LOG_INFO("calibrating int8 model on %u images", calibration_size);
+        quant = quant_model_alloc(ctx->model, calibration);
+    }
+
+    nv_free(indices);
+    mat_free(NULL, calibration);
+
+    if (!quant) {
+        NV_LOG_ERROR("failed to quantize model!");
+        return;
     }
+
+    struct accuracy_report reference, quantized;
+    measure_accuracy(ctx, data, NULL, &reference);
+    measure_accuracy(ctx, data, quant, &quantized);
+
+    log_accuracy("fp32", &reference);
+    log_accuracy("int8", &quantized);
+
+    if (reference.total > 0) {
+        int32_t delta = (int32_t)quantized.correct - (int32_t)reference.correct;
+        NV_LOG_INFO("int8 accuracy delta: %+.2f%%", 100.f * delta / reference.total);
+    }
+
+    quant_model_free(quant);
+}
+
+/* runs the whole test set through the model across the pool and reports how it did */
+static void run_eval(struct model_context* ctx) {
+    dataset_t* data;
+    if (!nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&data)) {
+        NV_LOG_ERROR("no testing dataset to evaluate on");
+        return;
+    }
+
+    evaluator_t* evaluator = evaluator_alloc(ctx->model, ctx->pool, ctx->params.eval_batch_size,
+                                             dataset_get_image_size(data));
+    if (!evaluator) {
+        return;
+    }
+
+    /* the first pass faults in the mapped parameters and warms the caches; only the second
+     * counts */
+    struct eval_report report;
+    bool evaluated =
+        evaluator_run(evaluator, data, &report) && evaluator_run(evaluator, data, &report);
+
+    evaluator_free(evaluator);
+    if (!evaluated) {
+        return;
+    }
+
+    float accuracy = report.total > 0 ? 100.f * report.correct / report.total : 0.f;
+    double rate = report.seconds > 0.0 ? report.total / report.seconds : 0.0;
+
+    NV_LOG_INFO("eval: %u/%u correct (%.2f%%), mean loss %f", report.correct, report.total,
+                accuracy, report.loss);
+    NV_LOG_INFO("eval: %.0f images/s over %u threads, batches of %u", rate,
+                pool_get_thread_count(ctx->pool), ctx->params.eval_batch_size);
+    NV_LOG_INFO("eval: batch latency p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms (%u batches)",
+                report.latency_p50 * 1e3, report.latency_p90 * 1e3, report.latency_p99 * 1e3,
+                report.latency_max * 1e3, report.batches);
+
+    NV_LOG_INFO("confusion matrix (rows are labels, columns predictions):");
+    for (uint32_t y = 0; y < report.classes; y++) {
+        char row[EVAL_MAX_CLASSES * 7 + 1];
+        size_t length = 0;
+
+        for (uint32_t x = 0; x < report.classes; x++) {
+            length += snprintf(row + length, sizeof(row) - length, " %6u", report.confusion[y][x]);
+        }
+
+        NV_LOG_INFO("%u:%s", y, row);
+    }
+}
+
+/* prunes every hidden layer by magnitude, stores what ends up sparse enough as sparse layers and
+ * writes the result, comparing it against the original on the test set */
+static void run_pruning(struct model_context* ctx) {
+    dataset_t* data;
+    if (!nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&data)) {
+        NV_LOG_ERROR("no testing dataset to prune against");
+        return;
+    }
+
+    if (model_has_sparse_layers(ctx->model)) {
+        NV_LOG_ERROR("model is already pruned");
+        return;
+    }
+
+    if (model_has_low_rank_layers(ctx->model)) {
+        NV_LOG_ERROR("cannot prune a factorized model");
+        return;
+    }
+
+    struct accuracy_report dense, pruned;
+    measure_accuracy(ctx, data, NULL, &dense);
+
+    size_t dense_size = (size_t)ctx->model->parameters->columns * sizeof(float);
+
+    /* the output layer is small and every weight in it matters */
+    for (uint32_t i = 0; i + 1 < ctx->model->num_layers; i++) {
+        model_prune_layer(ctx->model, i, ctx->params.sparsity);
+    }
+
+    uint32_t sparse_layers = model_sparsify(ctx->model);
+    size_t pruned_size = (size_t)ctx->model->parameters->columns * sizeof(float);
+
+    measure_accuracy(ctx, data, NULL, &pruned);
+
+    log_accuracy("dense", &dense);
+    log_accuracy("pruned", &pruned);
+
+    NV_LOG_INFO("%u sparse layers; parameters %zu -> %zu bytes", sparse_layers, dense_size,
+                pruned_size);
+
+    if (dense.total > 0) {
+        int32_t delta = (int32_t)pruned.correct - (int32_t)dense.correct;
+        NV_LOG_INFO("pruned accuracy delta: %+.2f%%", 100.f * delta / dense.total);
+    }
+
+    if (!model_write_to_path(ctx->model, ctx->params.output_path)) {
+        NV_LOG_ERROR("failed to write pruned model to %s", ctx->params.output_path);
+    }
+}
+
+/* marks the layers listed in list (comma-separated indices). NULL selects every hidden layer */
+static bool parse_layer_list(const char* list, uint32_t num_layers, bool* selected) {
+    for (uint32_t i = 0; i < num_layers; i++) {
+        /* the output layer is small, and factorizing it costs the most accuracy */
+        selected[i] = !list && i + 1 < num_layers;
+    }
+
+    while (list && *list != '\0') {
+        char* end;
+        unsigned long index = strtoul(list, &end, 10);
+
+        if (end == list || (*end != ',' && *end != '\0') || index >= num_layers) {
+            NV_LOG_ERROR("invalid layer list: %s", list);
+            return false;
+        }
+
+        selected[index] = true;
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return true;
+}
+
+static uint64_t get_model_flops(const model_t* model) {
+    uint64_t flops = 0;
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        flops += model_get_layer_flops(model, i);
+    }
+
+    return flops;
+}
+
+/* replaces the selected layers by low-rank factorizations and writes the result, comparing its
+ * cost and accuracy against the original on the test set */
+static void run_factorization(struct model_context* ctx) {
+    dataset_t* data;
+    if (!nv_map_get(ctx->datasets, (void*)DATASET_TESTING, (void**)&data)) {
+        NV_LOG_ERROR("no testing dataset to factorize against");
+        return;
+    }
+
+    model_t* model = ctx->model;
+    uint32_t num_layers = model->num_layers;
+
+    bool selected[num_layers];
+    if (!parse_layer_list(ctx->params.factor_layers, num_layers, selected)) {
+        return;
+    }
+
+    uint32_t ranks[num_layers];
+    uint64_t layer_flops[num_layers];
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+        layer_flops[i] = model_get_layer_flops(model, i);
+
+        ranks[i] = 0;
+        if (!selected[i]) {
+            continue;
+        }
+
+        if (layer->sparse || layer->factors) {
+            NV_LOG_WARN("layer %u is already sparse or low-rank; skipping", i);
+            continue;
+        }
+
+        ranks[i] = ctx->params.rank;
+        if (ranks[i] == 0) {
+            ranks[i] = model_get_layer_rank(model, i, ctx->params.energy);
+        }
+    }
+
+    struct accuracy_report dense, factorized;
+    measure_accuracy(ctx, data, NULL, &dense);
+
+    uint64_t dense_flops = get_model_flops(model);
+    uint32_t low_rank_layers = model_factorize(model, ranks);
+    uint64_t factorized_flops = get_model_flops(model);
+
+    measure_accuracy(ctx, data, NULL, &factorized);
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+        if (!layer->factors) {
+            continue;
+        }
+
+        NV_LOG_INFO("layer %u: %ux%u -> rank %u, %lu -> %lu flops per image", i,
+                    layer->weights->rows, layer->weights->columns, layer->factors[0].columns,
+                    (unsigned long)layer_flops[i], (unsigned long)model_get_layer_flops(model, i));
+    }
+
+    log_accuracy("dense", &dense);
+    log_accuracy("factorized", &factorized);
+
+    double savings =
+        dense_flops > 0 ? 100.0 * (1.0 - (double)factorized_flops / dense_flops) : 0.0;
+    NV_LOG_INFO("%u low-rank layers; %lu -> %lu flops per image (%.1f%% fewer)", low_rank_layers,
+                (unsigned long)dense_flops, (unsigned long)factorized_flops, savings);
+
+    if (dense.total > 0) {
+        int32_t delta = (int32_t)factorized.correct - (int32_t)dense.correct;
+        NV_LOG_INFO("factorized accuracy delta: %+.2f%%", 100.f * delta / dense.total);
+    }
+
+    if (!model_write_to_path(model, ctx->params.output_path)) {
+        NV_LOG_ERROR("failed to write factorized model to %s", ctx->params.output_path);
+    }
+}
+
+/* rewrites the model with its weights stored at the requested precision */
+static bool convert_model(struct model_context* ctx) {
+    if (!file_exists(ctx->model_path)) {
+        NV_LOG_ERROR("no model at path %s to convert", ctx->model_path);
+        return false;
+    }
+
+    ctx->model = model_map_from_path(NULL, ctx->model_path, MODEL_MAP_VERIFY);
+    if (!ctx->model) {
+        return false;
+    }
+
+    if (ctx->params.precision) {
+        model_set_weight_type(ctx->model, ctx->params.weight_type);
+    }
+
+    return model_write_to_path(ctx->model, ctx->params.output_path);
+}
+
+/* emits the model as standalone c */
+static bool compile_model(struct model_context* ctx) {
+    if (!file_exists(ctx->model_path)) {
+        NV_LOG_ERROR("no model at path %s to compile", ctx->model_path);
+        return false;
+    }
+
+    ctx->model = model_read_from_path(NULL, ctx->model_path);
+    if (!ctx->model) {
+        return false;
+    }
+
+    const char* name = ctx->params.compile_name ? ctx->params.compile_name : "model";
+    return compile_model_to_path(ctx->model, name, ctx->params.output_path);
+}
+
+/* answers images from other processes until told to stop */
+static bool serve_model(struct model_context* ctx) {
+    if (!file_exists(ctx->model_path)) {
+        NV_LOG_ERROR("no model at path %s to serve", ctx->model_path);
+        return false;
+    }
+
+    ctx->model = model_map_from_path(NULL, ctx->model_path, MODEL_MAP_VERIFY);
+    if (!ctx->model) {
+        return false;
+    }
+
+    if (ctx->params.precision) {
+        model_set_weight_type(ctx->model, ctx->params.weight_type);
+    }
+
+    /* one worker per thread runs batches side by side; products split across the pool from
+     * several of them at once would only queue behind each other */
+    mat_set_thread_pool(NULL);
+
+    struct server_params params;
+    params.max_batch = ctx->params.eval_batch_size;
+    params.max_delay = ctx->params.max_delay;
+    params.worker_count = pool_get_thread_count(ctx->pool);
+
+    server_t* server = server_alloc(ctx->model, &params);
+
+    bool served;
+    if (ctx->params.socket_path) {
+        served = server_listen(server, ctx->params.socket_path);
+    } else {
+        /* the protocol owns stdout when there is no socket; logs go to stderr instead. lines
+         * logged so far are still buffered, so they follow */
+        int out_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+
+        served = server_serve_stream(server, STDIN_FILENO, out_fd);
+        close(out_fd);
+    }
+
+    server_free(server);
+    return served;
 }
 
 int main(int argc, const char** argv) {
@@ -339,6 +1284,34 @@ int main(int argc, const char** argv) {
 
     if (!parse_params(argc, argv, &ctx.params)) {
         cleanup_context(&ctx);
+        return 1;
+    }
+
+    uint32_t pool_flags = ctx.params.deterministic ? POOL_STATIC_SCHEDULE : 0;
+    ctx.pool = pool_alloc(ctx.params.thread_count, pool_flags);
+    mat_set_thread_pool(ctx.pool);
+
+    ctx.model_path = ctx.params.model_path ? ctx.params.model_path : "model.bin";
+
+    if (ctx.params.mode == MODE_CONVERT) {
+        bool converted = convert_model(&ctx);
+
+        cleanup_context(&ctx);
+        return converted ? 0 : 1;
+    }
+
+    if (ctx.params.mode == MODE_COMPILE) {
+        bool compiled = compile_model(&ctx);
+
+        cleanup_context(&ctx);
+        return compiled ? 0 : 1;
+    }
+
+    if (ctx.params.mode == MODE_SERVE) {
+        bool served = serve_model(&ctx);
+
+        cleanup_context(&ctx);
+        return served ? 0 : 1;
     }
 
     ctx.datasets = load_datasets();
@@ -347,12 +1320,66 @@ int main(int argc, const char** argv) {
         return 1;
     }
 
-    ctx.model_path = ctx.params.model_path ? ctx.params.model_path : "model.bin";
-    ctx.model = open_model(NULL, ctx.model_path);
+    /* only training and pruning write to the parameters; everything else can share the file's
+     * pages */
+    bool trains = ctx.params.mode == MODE_TRAINING || ctx.params.mode == MODE_COMPARE;
+    bool writes = trains || ctx.params.mode == MODE_PRUNE;
+
+    ctx.model = open_model(NULL, ctx.model_path, writes ? MODEL_MAP_WRITABLE : 0);
+    if (ctx.model && ctx.params.precision) {
+        model_set_weight_type(ctx.model, ctx.params.weight_type);
+    }
+
+    if (ctx.model && trains && model_has_sparse_layers(ctx.model)) {
+        NV_LOG_ERROR("pruned models are inference-only; train the dense model instead");
+
+        cleanup_context(&ctx);
+        return 1;
+    }
+
+    if (ctx.model && trains && model_has_low_rank_layers(ctx.model)) {
+        NV_LOG_ERROR("factorized models are inference-only; train the dense model instead");
+
+        cleanup_context(&ctx);
+        return 1;
+    }
 
     switch (ctx.params.mode) {
     case MODE_TRAINING:
-        run_training(&ctx);
+        if (ctx.model) {
+            run_training(&ctx);
+        }
+
+        break;
+    case MODE_EVAL:
+        if (ctx.model) {
+            run_eval(&ctx);
+        }
+
+        break;
+    case MODE_QUANTIZE:
+        if (ctx.model) {
+            run_quantization(&ctx);
+        }
+
+        break;
+    case MODE_COMPARE:
+        if (ctx.model) {
+            run_comparison(&ctx);
+        }
+
+        break;
+    case MODE_PRUNE:
+        if (ctx.model) {
+            run_pruning(&ctx);
+        }
+
+        break;
+    case MODE_FACTORIZE:
+        if (ctx.model) {
+            run_factorization(&ctx);
+        }
+
         break;
     }
 
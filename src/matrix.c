@@ -1,73 +1,338 @@
 #include "matrix.h"
 
 #include "prng.h"
+#include "gemm.h"
+#include "vec.h"
+#include "half.h"
 
 #include <assert.h>
 #include <string.h>
 #include <math.h>
 
+#include <sys/mman.h>
+
 #include <nyoravim/mem.h>
 #include <nyoravim/log.h>
 
-matrix_t* mat_alloc(const struct nv_allocator* alloc, uint32_t rows, uint32_t columns) {
-    NV_LOG_TRACE("allocating %ux%u matrix %s an allocator", rows, columns,
-                 alloc ? "with" : "without");
+/* internal storage flags, kept out of the way of MAT_ALLOC_* */
+enum {
+    MAT_STORAGE_MAPPED = (1 << 16),
+    MAT_STORAGE_VIEW = (1 << 17),
+};
 
-    size_t meta_size = sizeof(matrix_t);
-    size_t data_size = sizeof(float) * rows * columns;
-    size_t block_size = meta_size + data_size;
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
 
-    matrix_t* mat;
-    if (alloc) {
-        mat = alloc->alloc(alloc->user, block_size);
-    } else {
-        mat = nv_alloc(block_size);
+static uint32_t get_type(uint32_t flags) {
+    if (flags & MAT_ALLOC_BF16) {
+        return MAT_TYPE_BF16;
     }
 
-    if (!mat) {
+    if (flags & MAT_ALLOC_F16) {
+        return MAT_TYPE_F16;
+    }
+
+    return MAT_TYPE_F32;
+}
+
+uint32_t mat_get_type_flag(uint32_t type) {
+    switch (type) {
+    case MAT_TYPE_BF16:
+        return MAT_ALLOC_BF16;
+    case MAT_TYPE_F16:
+        return MAT_ALLOC_F16;
+    default:
+        return 0;
+    }
+}
+
+static size_t get_element_size(uint32_t flags) {
+    return get_type(flags) == MAT_TYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+static uint32_t get_stride(uint32_t columns, uint32_t flags) {
+    if (!(flags & MAT_ALLOC_PAD_ROWS)) {
+        return columns;
+    }
+
+    size_t elements_per_line = MAT_ALIGNMENT / get_element_size(flags);
+    return (uint32_t)align_up(columns, elements_per_line);
+}
+
+/* the header sits in front of the data, padded so that the data is aligned */
+static size_t get_data_offset() { return align_up(sizeof(matrix_t), MAT_ALIGNMENT); }
+
+static size_t get_mapped_size(size_t data_size) {
+    return align_up(get_data_offset() + data_size, HUGE_PAGE_SIZE);
+}
+
+static matrix_t* map_huge_block(size_t size) {
+    /* over-map so the block can be trimmed down to a huge page boundary */
+    size_t mapped_size = size + HUGE_PAGE_SIZE;
+
+    void* mapping = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+
+    if (mapping == MAP_FAILED) {
         return NULL;
     }
 
+    uintptr_t start = align_up((uintptr_t)mapping, HUGE_PAGE_SIZE);
+    size_t head = start - (uintptr_t)mapping;
+    size_t tail = mapped_size - head - size;
+
+    if (head > 0) {
+        munmap(mapping, head);
+    }
+
+    if (tail > 0) {
+        munmap((void*)(start + size), tail);
+    }
+
+    /* advisory; falls back to regular pages if thp is disabled */
+    madvise((void*)start, size, MADV_HUGEPAGE);
+    return (matrix_t*)start;
+}
+
+static void init_header(matrix_t* mat, void* data, uint32_t rows, uint32_t columns,
+                        uint32_t flags) {
     mat->rows = rows;
     mat->columns = columns;
-    mat->data = (void*)mat + meta_size;
+    mat->stride = get_stride(columns, flags);
+    mat->flags = flags & (MAT_ALLOC_PAD_ROWS | MAT_ALLOC_HUGE_PAGES);
+    mat->type = get_type(flags);
+    mat->data = data;
+}
+
+size_t mat_get_alloc_size(uint32_t rows, uint32_t columns, uint32_t flags) {
+    /* allocators only guarantee pointer alignment, so leave room to align the data */
+    size_t data_size = get_element_size(flags) * rows * get_stride(columns, flags);
+    return sizeof(matrix_t) + (MAT_ALIGNMENT - 1) + data_size;
+}
+
+matrix_t* mat_alloc(const struct nv_allocator* alloc, uint32_t rows, uint32_t columns) {
+    return mat_alloc_ex(alloc, rows, columns, 0);
+}
+
+matrix_t* mat_alloc_ex(const struct nv_allocator* alloc, uint32_t rows, uint32_t columns,
+                       uint32_t flags) {
+    size_t data_offset = get_data_offset();
+    size_t data_size = get_element_size(flags) * rows * get_stride(columns, flags);
+
+    bool huge = !alloc && (flags & MAT_ALLOC_HUGE_PAGES) && data_size >= HUGE_PAGE_SIZE;
+
+    matrix_t* mat = NULL;
+    void* data = NULL;
+
+    if (huge) {
+        mat = map_huge_block(get_mapped_size(data_size));
+        if (mat) {
+            data = (void*)mat + data_offset;
+        } else {
+            NV_LOG_WARN("failed to map huge pages for %ux%u matrix; falling back", rows, columns);
+            huge = false;
+        }
+    }
+
+    if (!huge) {
+        size_t block_size = mat_get_alloc_size(rows, columns, flags);
+
+        /* custom allocators are used for hot per-step scratch; keep them quiet */
+        if (alloc) {
+            mat = alloc->alloc(alloc->user, block_size);
+        } else {
+            NV_LOG_TRACE("allocating %ux%u matrix", rows, columns);
+            mat = nv_alloc(block_size);
+        }
+
+        if (!mat) {
+            return NULL;
+        }
+
+        data = (void*)align_up((uintptr_t)mat + sizeof(matrix_t), MAT_ALIGNMENT);
+    }
+
+    init_header(mat, data, rows, columns, flags);
+    if (huge) {
+        mat->flags |= MAT_STORAGE_MAPPED;
+    }
+
+    /* keep padding zeroed so that it never holds garbage */
+    if (mat->stride > columns) {
+        size_t element_size = get_element_size(flags);
+
+        for (uint32_t y = 0; y < rows; y++) {
+            void* padding = (char*)mat_row_data(mat, y) + columns * element_size;
+            memset(padding, 0, (mat->stride - columns) * element_size);
+        }
+    }
 
     return mat;
 }
 
+size_t mat_get_data_size(uint32_t rows, uint32_t columns, uint32_t flags) {
+    size_t data_size = get_element_size(flags) * rows * get_stride(columns, flags);
+    return align_up(data_size, MAT_ALIGNMENT);
+}
+
+void mat_init_view(matrix_t* mat, void* data, uint32_t rows, uint32_t columns, uint32_t flags) {
+    assert(((uintptr_t)data & (MAT_ALIGNMENT - 1)) == 0);
+
+    init_header(mat, data, rows, columns, flags);
+    mat->flags |= MAT_STORAGE_VIEW;
+}
+
 void mat_free(const struct nv_allocator* alloc, matrix_t* mat) {
     if (!mat) {
         return;
     }
 
-    if (!alloc) {
+    /* views belong to whoever owns their data */
+    assert(!(mat->flags & MAT_STORAGE_VIEW));
+
+    if (mat->flags & MAT_STORAGE_MAPPED) {
+        size_t data_size = mat_get_element_size(mat) * mat->rows * mat->stride;
+        munmap(mat, get_mapped_size(data_size));
+    } else if (!alloc) {
         nv_free(mat);
     } else if (alloc->free) {
         alloc->free(alloc->user, mat);
     }
 }
 
+/* elements converted per step when copying between types */
+#define CONVERT_CHUNK 256
+
+static void convert_run(void* dst, uint32_t dst_type, const void* src, uint32_t src_type,
+                        uint32_t count) {
+    float widened[CONVERT_CHUNK];
+
+    for (uint32_t i = 0; i < count; i += CONVERT_CHUNK) {
+        uint32_t remaining = count - i;
+        uint32_t chunk = remaining < CONVERT_CHUNK ? remaining : CONVERT_CHUNK;
+
+        /* widen to fp32 first, straight into dst if that is where it is going */
+        float* values = dst_type == MAT_TYPE_F32 ? (float*)dst + i : widened;
+        switch (src_type) {
+        case MAT_TYPE_BF16:
+            half_bf16_to_floats(values, (const uint16_t*)src + i, chunk);
+            break;
+        case MAT_TYPE_F16:
+            half_f16_to_floats(values, (const uint16_t*)src + i, chunk);
+            break;
+        default:
+            memcpy(values, (const float*)src + i, chunk * sizeof(float));
+            break;
+        }
+
+        switch (dst_type) {
+        case MAT_TYPE_BF16:
+            half_floats_to_bf16((uint16_t*)dst + i, values, chunk);
+            break;
+        case MAT_TYPE_F16:
+            half_floats_to_f16((uint16_t*)dst + i, values, chunk);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 void mat_copy(matrix_t* dst, const matrix_t* src) {
     assert(dst->rows == src->rows);
     assert(dst->columns == src->columns);
 
-    memcpy(dst->data, src->data, sizeof(float) * dst->rows * dst->columns);
+    if (dst->type != src->type) {
+        for (uint32_t y = 0; y < dst->rows; y++) {
+            convert_run(mat_row_data(dst, y), dst->type, mat_row_data(src, y), src->type,
+                        dst->columns);
+        }
+
+        return;
+    }
+
+    size_t element_size = mat_get_element_size(dst);
+    if (mat_is_contiguous(dst) && mat_is_contiguous(src)) {
+        memcpy(dst->data, src->data, element_size * dst->rows * dst->columns);
+        return;
+    }
+
+    for (uint32_t y = 0; y < dst->rows; y++) {
+        memcpy(mat_row_data(dst, y), mat_row_data(src, y), element_size * dst->columns);
+    }
 }
 
 void mat_zero(matrix_t* mat) {
-    size_t data_size = sizeof(float) * mat->rows * mat->columns;
+    /* padding included */
+    size_t data_size = mat_get_element_size(mat) * mat->rows * mat->stride;
     memset(mat->data, 0, data_size);
 }
 
 void mat_randomize(struct prng* rng, matrix_t* mat) {
-    uint32_t total = mat->rows * mat->columns;
-    for (uint32_t i = 0; i < total; i++) {
-        uint32_t value = rng ? prng_rand(rng) : prng_rand_g();
-        mat->data[i] = (float)value / (float)UINT32_MAX;
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        float* row = mat_row(mat, y);
+        uint16_t* half_row = mat_half_row(mat, y);
+
+        for (uint32_t x = 0; x < mat->columns; x++) {
+            uint32_t value = rng ? prng_rand(rng) : prng_rand_g();
+            float element = (float)value / (float)UINT32_MAX;
+
+            switch (mat->type) {
+            case MAT_TYPE_BF16:
+                half_row[x] = half_float_to_bf16(element);
+                break;
+            case MAT_TYPE_F16:
+                half_row[x] = half_float_to_f16(element);
+                break;
+            default:
+                row[x] = element;
+                break;
+            }
+        }
     }
 }
 
-void mat_mul(matrix_t* result, const matrix_t* lhs, const matrix_t* rhs, uint32_t flags) {
+static struct thread_pool* s_pool;
+
+void mat_set_thread_pool(struct thread_pool* pool) { s_pool = pool; }
+
+static uint32_t get_gemm_type(const matrix_t* mat) {
+    switch (mat->type) {
+    case MAT_TYPE_BF16:
+        return GEMM_TYPE_BF16;
+    case MAT_TYPE_F16:
+        return GEMM_TYPE_F16;
+    default:
+        return GEMM_TYPE_F32;
+    }
+}
+
+static uint32_t get_gemm_flags(uint32_t flags) {
+    uint32_t gemm_flags = 0;
+    if (flags & MAT_MUL_TRANSPOSE_LHS) {
+        gemm_flags |= GEMM_TRANSPOSE_A;
+    }
+
+    if (flags & MAT_MUL_TRANSPOSE_RHS) {
+        gemm_flags |= GEMM_TRANSPOSE_B;
+    }
+
+    if (flags & MAT_MUL_ZERO_RESULT) {
+        gemm_flags |= GEMM_OVERWRITE;
+    }
+
+    return gemm_flags;
+}
+
+gemm_plan_t* mat_plan_mul(uint32_t flags, uint32_t rows, uint32_t columns, uint32_t inner) {
+    return gemm_plan_alloc(get_gemm_flags(flags), rows, columns, inner);
+}
+
+void mat_mul(matrix_t* result, const matrix_t* lhs, const matrix_t* rhs, uint32_t flags,
+             const gemm_plan_t* plan) {
     bool transpose_lhs = flags & MAT_MUL_TRANSPOSE_LHS;
     bool transpose_rhs = flags & MAT_MUL_TRANSPOSE_RHS;
 
@@ -80,55 +345,194 @@ void mat_mul(matrix_t* result, const matrix_t* lhs, const matrix_t* rhs, uint32_
     assert(lhs_columns == rhs_rows);
     assert(result->rows == lhs_rows);
     assert(result->columns == rhs_columns);
+    assert(result->type == MAT_TYPE_F32);
 
-    if (flags & MAT_MUL_ZERO_RESULT) {
-        mat_zero(result);
+    struct gemm_params params;
+    params.flags = get_gemm_flags(flags);
+    params.m = lhs_rows;
+    params.n = rhs_columns;
+    params.k = lhs_columns;
+
+    /* leading dimensions are in terms of the stored (untransposed) layout */
+    params.a = lhs->data;
+    params.lda = lhs->stride;
+    params.a_type = get_gemm_type(lhs);
+
+    params.b = rhs->data;
+    params.ldb = rhs->stride;
+    params.b_type = get_gemm_type(rhs);
+
+    params.c = result->data;
+    params.ldc = result->stride;
+
+    params.epilogue = NULL;
+    params.plan = plan;
+    params.pool = s_pool;
+
+    gemm_run(&params);
+}
+
+void mat_mul_bias_activate(matrix_t* output, matrix_t* z, const matrix_t* weights,
+                           const matrix_t* input, const matrix_t* biases, uint32_t activation,
+                           const gemm_plan_t* plan) {
+    assert(weights->columns == input->rows);
+    assert(output->rows == weights->rows);
+    assert(output->columns == input->columns);
+
+    assert(output->type == MAT_TYPE_F32);
+
+    assert(biases->rows == output->rows);
+    assert(biases->columns == 1);
+    assert(biases->stride == 1);
+    assert(biases->type == MAT_TYPE_F32);
+
+    if (z) {
+        assert(z->rows == output->rows);
+        assert(z->columns == output->columns);
+        assert(z->type == MAT_TYPE_F32);
     }
 
-    for (uint32_t m = 0; m < lhs_rows; m++) {
-        for (uint32_t n = 0; n < rhs_columns; n++) {
-            uint32_t result_index = m * rhs_columns + n;
+    struct gemm_epilogue epilogue;
+    epilogue.bias = biases->data;
+    epilogue.z = z ? z->data : NULL;
+    epilogue.ldz = z ? z->stride : 0;
+
+    switch (activation) {
+    case MAT_ACTIVATION_RELU:
+        epilogue.activation = GEMM_ACTIVATION_RELU;
+        break;
+    case MAT_ACTIVATION_SIGMOID:
+        epilogue.activation = GEMM_ACTIVATION_SIGMOID;
+        break;
+    default:
+        /* softmax normalizes across rows, so it cannot run per tile; done as a pass below */
+        epilogue.activation = GEMM_ACTIVATION_NONE;
+        break;
+    }
 
-            /* can also be rhs_rows */
-            for (uint32_t x = 0; x < lhs_columns; x++) {
-                uint32_t lhs_index = transpose_lhs ? x * lhs_rows + m : m * lhs_rows * x;
-                uint32_t rhs_index = transpose_rhs ? n * rhs_rows + x : x * rhs_rows + n;
+    struct gemm_params params;
+    params.flags = GEMM_OVERWRITE;
+    params.m = weights->rows;
+    params.n = input->columns;
+    params.k = weights->columns;
 
-                result->data[result_index] += lhs->data[lhs_index] * rhs->data[rhs_index];
-            }
-        }
+    params.a = weights->data;
+    params.lda = weights->stride;
+    params.a_type = get_gemm_type(weights);
+
+    params.b = input->data;
+    params.ldb = input->stride;
+    params.b_type = get_gemm_type(input);
+
+    params.c = output->data;
+    params.ldc = output->stride;
+
+    params.epilogue = &epilogue;
+    params.plan = plan;
+    params.pool = s_pool;
+
+    gemm_run(&params);
+
+    if (activation == MAT_ACTIVATION_SOFTMAX) {
+        mat_softmax(output, output);
     }
 }
 
 void mat_scale(matrix_t* mat, float scalar) {
-    uint32_t total = mat->rows * mat->columns;
-    for (uint32_t i = 0; i < total; i++) {
-        mat->data[i] *= scalar;
+    assert(mat->type == MAT_TYPE_F32);
+    const struct vec_kernels* kernels = vec_get_kernels();
+
+    if (mat_is_contiguous(mat)) {
+        kernels->scale(mat->data, scalar, mat->rows * mat->columns);
+        return;
+    }
+
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        kernels->scale(mat_row(mat, y), scalar, mat->columns);
     }
 }
 
-static float relu(float x) { return x > 0 ? x : 0.f; }
-static float sigmoid(float x) { return 1.f / (1.f + expf(-x)); }
-static float cross_entropy(float x, float y) { return x == 0.f ? 0.f : x * -logf(y); }
+void mat_add_scaled(matrix_t* dst, const matrix_t* src, float scalar) {
+    assert(dst->rows == src->rows);
+    assert(dst->columns == src->columns);
+    assert(dst->type == MAT_TYPE_F32 && src->type == MAT_TYPE_F32);
 
-void mat_relu(matrix_t* output, const matrix_t* input) {
+    for (uint32_t y = 0; y < dst->rows; y++) {
+        float* dst_row = mat_row(dst, y);
+        const float* src_row = mat_row(src, y);
+
+        for (uint32_t x = 0; x < dst->columns; x++) {
+            dst_row[x] += scalar * src_row[x];
+        }
+    }
+}
+
+void mat_add_row_sums(matrix_t* sums, const matrix_t* mat) {
+    assert(sums->rows == mat->rows);
+    assert(sums->columns == 1);
+
+    const struct vec_kernels* kernels = vec_get_kernels();
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        mat_row(sums, y)[0] += kernels->sum(mat_row(mat, y), mat->columns);
+    }
+}
+
+typedef void (*unary_kernel_t)(float* dst, const float* src, size_t count);
+
+/* one sweep if neither side is padded, otherwise row by row */
+static void apply_unary(unary_kernel_t kernel, matrix_t* output, const matrix_t* input) {
     assert(output->rows == input->rows);
     assert(output->columns == input->columns);
+    assert(output->type == MAT_TYPE_F32 && input->type == MAT_TYPE_F32);
 
-    uint32_t total = output->rows * output->columns;
-    for (uint32_t i = 0; i < total; i++) {
-        float in = input->data[i];
-        output->data[i] = in > 0 ? in : 0.f;
+    if (mat_is_contiguous(output) && mat_is_contiguous(input)) {
+        kernel(output->data, input->data, output->rows * output->columns);
+        return;
+    }
+
+    for (uint32_t y = 0; y < output->rows; y++) {
+        kernel(mat_row(output, y), mat_row(input, y), output->columns);
     }
 }
 
+void mat_relu(matrix_t* output, const matrix_t* input) {
+    apply_unary(vec_get_kernels()->relu, output, input);
+}
+
 void mat_sigmoid(matrix_t* output, const matrix_t* input) {
-    assert(output->rows == input->rows);
-    assert(output->columns == input->columns);
+    apply_unary(vec_get_kernels()->sigmoid, output, input);
+}
+
+/* columns per softmax pass; bounds the per-column accumulators kept on the stack */
+#define SOFTMAX_CHUNK 256
+
+static void get_column_maxes(const matrix_t* input, uint32_t x0, uint32_t count, float* maxes) {
+    for (uint32_t x = 0; x < count; x++) {
+        maxes[x] = -INFINITY;
+    }
 
-    uint32_t total = output->rows * output->columns;
-    for (uint32_t i = 0; i < total; i++) {
-        output->data[i] = sigmoid(input->data[i]);
+    for (uint32_t y = 0; y < input->rows; y++) {
+        const float* row = mat_row(input, y) + x0;
+        for (uint32_t x = 0; x < count; x++) {
+            maxes[x] = row[x] > maxes[x] ? row[x] : maxes[x];
+        }
+    }
+}
+
+/* output = exp(input - column max) for columns [x0, x0 + count); sums receives each column's
+ * total */
+static void exp_columns(matrix_t* output, const matrix_t* input, uint32_t x0, uint32_t count,
+                        const float* maxes, float* sums) {
+    const struct vec_kernels* kernels = vec_get_kernels();
+    memset(sums, 0, count * sizeof(float));
+
+    for (uint32_t y = 0; y < output->rows; y++) {
+        float* row = mat_row(output, y) + x0;
+        kernels->exp_shifted(row, mat_row(input, y) + x0, maxes, count);
+
+        for (uint32_t x = 0; x < count; x++) {
+            sums[x] += row[x];
+        }
     }
 }
 
@@ -136,17 +540,151 @@ void mat_softmax(matrix_t* output, const matrix_t* input) {
     assert(output->rows == input->rows);
     assert(output->columns == input->columns);
 
-    uint32_t total = output->rows * output->columns;
-    float sum = 0.f;
+    /* each column is normalized on its own, shifted by its max so exp cannot overflow. walk rows
+     * so every access stays contiguous */
+    float maxes[SOFTMAX_CHUNK];
+    float sums[SOFTMAX_CHUNK];
+
+    for (uint32_t x0 = 0; x0 < output->columns; x0 += SOFTMAX_CHUNK) {
+        uint32_t remaining = output->columns - x0;
+        uint32_t count = remaining < SOFTMAX_CHUNK ? remaining : SOFTMAX_CHUNK;
+
+        get_column_maxes(input, x0, count, maxes);
+        exp_columns(output, input, x0, count, maxes, sums);
 
-    for (uint32_t i = 0; i < total; i++) {
-        float expf_in = expf(input->data[i]);
-        output->data[i] = expf_in;
+        for (uint32_t x = 0; x < count; x++) {
+            sums[x] = 1.f / sums[x];
+        }
 
-        sum += expf_in;
+        for (uint32_t y = 0; y < output->rows; y++) {
+            float* row = mat_row(output, y) + x0;
+            for (uint32_t x = 0; x < count; x++) {
+                row[x] *= sums[x];
+            }
+        }
     }
+}
+
+/* gradient = a * (gradient - sum over the column of gradient * a), a column at a time */
+static void softmax_backward(matrix_t* gradient, const matrix_t* activations) {
+    float dots[SOFTMAX_CHUNK];
+
+    for (uint32_t x0 = 0; x0 < gradient->columns; x0 += SOFTMAX_CHUNK) {
+        uint32_t remaining = gradient->columns - x0;
+        uint32_t count = remaining < SOFTMAX_CHUNK ? remaining : SOFTMAX_CHUNK;
+
+        memset(dots, 0, count * sizeof(float));
+        for (uint32_t y = 0; y < gradient->rows; y++) {
+            const float* g = mat_row(gradient, y) + x0;
+            const float* a = mat_row(activations, y) + x0;
+
+            for (uint32_t x = 0; x < count; x++) {
+                dots[x] += g[x] * a[x];
+            }
+        }
+
+        for (uint32_t y = 0; y < gradient->rows; y++) {
+            float* g = mat_row(gradient, y) + x0;
+            const float* a = mat_row(activations, y) + x0;
+
+            for (uint32_t x = 0; x < count; x++) {
+                g[x] = a[x] * (g[x] - dots[x]);
+            }
+        }
+    }
+}
 
-    mat_scale(output, 1.f / sum);
+void mat_activation_backward(matrix_t* gradient, const matrix_t* activations,
+                             uint32_t activation) {
+    assert(gradient->rows == activations->rows);
+    assert(gradient->columns == activations->columns);
+
+    if (activation == MAT_ACTIVATION_SOFTMAX) {
+        softmax_backward(gradient, activations);
+        return;
+    }
+
+    for (uint32_t y = 0; y < gradient->rows; y++) {
+        float* g = mat_row(gradient, y);
+        const float* a = mat_row(activations, y);
+
+        switch (activation) {
+        case MAT_ACTIVATION_RELU:
+            /* a > 0 exactly where z > 0 */
+            for (uint32_t x = 0; x < gradient->columns; x++) {
+                g[x] = a[x] > 0.f ? g[x] : 0.f;
+            }
+
+            break;
+        case MAT_ACTIVATION_SIGMOID:
+            for (uint32_t x = 0; x < gradient->columns; x++) {
+                g[x] *= a[x] * (1.f - a[x]);
+            }
+
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+float mat_softmax_cross_entropy(matrix_t* gradient, matrix_t* losses, const matrix_t* logits,
+                                const uint8_t* labels) {
+    assert(gradient->rows == logits->rows);
+    assert(gradient->columns == logits->columns);
+
+    if (losses) {
+        assert(losses->rows == 1);
+        assert(losses->columns == logits->columns);
+    }
+
+    float maxes[SOFTMAX_CHUNK];
+    float sums[SOFTMAX_CHUNK];
+    float picked[SOFTMAX_CHUNK];
+
+    float total_loss = 0.f;
+    for (uint32_t x0 = 0; x0 < logits->columns; x0 += SOFTMAX_CHUNK) {
+        uint32_t remaining = logits->columns - x0;
+        uint32_t count = remaining < SOFTMAX_CHUNK ? remaining : SOFTMAX_CHUNK;
+
+        get_column_maxes(logits, x0, count, maxes);
+
+        /* read the labelled logits before gradient (which may alias logits) is written */
+        for (uint32_t x = 0; x < count; x++) {
+            uint8_t label = labels[x0 + x];
+            assert(label < logits->rows);
+
+            picked[x] = mat_row(logits, label)[x0 + x];
+        }
+
+        exp_columns(gradient, logits, x0, count, maxes, sums);
+
+        /* loss = log(sum(exp(z - max))) - (z_label - max) */
+        for (uint32_t x = 0; x < count; x++) {
+            float loss = logf(sums[x]) - (picked[x] - maxes[x]);
+            total_loss += loss;
+
+            if (losses) {
+                losses->data[x0 + x] = loss;
+            }
+
+            sums[x] = 1.f / sums[x];
+        }
+
+        /* gradient = softmax - onehot */
+        for (uint32_t y = 0; y < gradient->rows; y++) {
+            float* row = mat_row(gradient, y) + x0;
+            for (uint32_t x = 0; x < count; x++) {
+                row[x] *= sums[x];
+            }
+        }
+
+        for (uint32_t x = 0; x < count; x++) {
+            mat_row(gradient, labels[x0 + x])[x0 + x] -= 1.f;
+        }
+    }
+
+    return logits->columns > 0 ? total_loss / logits->columns : 0.f;
 }
 
 void mat_cross_entropy(matrix_t* output, const matrix_t* actual, const matrix_t* expected) {
@@ -156,8 +694,16 @@ void mat_cross_entropy(matrix_t* output, const matrix_t* actual, const matrix_t*
     assert(actual->rows == expected->rows);
     assert(actual->columns == expected->columns);
 
-    uint32_t total = output->rows * output->columns;
-    for (uint32_t i = 0; i < total; i++) {
-        output->data[i] = cross_entropy(actual->data[i], expected->data[i]);
+    const struct vec_kernels* kernels = vec_get_kernels();
+    if (mat_is_contiguous(output) && mat_is_contiguous(actual) && mat_is_contiguous(expected)) {
+        uint32_t total = output->rows * output->columns;
+        kernels->cross_entropy(output->data, actual->data, expected->data, total);
+
+        return;
+    }
+
+    for (uint32_t y = 0; y < output->rows; y++) {
+        kernels->cross_entropy(mat_row(output, y), mat_row(actual, y), mat_row(expected, y),
+                               output->columns);
     }
 }
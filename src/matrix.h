@@ -1,19 +1,96 @@
 #ifndef _MATRIX_H
 #define _MATRIX_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+/* data is always aligned to this many bytes */
+#define MAT_ALIGNMENT 64
+
+/* element storage. half precision matrices (see half.h) can be read by mat_mul and
+ * mat_mul_bias_activate, which accumulate in fp32, and converted with mat_copy. everything else
+ * expects fp32 */
+enum {
+    MAT_TYPE_F32 = 0,
+    MAT_TYPE_BF16,
+    MAT_TYPE_F16,
+};
+
 typedef struct matrix {
     uint32_t rows, columns;
-    float* data;
+
+    /* elements between the starts of consecutive rows; at least columns */
+    uint32_t stride;
+    uint32_t flags;
+
+    /* one of MAT_TYPE_*; selects the valid member below */
+    uint32_t type;
+
+    union {
+        float* data;
+        uint16_t* half;
+    };
 } matrix_t;
 
+enum {
+    /* pad every row to a multiple of MAT_ALIGNMENT bytes so each row starts aligned */
+    MAT_ALLOC_PAD_ROWS = (1 << 0),
+
+    /* back matrices of at least 2 MiB with transparent huge pages. ignored when allocating through
+     * an nv_allocator */
+    MAT_ALLOC_HUGE_PAGES = (1 << 1),
+
+    /* store elements as MAT_TYPE_BF16 or MAT_TYPE_F16 instead of fp32 */
+    MAT_ALLOC_BF16 = (1 << 2),
+    MAT_ALLOC_F16 = (1 << 3),
+};
+
+/* the MAT_ALLOC_* flag selecting type; 0 for fp32 */
+uint32_t mat_get_type_flag(uint32_t type);
+
 struct nv_allocator;
 
 matrix_t* mat_alloc(const struct nv_allocator* alloc, uint32_t rows, uint32_t columns);
+matrix_t* mat_alloc_ex(const struct nv_allocator* alloc, uint32_t rows, uint32_t columns,
+                       uint32_t flags);
+
 void mat_free(const struct nv_allocator* alloc, matrix_t* mat);
 
+/* size of the single block mat_alloc_ex requests from an allocator */
+size_t mat_get_alloc_size(uint32_t rows, uint32_t columns, uint32_t flags);
+
+/* bytes of element storage a rows x columns matrix with flags covers, rounded up to MAT_ALIGNMENT
+ * so that views can be packed back to back in one block */
+size_t mat_get_data_size(uint32_t rows, uint32_t columns, uint32_t flags);
+
+/* sets up mat (e.g. embedded in a larger structure) to view data, which must be MAT_ALIGNMENT
+ * aligned and at least mat_get_data_size bytes. data is not touched, so it may be read-only; any
+ * row padding in it must already be zero. the view does not own data and must never be passed to
+ * mat_free */
+void mat_init_view(matrix_t* mat, void* data, uint32_t rows, uint32_t columns, uint32_t flags);
+
+static inline size_t mat_get_element_size(const matrix_t* mat) {
+    return mat->type == MAT_TYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+static inline float* mat_row(const matrix_t* mat, uint32_t y) {
+    return mat->data + (size_t)y * mat->stride;
+}
+
+static inline uint16_t* mat_half_row(const matrix_t* mat, uint32_t y) {
+    return mat->half + (size_t)y * mat->stride;
+}
+
+/* row y of a matrix of any type */
+static inline void* mat_row_data(const matrix_t* mat, uint32_t y) {
+    return (char*)mat->data + (size_t)y * mat->stride * mat_get_element_size(mat);
+}
+
+/* true if there is no padding between rows */
+static inline bool mat_is_contiguous(const matrix_t* mat) { return mat->stride == mat->columns; }
+
+/* converts between types if dst and src differ */
 void mat_copy(matrix_t* dst, const matrix_t* src);
 
 /* from prng.h */
@@ -28,13 +105,63 @@ enum {
     MAT_MUL_ZERO_RESULT = (1 << 2),
 };
 
-void mat_mul(matrix_t* result, const matrix_t* lhs, const matrix_t* rhs, uint32_t flags);
+/* from pool.h */
+struct thread_pool;
+
+/* large products passed to mat_mul are split across pool. NULL (the default) runs everything on
+ * the calling thread */
+void mat_set_thread_pool(struct thread_pool* pool);
+
+/* from gemm.h */
+typedef struct gemm_plan gemm_plan_t;
+
+/* generated code for products of one shape (see gemm_plan_alloc): a rows x columns result of inner
+ * products of length inner, with flags' MAT_MUL_TRANSPOSE_* bits. NULL if none could be generated.
+ * freed with gemm_plan_free */
+gemm_plan_t* mat_plan_mul(uint32_t flags, uint32_t rows, uint32_t columns, uint32_t inner);
+
+/* plan may be NULL. one made for a different shape is ignored */
+void mat_mul(matrix_t* result, const matrix_t* lhs, const matrix_t* rhs, uint32_t flags,
+             const gemm_plan_t* plan);
+
+enum {
+    MAT_ACTIVATION_NONE = 0,
+    MAT_ACTIVATION_RELU,
+    MAT_ACTIVATION_SIGMOID,
+    MAT_ACTIVATION_SOFTMAX,
+};
+
+/* output = A(weights * input + biases) in one pass, with biases (a column vector) broadcast across
+ * columns. the bias and activation are applied to each output tile as the product finishes it. z,
+ * if not NULL, receives the values before the activation */
+void mat_mul_bias_activate(matrix_t* output, matrix_t* z, const matrix_t* weights,
+                           const matrix_t* input, const matrix_t* biases, uint32_t activation,
+                           const gemm_plan_t* plan);
 
 void mat_scale(matrix_t* mat, float scalar);
 
+/* dst += scalar * src */
+void mat_add_scaled(matrix_t* dst, const matrix_t* src, float scalar);
+
+/* sums (rows x 1) += the sum of each row of mat, e.g. a gradient summed over a batch */
+void mat_add_row_sums(matrix_t* sums, const matrix_t* mat);
+
 void mat_relu(matrix_t* output, const matrix_t* input);
 void mat_sigmoid(matrix_t* output, const matrix_t* input);
+/* normalizes each column independently; a column is one sample of a batch */
 void mat_softmax(matrix_t* output, const matrix_t* input);
 void mat_cross_entropy(matrix_t* output, const matrix_t* actual, const matrix_t* expected);
 
+/* turns gradient (with respect to A(z)) into the gradient with respect to z, in place. activations
+ * are the forward outputs A(z), which is all any MAT_ACTIVATION_* needs. softmax is treated per
+ * column */
+void mat_activation_backward(matrix_t* gradient, const matrix_t* activations, uint32_t activation);
+
+/* softmax + cross-entropy against labels (one per column) in one pass over logits, using
+ * log-sum-exp so large logits cannot overflow. gradient (may alias logits) receives
+ * softmax - onehot; losses (1 x batch, may be NULL) receives each sample's loss. returns the mean
+ * loss over the batch */
+float mat_softmax_cross_entropy(matrix_t* gradient, matrix_t* losses, const matrix_t* logits,
+                                const uint8_t* labels);
+
 #endif
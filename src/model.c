@@ -1,23 +1,202 @@
 #include "model.h"
 
 #include "matrix.h"
+#include "arena.h"
+#include "gemm.h"
+#include "sparse.h"
+#include "svd.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
 
 #include <nyoravim/mem.h>
 #include <nyoravim/log.h>
 
-model_t* model_alloc(const struct nv_allocator* alloc, uint32_t input_size, uint32_t num_layers,
-                     const struct model_layer_spec* layers) {
+/* weight rows start on a cache line */
+static uint32_t get_weight_flags(uint32_t type) {
+    return MAT_ALLOC_PAD_ROWS | mat_get_type_flag(type);
+}
+
+static uint32_t get_spec_type(uint32_t op) {
+    return (op & ~(LAYER_SPEC_SPARSE | LAYER_SPEC_LOW_RANK)) >> LAYER_SPEC_TYPE_SHIFT;
+}
+
+/* where the model's matrices go. each layer has two views (biases, weights), one sparse view and
+ * two factor views */
+struct parameter_views {
+    matrix_t* views;
+    sparse_matrix_t* sparse_views;
+    matrix_t* factor_views;
+};
+
+/* lays each layer's biases and then weights out back to back, every matrix starting on a cache
+ * line, and returns the bytes that covers. extents give the nonzero count of sparse layers and the
+ * rank of low-rank ones (extents may be NULL if there are neither). with parameters NULL this only
+ * measures; otherwise views are pointed into parameters and handed to layers */
+static size_t layout_parameters(uint32_t input_size, uint32_t num_layers,
+                                const struct model_layer_spec* specs, const uint32_t* extents,
+                                void* parameters, const struct parameter_views* views,
+                                struct model_layer* layers) {
+    size_t offset = 0;
+    for (uint32_t i = 0; i < num_layers; i++) {
+        /* layer sizes have the input layer at the front hence the +1 offset */
+        uint32_t previous_size = i > 0 ? specs[i - 1].size : input_size;
+        uint32_t current_size = specs[i].size;
+
+        bool sparse = specs[i].op & LAYER_SPEC_SPARSE;
+        bool low_rank = specs[i].op & LAYER_SPEC_LOW_RANK;
+        assert(!(sparse || low_rank) || extents);
+
+        uint32_t weight_flags = get_weight_flags(get_spec_type(specs[i].op));
+
+        size_t bias_size = mat_get_data_size(current_size, 1, 0);
+        size_t weight_size, left_size = 0;
+
+        if (sparse) {
+            weight_size = sparse_get_data_size(current_size, extents[i]);
+        } else if (low_rank) {
+            left_size = mat_get_data_size(current_size, extents[i], weight_flags);
+            weight_size = left_size + mat_get_data_size(extents[i], previous_size, weight_flags);
+        } else {
+            weight_size = mat_get_data_size(current_size, previous_size, weight_flags);
+        }
+
+        if (parameters) {
+            matrix_t* biases = &views->views[i * 2];
+            matrix_t* weights = &views->views[i * 2 + 1];
+
+            void* weight_data = parameters + offset + bias_size;
+            mat_init_view(biases, parameters + offset, current_size, 1, 0);
+
+            layers[i].biases = biases;
+            layers[i].weights = weights;
+            layers[i].sparse = NULL;
+            layers[i].factors = NULL;
+
+            if (sparse) {
+                /* the dense view only carries the shape */
+                mat_init_view(weights, NULL, current_size, previous_size, 0);
+
+                sparse_init_view(&views->sparse_views[i], weight_data, current_size,
+                                 previous_size, extents[i]);
+
+                layers[i].sparse = &views->sparse_views[i];
+            } else if (low_rank) {
+                mat_init_view(weights, NULL, current_size, previous_size, weight_flags);
+
+                matrix_t* factors = &views->factor_views[i * 2];
+                mat_init_view(&factors[0], weight_data, current_size, extents[i], weight_flags);
+                mat_init_view(&factors[1], weight_data + left_size, extents[i], previous_size,
+                              weight_flags);
+
+                layers[i].factors = factors;
+            } else {
+                mat_init_view(weights, weight_data, current_size, previous_size, weight_flags);
+            }
+        }
+
+        offset += bias_size + weight_size;
+    }
+
+    return offset;
+}
+
+static void get_model_views(const model_t* model, struct parameter_views* views) {
+    views->views = model->views;
+    views->sparse_views = model->sparse_views;
+    views->factor_views = model->factor_views;
+}
+
+/* the whole block as one fp32 row; large models may sit on huge pages */
+static matrix_t* alloc_parameters(const struct nv_allocator* alloc, size_t size) {
+    assert(size % sizeof(float) == 0);
+    assert(size / sizeof(float) <= UINT32_MAX);
+
+    matrix_t* parameters =
+        mat_alloc_ex(alloc, 1, (uint32_t)(size / sizeof(float)), MAT_ALLOC_HUGE_PAGES);
+    assert(parameters);
+
+    /* views expect their row padding to be zero already */
+    mat_zero(parameters);
+    return parameters;
+}
+
+/* the specs model would be allocated from */
+static void get_layer_specs(const model_t* model, struct model_layer_spec* specs) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        specs[i].op = layer->op | (layer->weights->type << LAYER_SPEC_TYPE_SHIFT);
+        specs[i].size = layer->weights->rows;
+
+        if (layer->sparse) {
+            specs[i].op |= LAYER_SPEC_SPARSE;
+        }
+
+        if (layer->factors) {
+            specs[i].op |= LAYER_SPEC_LOW_RANK;
+        }
+    }
+}
+
+/* the nonzero count of each sparse layer and the rank of each low-rank one; 0 for dense ones */
+static void get_layer_extents(const model_t* model, uint32_t* extents) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        extents[i] = 0;
+        if (layer->sparse) {
+            extents[i] = layer->sparse->nonzeros;
+        } else if (layer->factors) {
+            extents[i] = layer->factors[0].columns;
+        }
+    }
+}
+
+/* everything but the parameter block. layers are left for layout_parameters */
+static model_t* alloc_model_struct(const struct nv_allocator* alloc, uint32_t num_layers,
+                                   const struct model_layer_spec* layers) {
     if (num_layers < 1) {
         NV_LOG_ERROR("each network must have at least 1 layer!");
         return NULL;
     }
 
+    for (uint32_t i = 0; i < num_layers; i++) {
+        uint32_t type = get_spec_type(layers[i].op);
+        if (type > MAT_TYPE_F16) {
+            NV_LOG_ERROR("layer %u has unknown weight type %u!", i, type);
+            return NULL;
+        }
+
+        if ((layers[i].op & LAYER_SPEC_SPARSE) && type != MAT_TYPE_F32) {
+            NV_LOG_ERROR("sparse layer %u must have fp32 values!", i);
+            return NULL;
+        }
+
+        if ((layers[i].op & LAYER_SPEC_SPARSE) && (layers[i].op & LAYER_SPEC_LOW_RANK)) {
+            NV_LOG_ERROR("layer %u cannot be both sparse and low-rank!", i);
+            return NULL;
+        }
+    }
+
     NV_LOG_TRACE("allocating model with %u layers", num_layers);
-    size_t model_size = sizeof(model_t) + num_layers * sizeof(struct model_layer);
+    size_t layers_size = num_layers * sizeof(struct model_layer);
+
+    /* two views per layer, plus one over a file mapping */
+    size_t views_size = (num_layers * 2 + 1) * sizeof(matrix_t);
+    size_t sparse_views_size = num_layers * sizeof(sparse_matrix_t);
+    size_t factor_views_size = num_layers * 2 * sizeof(matrix_t);
+    size_t model_size =
+        sizeof(model_t) + layers_size + views_size + sparse_views_size + factor_views_size;
 
     model_t* model;
     if (alloc) {
@@ -36,183 +215,1603 @@ model_t* model_alloc(const struct nv_allocator* alloc, uint32_t input_size, uint
 
     model->num_layers = num_layers;
     model->layers = (void*)model + sizeof(model_t);
+    model->views = (void*)model->layers + layers_size;
+    model->sparse_views = (void*)model->views + views_size;
+    model->factor_views = (void*)model->sparse_views + sparse_views_size;
+
+    model->parameters = NULL;
+    model->mapping = NULL;
+    model->mapping_size = 0;
 
     for (uint32_t i = 0; i < num_layers; i++) {
-        /* layer sizes have the input layer at the front hence the +1 offset */
-        uint32_t previous_size = i > 0 ? layers[i - 1].size : input_size;
-        uint32_t current_size = layers[i].size;
+        model->layers[i].op = layers[i].op & LAYER_SPEC_OP_MASK;
+    }
+
+    return model;
+}
+
+static void log_layers(const model_t* model) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        NV_LOG_DEBUG("layer %u: %u>%u, op %u, type %u", i, layer->weights->columns,
+                     layer->weights->rows, layer->op, layer->weights->type);
+
+        if (layer->sparse) {
+            double size = (double)layer->weights->rows * layer->weights->columns;
+            double zeros = 1.0 - layer->sparse->nonzeros / size;
+
+            NV_LOG_DEBUG("layer %u: sparse, %u nonzeros (%.1f%% zeros)", i,
+                         layer->sparse->nonzeros, zeros * 100.0);
+        }
+
+        if (layer->factors) {
+            NV_LOG_DEBUG("layer %u: low-rank, rank %u", i, layer->factors[0].columns);
+        }
+    }
+
+    NV_LOG_DEBUG("%zu bytes of parameters", (size_t)model->parameters->columns * sizeof(float));
+}
+
+/* model_alloc, with the extents of any sparse or low-rank layers (see layout_parameters) */
+static model_t* alloc_model(const struct nv_allocator* alloc, uint32_t input_size,
+                            uint32_t num_layers, const struct model_layer_spec* layers,
+                            const uint32_t* extents) {
+    model_t* model = alloc_model_struct(alloc, num_layers, layers);
+    if (!model) {
+        return NULL;
+    }
+
+    size_t parameters_size =
+        layout_parameters(input_size, num_layers, layers, extents, NULL, NULL, NULL);
+    model->parameters = alloc_parameters(alloc, parameters_size);
+
+    struct parameter_views views;
+    get_model_views(model, &views);
+
+    layout_parameters(input_size, num_layers, layers, extents, model->parameters->data, &views,
+                      model->layers);
+
+    log_layers(model);
+    return model;
+}
+
+model_t* model_alloc(const struct nv_allocator* alloc, uint32_t input_size, uint32_t num_layers,
+                     const struct model_layer_spec* layers) {
+    for (uint32_t i = 0; i < num_layers; i++) {
+        if (layers[i].op & LAYER_SPEC_SPARSE) {
+            NV_LOG_ERROR("layer %u is sparse; only existing models can be made sparse", i);
+            return NULL;
+        }
+
+        if (layers[i].op & LAYER_SPEC_LOW_RANK) {
+            NV_LOG_ERROR("layer %u is low-rank; only existing models can be factorized", i);
+            return NULL;
+        }
+    }
+
+    return alloc_model(alloc, input_size, num_layers, layers, NULL);
+}
+
+static void free_parameters(model_t* model) {
+    if (model->mapping) {
+        munmap(model->mapping, model->mapping_size);
+
+        model->mapping = NULL;
+        model->mapping_size = 0;
+    } else {
+        mat_free(model->alloc, model->parameters);
+    }
+
+    model->parameters = NULL;
+}
+
+void model_free(model_t* model) {
+    if (!model) {
+        return;
+    }
+
+    /* the layers' matrices are views into this */
+    free_parameters(model);
+
+    if (!model->alloc) {
+        nv_free(model);
+    } else {
+        struct nv_allocator alloc;
+        memcpy(&alloc, model->alloc, sizeof(struct nv_allocator));
+
+        if (alloc.free) {
+            alloc.free(alloc.user, model);
+        }
+    }
+}
+
+/* maps mat_randomize's [0, 1] onto [-limit, limit] */
+static void center_weights(matrix_t* weights, float limit) {
+    for (uint32_t y = 0; y < weights->rows; y++) {
+        float* row = mat_row(weights, y);
+        for (uint32_t x = 0; x < weights->columns; x++) {
+            row[x] = (2.f * row[x] - 1.f) * limit;
+        }
+    }
+}
+
+model_t* model_clone(const struct nv_allocator* alloc, const model_t* model) {
+    struct model_layer_spec* specs = nv_alloc(model->num_layers * sizeof(struct model_layer_spec));
+    uint32_t* extents = nv_alloc(model->num_layers * sizeof(uint32_t));
+    assert(specs && extents);
+
+    get_layer_specs(model, specs);
+    get_layer_extents(model, extents);
+
+    model_t* clone =
+        alloc_model(alloc, model_get_input_size(model), model->num_layers, specs, extents);
+
+    nv_free(extents);
+    nv_free(specs);
+
+    if (clone) {
+        model_copy(clone, model);
+    }
+
+    return clone;
+}
+
+/* true if both parameter blocks are laid out the same, i.e. every weight type and sparse or
+ * low-rank layer matches */
+static bool has_same_layout(const model_t* a, const model_t* b) {
+    if (a->parameters->columns != b->parameters->columns) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < a->num_layers; i++) {
+        const struct model_layer* layer_a = &a->layers[i];
+        const struct model_layer* layer_b = &b->layers[i];
+
+        if (layer_a->weights->type != layer_b->weights->type) {
+            return false;
+        }
+
+        if (!layer_a->sparse != !layer_b->sparse ||
+            (layer_a->sparse && layer_a->sparse->nonzeros != layer_b->sparse->nonzeros)) {
+            return false;
+        }
+
+        if (!layer_a->factors != !layer_b->factors ||
+            (layer_a->factors && layer_a->factors[0].columns != layer_b->factors[0].columns)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void model_copy(model_t* dst, const model_t* src) {
+    assert(dst->num_layers == src->num_layers);
+
+    for (uint32_t i = 0; i < src->num_layers; i++) {
+        dst->layers[i].op = src->layers[i].op;
+    }
+
+    /* one sweep; the block is copied bit for bit, whatever it holds */
+    if (has_same_layout(dst, src)) {
+        mat_copy(dst->parameters, src->parameters);
+        return;
+    }
+
+    for (uint32_t i = 0; i < src->num_layers; i++) {
+        const struct model_layer* src_layer = &src->layers[i];
+        struct model_layer* dst_layer = &dst->layers[i];
+
+        /* only weight types can differ; sparse and low-rank layers have to match */
+        assert(!src_layer->sparse == !dst_layer->sparse);
+        assert(!src_layer->factors == !dst_layer->factors);
+
+        if (src_layer->sparse) {
+            sparse_copy(dst_layer->sparse, src_layer->sparse);
+        } else if (src_layer->factors) {
+            mat_copy(&dst_layer->factors[0], &src_layer->factors[0]);
+            mat_copy(&dst_layer->factors[1], &src_layer->factors[1]);
+        } else {
+            mat_copy(dst_layer->weights, src_layer->weights);
+        }
+
+        mat_copy(dst_layer->biases, src_layer->biases);
+    }
+}
+
+void model_randomize(struct prng* rng, model_t* model) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        struct model_layer* layer = &model->layers[i];
+        assert(layer->weights->type == MAT_TYPE_F32 && !layer->sparse && !layer->factors);
+
+        /* xavier/glorot: keeps z around unit variance so sigmoid and softmax start out of
+         * saturation, where gradients vanish */
+        uint32_t fan_in = layer->weights->columns;
+        uint32_t fan_out = layer->weights->rows;
+
+        mat_randomize(rng, layer->weights);
+        center_weights(layer->weights, sqrtf(6.f / (float)(fan_in + fan_out)));
+
+        mat_zero(layer->biases);
+    }
+}
+
+/* factors = the truncated svd of weights, with each singular value split evenly between the two
+ * sides so that neither factor's scale runs away from the other's */
+static void factorize_weights(matrix_t* factors, const matrix_t* weights) {
+    uint32_t rows = weights->rows;
+    uint32_t columns = weights->columns;
+    uint32_t k = rows < columns ? rows : columns;
+    uint32_t rank = factors[0].columns;
+
+    matrix_t* u = mat_alloc(NULL, rows, k);
+    matrix_t* vt = mat_alloc(NULL, k, columns);
+    float* values = nv_alloc(k * sizeof(float));
+    assert(u && vt && values);
+
+    svd_decompose(weights, u, values, vt);
+
+    /* staged in fp32 so mat_copy can convert to the factors' type */
+    matrix_t* left = mat_alloc(NULL, rows, rank);
+    matrix_t* right = mat_alloc(NULL, rank, columns);
+    assert(left && right);
+
+    for (uint32_t j = 0; j < rank; j++) {
+        float scale = sqrtf(values[j]);
+
+        for (uint32_t y = 0; y < rows; y++) {
+            mat_row(left, y)[j] = mat_row(u, y)[j] * scale;
+        }
+
+        for (uint32_t x = 0; x < columns; x++) {
+            mat_row(right, j)[x] = mat_row(vt, j)[x] * scale;
+        }
+    }
+
+    mat_copy(&factors[0], left);
+    mat_copy(&factors[1], right);
+
+    mat_free(NULL, right);
+    mat_free(NULL, left);
+
+    nv_free(values);
+    mat_free(NULL, vt);
+    mat_free(NULL, u);
+}
+
+/* moves the parameters into a new block laid out for specs and extents, converting each layer's
+ * weights as they are copied over. a layer can change type or become sparse or low-rank, but never
+ * dense again */
+static void relayout_parameters(model_t* model, const struct model_layer_spec* specs,
+                                const uint32_t* extents) {
+    uint32_t num_layers = model->num_layers;
+    uint32_t input_size = model_get_input_size(model);
+
+    /* lay out a new block next to the old one, convert into it, then take it over */
+    size_t parameters_size =
+        layout_parameters(input_size, num_layers, specs, extents, NULL, NULL, NULL);
+    matrix_t* parameters = alloc_parameters(model->alloc, parameters_size);
+
+    struct parameter_views views;
+    views.views = nv_alloc(num_layers * 2 * sizeof(matrix_t));
+    views.sparse_views = nv_alloc(num_layers * sizeof(sparse_matrix_t));
+    views.factor_views = nv_alloc(num_layers * 2 * sizeof(matrix_t));
+    struct model_layer* layers = nv_alloc(num_layers * sizeof(struct model_layer));
+    assert(views.views && views.sparse_views && views.factor_views && layers);
+
+    layout_parameters(input_size, num_layers, specs, extents, parameters->data, &views, layers);
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        struct model_layer* layer = &model->layers[i];
+
+        if (layers[i].sparse && layer->sparse) {
+            sparse_copy(layers[i].sparse, layer->sparse);
+        } else if (layers[i].sparse) {
+            sparse_from_dense(layers[i].sparse, layer->weights);
+        } else if (layers[i].factors && layer->factors) {
+            mat_copy(&layers[i].factors[0], &layer->factors[0]);
+            mat_copy(&layers[i].factors[1], &layer->factors[1]);
+        } else if (layers[i].factors) {
+            factorize_weights(layers[i].factors, layer->weights);
+        } else {
+            assert(!layer->sparse && !layer->factors);
+            mat_copy(layers[i].weights, layer->weights);
+        }
+
+        mat_copy(layers[i].biases, layer->biases);
+
+        /* weights and biases already point at model->views */
+        layer->sparse = layers[i].sparse ? &model->sparse_views[i] : NULL;
+        layer->factors = layers[i].factors ? &model->factor_views[i * 2] : NULL;
+    }
+
+    memcpy(model->views, views.views, num_layers * 2 * sizeof(matrix_t));
+    memcpy(model->sparse_views, views.sparse_views, num_layers * sizeof(sparse_matrix_t));
+    memcpy(model->factor_views, views.factor_views, num_layers * 2 * sizeof(matrix_t));
+
+    /* drops a file mapping too; the model then owns its parameters */
+    free_parameters(model);
+    model->parameters = parameters;
+
+    nv_free(layers);
+    nv_free(views.factor_views);
+    nv_free(views.sparse_views);
+    nv_free(views.views);
+}
+
+void model_set_weight_type(model_t* model, uint32_t type) {
+    uint32_t num_layers = model->num_layers;
+
+    struct model_layer_spec* specs = nv_alloc(num_layers * sizeof(struct model_layer_spec));
+    uint32_t* extents = nv_alloc(num_layers * sizeof(uint32_t));
+    assert(specs && extents);
+
+    get_layer_specs(model, specs);
+    get_layer_extents(model, extents);
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        /* sparse values stay fp32; low-rank factors are converted like any dense weights */
+        if (!(specs[i].op & LAYER_SPEC_SPARSE)) {
+            uint32_t flags = specs[i].op & LAYER_SPEC_LOW_RANK;
+            specs[i].op =
+                (specs[i].op & LAYER_SPEC_OP_MASK) | (type << LAYER_SPEC_TYPE_SHIFT) | flags;
+        }
+    }
+
+    relayout_parameters(model, specs, extents);
+
+    nv_free(extents);
+    nv_free(specs);
+}
+
+static int compare_floats(const void* lhs, const void* rhs) {
+    float a = *(const float*)lhs;
+    float b = *(const float*)rhs;
+
+    return (a > b) - (a < b);
+}
+
+void model_prune_layer(model_t* model, uint32_t index, float sparsity) {
+    assert(index < model->num_layers);
+
+    matrix_t* weights = model->layers[index].weights;
+    assert(weights->type == MAT_TYPE_F32 && !model->layers[index].sparse &&
+           !model->layers[index].factors);
+
+    size_t count = (size_t)weights->rows * weights->columns;
+    size_t target = (size_t)ceil((double)sparsity * count);
+    target = target < count ? target : count;
+
+    if (target == 0) {
+        return;
+    }
+
+    float* magnitudes = nv_alloc(count * sizeof(float));
+    assert(magnitudes);
+
+    for (uint32_t y = 0; y < weights->rows; y++) {
+        const float* row = mat_row(weights, y);
+        for (uint32_t x = 0; x < weights->columns; x++) {
+            magnitudes[(size_t)y * weights->columns + x] = fabsf(row[x]);
+        }
+    }
+
+    /* everything at or below the target'th smallest magnitude goes; ties may take a few more */
+    qsort(magnitudes, count, sizeof(float), compare_floats);
+    float threshold = magnitudes[target - 1];
+    nv_free(magnitudes);
+
+    for (uint32_t y = 0; y < weights->rows; y++) {
+        float* row = mat_row(weights, y);
+        for (uint32_t x = 0; x < weights->columns; x++) {
+            if (fabsf(row[x]) <= threshold) {
+                row[x] = 0.f;
+            }
+        }
+    }
+
+    NV_LOG_DEBUG("pruned layer %u to %zu of %zu weights", index, count - target, count);
+}
+
+uint32_t model_sparsify(model_t* model) {
+    uint32_t num_layers = model->num_layers;
+
+    struct model_layer_spec* specs = nv_alloc(num_layers * sizeof(struct model_layer_spec));
+    uint32_t* extents = nv_alloc(num_layers * sizeof(uint32_t));
+    assert(specs && extents);
+
+    get_layer_specs(model, specs);
+    get_layer_extents(model, extents);
+
+    uint32_t sparse_count = 0;
+    bool changed = false;
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+        if (layer->sparse) {
+            sparse_count++;
+            continue;
+        }
+
+        if (layer->factors || layer->weights->type != MAT_TYPE_F32 ||
+            layer->weights->columns > SPARSE_MAX_COLUMNS) {
+            continue;
+        }
+
+        uint32_t count = sparse_count_nonzeros(layer->weights);
+        double size = (double)layer->weights->rows * layer->weights->columns;
+
+        if (1.0 - count / size < MODEL_SPARSE_MIN_SPARSITY) {
+            continue;
+        }
+
+        specs[i].op |= LAYER_SPEC_SPARSE;
+        extents[i] = count;
+
+        sparse_count++;
+        changed = true;
+    }
+
+    if (changed) {
+        relayout_parameters(model, specs, extents);
+        log_layers(model);
+    }
+
+    nv_free(extents);
+    nv_free(specs);
+
+    return sparse_count;
+}
+
+bool model_has_sparse_layers(const model_t* model) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        if (model->layers[i].sparse) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t model_get_layer_rank(const model_t* model, uint32_t index, float energy) {
+    assert(index < model->num_layers);
+
+    const struct model_layer* layer = &model->layers[index];
+    assert(!layer->sparse && !layer->factors);
+
+    uint32_t rows = layer->weights->rows;
+    uint32_t columns = layer->weights->columns;
+    uint32_t k = rows < columns ? rows : columns;
+
+    float* values = nv_alloc(k * sizeof(float));
+    assert(values);
+
+    svd_decompose(layer->weights, NULL, values, NULL);
+
+    double total = 0.0;
+    for (uint32_t i = 0; i < k; i++) {
+        total += (double)values[i] * values[i];
+    }
+
+    /* a zero matrix keeps all of its energy at any rank */
+    uint32_t rank = 1;
+    double kept = (double)values[0] * values[0];
+
+    while (rank < k && kept < energy * total) {
+        kept += (double)values[rank] * values[rank];
+        rank++;
+    }
+
+    nv_free(values);
+    return rank;
+}
+
+uint64_t model_get_layer_flops(const model_t* model, uint32_t index) {
+    assert(index < model->num_layers);
+
+    const struct model_layer* layer = &model->layers[index];
+    uint64_t rows = layer->weights->rows;
+    uint64_t columns = layer->weights->columns;
+
+    if (layer->sparse) {
+        return 2 * (uint64_t)layer->sparse->nonzeros;
+    }
+
+    if (layer->factors) {
+        return 2 * (uint64_t)layer->factors[0].columns * (rows + columns);
+    }
+
+    return 2 * rows * columns;
+}
+
+uint32_t model_factorize(model_t* model, const uint32_t* ranks) {
+    uint32_t num_layers = model->num_layers;
+
+    struct model_layer_spec* specs = nv_alloc(num_layers * sizeof(struct model_layer_spec));
+    uint32_t* extents = nv_alloc(num_layers * sizeof(uint32_t));
+    assert(specs && extents);
+
+    get_layer_specs(model, specs);
+    get_layer_extents(model, extents);
+
+    uint32_t low_rank_count = 0;
+    bool changed = false;
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+        if (layer->factors) {
+            low_rank_count++;
+            continue;
+        }
+
+        if (layer->sparse || ranks[i] == 0) {
+            continue;
+        }
+
+        uint64_t rows = layer->weights->rows;
+        uint64_t columns = layer->weights->columns;
+
+        uint32_t rank = ranks[i];
+        rank = rank < rows ? rank : (uint32_t)rows;
+        rank = rank < columns ? rank : (uint32_t)columns;
+
+        /* two products of this rank would cost as much as the one they replace */
+        if (rank * (rows + columns) >= rows * columns) {
+            NV_LOG_DEBUG("layer %u: rank %u saves nothing over %ux%u; left dense", i, rank,
+                         (uint32_t)rows, (uint32_t)columns);
+            continue;
+        }
+
+        specs[i].op |= LAYER_SPEC_LOW_RANK;
+        extents[i] = rank;
+
+        low_rank_count++;
+        changed = true;
+    }
+
+    if (changed) {
+        relayout_parameters(model, specs, extents);
+        log_layers(model);
+    }
+
+    nv_free(extents);
+    nv_free(specs);
+
+    return low_rank_count;
+}
+
+bool model_has_low_rank_layers(const model_t* model) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        if (model->layers[i].factors) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t model_get_input_size(const model_t* model) { return model->layers[0].weights->columns; }
+
+uint32_t model_get_output_size(const model_t* model) {
+    return model->layers[model->num_layers - 1].weights->rows;
+}
+
+/* z = w * a_0 (+ b), for every sample of the batch. sparse layers have their own kernel, and
+ * low-rank ones multiply by their left factor here */
+static gemm_plan_t* get_forward_plan(const struct model_layer* layer, uint32_t batch_size) {
+    if (layer->sparse) {
+        return NULL;
+    }
+
+    if (layer->factors) {
+        return mat_plan_mul(0, layer->weights->rows, batch_size, layer->factors[0].columns);
+    }
+
+    return mat_plan_mul(0, layer->weights->rows, batch_size, layer->weights->columns);
+}
+
+/* the right factor's product, rank x batch_size, which low-rank layers run first */
+static gemm_plan_t* get_bottleneck_plan(const struct model_layer* layer, uint32_t batch_size) {
+    if (!layer->factors) {
+        return NULL;
+    }
+
+    return mat_plan_mul(0, layer->factors[1].rows, batch_size, layer->weights->columns);
+}
+
+struct forwardprop_layer_output* model_alloc_forwardprop(const model_t* model,
+                                                         const struct nv_allocator* alloc,
+                                                         uint32_t batch_size, uint32_t flags) {
+    size_t size = model->num_layers * sizeof(struct forwardprop_layer_output);
+
+    struct forwardprop_layer_output* output;
+    if (alloc) {
+        output = alloc->alloc(alloc->user, size);
+    } else {
+        NV_LOG_TRACE("allocating forwardprop outputs for a batch of %u", batch_size);
+        output = nv_alloc(size);
+    }
+
+    assert(output);
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        uint32_t layer_size = model->layers[i].weights->rows;
+
+        output[i].z = NULL;
+        if (flags & FORWARDPROP_KEEP_Z) {
+            output[i].z = mat_alloc(alloc, layer_size, batch_size);
+            assert(output[i].z);
+        }
+
+        output[i].activations = mat_alloc(alloc, layer_size, batch_size);
+        assert(output[i].activations);
+
+        output[i].plan = get_forward_plan(&model->layers[i], batch_size);
+
+        output[i].bottleneck = NULL;
+        output[i].bottleneck_plan = get_bottleneck_plan(&model->layers[i], batch_size);
+
+        const matrix_t* factors = model->layers[i].factors;
+        if (factors) {
+            output[i].bottleneck = mat_alloc(alloc, factors[1].rows, batch_size);
+            assert(output[i].bottleneck);
+        }
+    }
+
+    return output;
+}
+
+void model_free_forwardprop(const model_t* model, const struct nv_allocator* alloc,
+                            struct forwardprop_layer_output* output) {
+    if (!output) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        mat_free(alloc, output[i].z);
+        mat_free(alloc, output[i].activations);
+        mat_free(alloc, output[i].bottleneck);
+
+        /* never from alloc */
+        gemm_plan_free(output[i].plan);
+        gemm_plan_free(output[i].bottleneck_plan);
+    }
+
+    if (!alloc) {
+        nv_free(output);
+    } else if (alloc->free) {
+        alloc->free(alloc->user, output);
+    }
+}
+
+size_t model_get_forwardprop_size(const model_t* model, uint32_t batch_size, uint32_t flags) {
+    size_t size = arena_get_footprint(model->num_layers * sizeof(struct forwardprop_layer_output));
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        uint32_t layer_size = model->layers[i].weights->rows;
+        size_t matrix_size = arena_get_footprint(mat_get_alloc_size(layer_size, batch_size, 0));
+
+        size += matrix_size;
+        if (flags & FORWARDPROP_KEEP_Z) {
+            size += matrix_size;
+        }
+
+        const matrix_t* factors = model->layers[i].factors;
+        if (factors) {
+            size += arena_get_footprint(mat_get_alloc_size(factors[1].rows, batch_size, 0));
+        }
+    }
+
+    return size;
+}
+
+static uint32_t get_layer_activation(const struct model_layer* layer) {
+    switch (layer->op) {
+    case LAYER_OP_RELU:
+        return MAT_ACTIVATION_RELU;
+    case LAYER_OP_SIGMOID:
+        return MAT_ACTIVATION_SIGMOID;
+    case LAYER_OP_SOFTMAX:
+        return MAT_ACTIVATION_SOFTMAX;
+    default:
+        if (layer->op != LAYER_OP_NONE) {
+            NV_LOG_WARN("unknown layer op %u; assuming LAYER_OP_NONE", layer->op);
+        }
+
+        return MAT_ACTIVATION_NONE;
+    }
+}
+
+/* output = A(w * input + b), in one pass. z is only written if not NULL. low-rank layers first
+ * multiply by their right factor into bottleneck (rank x batch), the one extra pass they take */
+static void layer_mul_bias_activate(const struct model_layer* layer, const matrix_t* input,
+                                    matrix_t* output, matrix_t* z, const gemm_plan_t* plan,
+                                    matrix_t* bottleneck, const gemm_plan_t* bottleneck_plan) {
+    uint32_t activation = get_layer_activation(layer);
+
+    if (layer->sparse) {
+        sparse_mul_bias_activate(output, z, layer->sparse, input, layer->biases, activation);
+    } else if (layer->factors) {
+        mat_mul(bottleneck, &layer->factors[1], input, MAT_MUL_ZERO_RESULT, bottleneck_plan);
+        mat_mul_bias_activate(output, z, &layer->factors[0], bottleneck, layer->biases,
+                              activation, plan);
+    } else {
+        mat_mul_bias_activate(output, z, layer->weights, input, layer->biases, activation, plan);
+    }
+}
+
+static void layer_forwardprop(const struct model_layer* layer, const matrix_t* input,
+                              struct forwardprop_layer_output* output) {
+    /* z_1 = w_1 * a_0 + b_1, a = A(z) */
+    layer_mul_bias_activate(layer, input, output->activations, output->z, output->plan,
+                            output->bottleneck, output->bottleneck_plan);
+}
+
+void model_forwardprop(const model_t* model, const matrix_t* input,
+                       struct forwardprop_layer_output* output) {
+    assert(input);
+    assert(output);
+    assert(input->rows == model_get_input_size(model));
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const matrix_t* layer_input = i > 0 ? output[i - 1].activations : input;
+        layer_forwardprop(&model->layers[i], layer_input, &output[i]);
+    }
+}
+
+struct model_inference {
+    uint32_t batch_size;
+    matrix_t* buffers[2];
+
+    /* each layer's output, viewed in whichever buffer it lands in */
+    matrix_t views[2];
+
+    /* for full batches; smaller ones use the built-in kernels */
+    uint32_t num_layers;
+    gemm_plan_t** plans;
+
+    /* the right factor's product for low-rank layers, sized for the largest rank (NULL if there
+     * are none), and their plans for it */
+    matrix_t* bottleneck;
+    matrix_t bottleneck_view;
+    gemm_plan_t** bottleneck_plans;
+
+    /* for model_infer_pixels: the first layer's weights (its right factor if it is low-rank)
+     * transposed, NULL if that layer is sparse, and the batch as floats for when it is too dense to
+     * benefit */
+    matrix_t* columns;
+    matrix_t* input;
+};
+
+static uint32_t get_widest_layer(const model_t* model) {
+    uint32_t widest = 0;
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        uint32_t size = model->layers[i].weights->rows;
+        widest = size > widest ? size : widest;
+    }
+
+    return widest;
+}
+
+/* w_1 transposed and widened to fp32, so that each input element selects a contiguous row. for a
+ * low-rank layer, the right factor is what reads the input */
+static matrix_t* get_first_layer_columns(const model_t* model, const struct nv_allocator* alloc) {
+    const struct model_layer* layer = &model->layers[0];
+    if (layer->sparse || layer->weights->columns > SPARSE_MAX_COLUMNS) {
+        return NULL;
+    }
+
+    const matrix_t* weights = layer->factors ? &layer->factors[1] : layer->weights;
+    uint32_t rows = weights->rows;
+    uint32_t columns = weights->columns;
+
+    matrix_t* transposed = mat_alloc(alloc, columns, rows);
+    matrix_t* widened = mat_alloc(NULL, 1, columns);
+    assert(transposed && widened);
+
+    for (uint32_t y = 0; y < rows; y++) {
+        matrix_t source = *weights;
+        source.rows = 1;
+        source.data = mat_row_data(weights, y);
+
+        mat_copy(widened, &source);
+
+        for (uint32_t x = 0; x < columns; x++) {
+            mat_row(transposed, x)[y] = widened->data[x];
+        }
+    }
+
+    mat_free(NULL, widened);
+    return transposed;
+}
+
+struct model_inference* model_alloc_inference(const model_t* model,
+                                              const struct nv_allocator* alloc,
+                                              uint32_t batch_size) {
+    size_t plans_size = model->num_layers * sizeof(gemm_plan_t*);
+    size_t size = sizeof(struct model_inference) + plans_size * 2;
+
+    struct model_inference* inference;
+    if (alloc) {
+        inference = alloc->alloc(alloc->user, size);
+    } else {
+        NV_LOG_TRACE("allocating inference buffers for a batch of %u", batch_size);
+        inference = nv_alloc(size);
+    }
+
+    assert(inference);
+    inference->batch_size = batch_size;
+
+    inference->num_layers = model->num_layers;
+    inference->plans = (void*)inference + sizeof(struct model_inference);
+    inference->bottleneck_plans = (void*)inference->plans + plans_size;
+
+    uint32_t largest_rank = 0;
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        inference->plans[i] = get_forward_plan(layer, batch_size);
+        inference->bottleneck_plans[i] = get_bottleneck_plan(layer, batch_size);
+
+        if (layer->factors && layer->factors[1].rows > largest_rank) {
+            largest_rank = layer->factors[1].rows;
+        }
+    }
+
+    inference->bottleneck = NULL;
+    if (largest_rank > 0) {
+        inference->bottleneck = mat_alloc(alloc, largest_rank, batch_size);
+        assert(inference->bottleneck);
+    }
+
+    /* layer outputs are unpadded, so any narrower layer fits in the front of a buffer */
+    uint32_t widest = get_widest_layer(model);
+    for (uint32_t i = 0; i < 2; i++) {
+        inference->buffers[i] = mat_alloc(alloc, widest, batch_size);
+        assert(inference->buffers[i]);
+    }
+
+    inference->columns = get_first_layer_columns(model, alloc);
+
+    inference->input = mat_alloc(alloc, model_get_input_size(model), batch_size);
+    assert(inference->input);
+
+    return inference;
+}
+
+void model_free_inference(const struct nv_allocator* alloc, struct model_inference* inference) {
+    if (!inference) {
+        return;
+    }
+
+    mat_free(alloc, inference->buffers[0]);
+    mat_free(alloc, inference->buffers[1]);
+
+    mat_free(alloc, inference->columns);
+    mat_free(alloc, inference->input);
+    mat_free(alloc, inference->bottleneck);
+
+    for (uint32_t i = 0; i < inference->num_layers; i++) {
+        gemm_plan_free(inference->plans[i]);
+        gemm_plan_free(inference->bottleneck_plans[i]);
+    }
+
+    if (!alloc) {
+        nv_free(inference);
+    } else if (alloc->free) {
+        alloc->free(alloc->user, inference);
+    }
+}
+
+/* layers [first, num_layers), the first of which reads layer_input */
+static const matrix_t* infer_layers(const model_t* model, uint32_t first,
+                                    const matrix_t* layer_input, uint32_t batch_size,
+                                    struct model_inference* inference) {
+    for (uint32_t i = first; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        /* the input of this layer is the other buffer */
+        matrix_t* output = &inference->views[i % 2];
+        mat_init_view(output, inference->buffers[i % 2]->data, layer->weights->rows, batch_size,
+                      0);
+
+        matrix_t* bottleneck = NULL;
+        if (layer->factors) {
+            bottleneck = &inference->bottleneck_view;
+            mat_init_view(bottleneck, inference->bottleneck->data, layer->factors[1].rows,
+                          batch_size, 0);
+        }
+
+        layer_mul_bias_activate(layer, layer_input, output, NULL, inference->plans[i], bottleneck,
+                                inference->bottleneck_plans[i]);
+
+        layer_input = output;
+    }
+
+    return layer_input;
+}
+
+const matrix_t* model_infer(const model_t* model, const matrix_t* input,
+                            struct model_inference* inference) {
+    assert(input);
+    assert(inference);
+    assert(input->rows == model_get_input_size(model));
+    assert(input->columns <= inference->batch_size);
+
+    return infer_layers(model, 0, input, input->columns, inference);
+}
+
+const matrix_t* model_infer_pixels(const model_t* model, const uint8_t* pixels, size_t stride,
+                                   uint32_t count, struct model_inference* inference) {
+    assert(pixels);
+    assert(inference);
+    assert(count <= inference->batch_size);
+
+    uint32_t input_size = model_get_input_size(model);
+    assert(stride >= input_size);
+
+    uint32_t nonzeros = sparse_count_pixels(pixels, input_size, stride, count);
+    float density = count > 0 ? (float)nonzeros / ((float)input_size * count) : 1.f;
+
+    if (inference->columns && density <= MODEL_SPARSE_INPUT_MAX_DENSITY) {
+        const struct model_layer* layer = &model->layers[0];
+
+        matrix_t* output = &inference->views[0];
+        mat_init_view(output, inference->buffers[0]->data, layer->weights->rows, count, 0);
+
+        if (layer->factors) {
+            /* only the right factor's product sees the pixels */
+            matrix_t* bottleneck = &inference->bottleneck_view;
+            mat_init_view(bottleneck, inference->bottleneck->data, layer->factors[1].rows, count,
+                          0);
+
+            sparse_input_mul_bias_activate(bottleneck, inference->columns, pixels, stride, NULL,
+                                           MAT_ACTIVATION_NONE);
+
+            mat_mul_bias_activate(output, NULL, &layer->factors[0], bottleneck, layer->biases,
+                                  get_layer_activation(layer), inference->plans[0]);
+        } else {
+            sparse_input_mul_bias_activate(output, inference->columns, pixels, stride,
+                                           layer->biases, get_layer_activation(layer));
+        }
+
+        return infer_layers(model, 1, output, count, inference);
+    }
+
+    /* scaled as dataset_get_batch does */
+    matrix_t input;
+    mat_init_view(&input, inference->input->data, input_size, count, 0);
+
+    for (uint32_t x = 0; x < count; x++) {
+        const uint8_t* image = pixels + x * stride;
+
+        for (uint32_t y = 0; y < input_size; y++) {
+            mat_row(&input, y)[x] = (float)image[y] / 255;
+        }
+    }
+
+    return infer_layers(model, 0, &input, count, inference);
+}
+
+struct model_deltas* model_alloc_deltas(const model_t* model, uint32_t batch_size) {
+    uint32_t num_layers = model->num_layers;
+
+    size_t layers_size = num_layers * sizeof(struct model_layer);
+    size_t errors_size = num_layers * sizeof(matrix_t*);
+    size_t views_size = num_layers * 2 * sizeof(matrix_t);
+    size_t plans_size = num_layers * sizeof(gemm_plan_t*);
+
+    NV_LOG_TRACE("allocating deltas for a batch of %u", batch_size);
+    struct model_deltas* deltas = nv_alloc(sizeof(struct model_deltas) + layers_size + views_size +
+                                           errors_size + plans_size * 2);
+    assert(deltas);
+
+    deltas->num_layers = num_layers;
+    deltas->batch_size = batch_size;
+    deltas->layers = (void*)deltas + sizeof(struct model_deltas);
+    deltas->views = (void*)deltas->layers + layers_size;
+    deltas->errors = (void*)deltas->views + views_size;
+    deltas->gradient_plans = (void*)deltas->errors + errors_size;
+    deltas->error_plans = (void*)deltas->gradient_plans + plans_size;
+
+    /* gradients are always fp32, whatever the weights are stored as. an fp32 model's block is then
+     * laid out the same as this one */
+    struct model_layer_spec* specs = nv_alloc(num_layers * sizeof(struct model_layer_spec));
+    assert(specs);
+
+    get_layer_specs(model, specs);
+    for (uint32_t i = 0; i < num_layers; i++) {
+        specs[i].op = LAYER_OP_NONE;
+    }
+
+    uint32_t input_size = model_get_input_size(model);
+    size_t parameters_size =
+        layout_parameters(input_size, num_layers, specs, NULL, NULL, NULL, NULL);
+    deltas->parameters = alloc_parameters(NULL, parameters_size);
+
+    struct parameter_views views = {.views = deltas->views};
+    layout_parameters(input_size, num_layers, specs, NULL, deltas->parameters->data, &views,
+                      deltas->layers);
+
+    nv_free(specs);
+
+    for (uint32_t i = 0; i < num_layers; i++) {
+        /* op is unused */
+        deltas->layers[i].op = LAYER_OP_NONE;
+
+        deltas->errors[i] = mat_alloc(NULL, model->layers[i].weights->rows, batch_size);
+        assert(deltas->errors[i]);
+
+        /* see model_backprop. the first layer passes no error back */
+        uint32_t rows = model->layers[i].weights->rows;
+        uint32_t columns = model->layers[i].weights->columns;
+
+        deltas->gradient_plans[i] = mat_plan_mul(MAT_MUL_TRANSPOSE_RHS, rows, columns, batch_size);
+        deltas->error_plans[i] =
+            i > 0 ? mat_plan_mul(MAT_MUL_TRANSPOSE_LHS, columns, batch_size, rows) : NULL;
+    }
+
+    model_zero_deltas(deltas);
+    return deltas;
+}
+
+void model_free_deltas(struct model_deltas* deltas) {
+    if (!deltas) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < deltas->num_layers; i++) {
+        mat_free(NULL, deltas->errors[i]);
+
+        gemm_plan_free(deltas->gradient_plans[i]);
+        gemm_plan_free(deltas->error_plans[i]);
+    }
+
+    mat_free(NULL, deltas->parameters);
+    nv_free(deltas);
+}
+
+void model_zero_deltas(struct model_deltas* deltas) {
+    /* padding included, which keeps it zero in the model too */
+    mat_zero(deltas->parameters);
+}
+
+matrix_t* model_get_output_error(const struct model_deltas* deltas) {
+    return deltas->errors[deltas->num_layers - 1];
+}
+
+void model_backprop(const model_t* model, const matrix_t* input,
+                    const struct forwardprop_layer_output* fp, struct model_deltas* deltas,
+                    uint32_t flags) {
+    assert(input);
+    assert(fp);
+    assert(deltas);
+
+    assert(deltas->num_layers == model->num_layers);
+    assert(input->columns == deltas->batch_size);
+
+    for (uint32_t i = model->num_layers; i-- > 0;) {
+        const struct model_layer* layer = &model->layers[i];
+        struct model_layer* gradient = &deltas->layers[i];
+        matrix_t* error = deltas->errors[i];
+
+        /* pruned layers are inference-only */
+        assert(!layer->sparse && !layer->factors);
+
+        /* dL/da -> dL/dz, unless the caller already folded the activation in */
+        bool is_z = i == model->num_layers - 1 && (flags & BACKPROP_OUTPUT_IS_Z);
+        if (!is_z) {
+            mat_activation_backward(error, fp[i].activations, get_layer_activation(layer));
+        }
+
+        /* dL/dw += dL/dz * a_0^T; dL/db += dL/dz summed over the batch */
+        const matrix_t* layer_input = i > 0 ? fp[i - 1].activations : input;
+        mat_mul(gradient->weights, error, layer_input, MAT_MUL_TRANSPOSE_RHS,
+                deltas->gradient_plans[i]);
+        mat_add_row_sums(gradient->biases, error);
+
+        /* dL/da_0 = w^T * dL/dz */
+        if (i > 0) {
+            mat_mul(deltas->errors[i - 1], layer->weights, error,
+                    MAT_MUL_TRANSPOSE_LHS | MAT_MUL_ZERO_RESULT, deltas->error_plans[i]);
+        }
+    }
+}
+
+void model_apply_deltas(model_t* model, const struct model_deltas* deltas, float rate) {
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        assert(model->layers[i].weights->type == MAT_TYPE_F32 && !model->layers[i].sparse &&
+               !model->layers[i].factors);
+    }
+
+    /* with dense fp32 weights both blocks share a layout, so this is a single sweep */
+    mat_add_scaled(model->parameters, deltas->parameters, -rate);
+}
+
+static bool read_chunk_from_file(FILE* f, void* buffer, size_t size) {
+    while (size > 0) {
+        size_t bytes_read = fread(buffer, 1, size, f);
+        if (bytes_read == 0) {
+            /* EOF */
+            NV_LOG_WARN("failed to read entire chunk from file! (%zu bytes missing)", size);
+            return false;
+        }
+
+        assert(bytes_read <= size);
+
+        buffer += bytes_read;
+        size -= bytes_read;
+    }
+
+    return true;
+}
+
+/* model files (version 1 and up) start with a header, followed by the layer specs and a tensor
+ * table, all in the writer's byte order. the parameter block follows at data_offset, exactly as it
+ * is laid out in memory, so it can be written in one go and mapped straight back in. files from
+ * before versioning start with a struct legacy_header instead.
+ *
+ * version 2 adds sparse layers (LAYER_SPEC_SPARSE), whose weight tensor describes the csr block
+ * and holds the nonzero count where a stride would be. version 3 adds low-rank layers
+ * (LAYER_SPEC_LOW_RANK), whose weight tensor points at the left factor, with the right one right
+ * after it, and holds the rank where a stride would be. each file is written as the lowest version
+ * that can describe it, so older builds can read what they understand */
+#define MODEL_FILE_MAGIC "NVML"
+#define MODEL_FILE_VERSION 3
+#define MODEL_FILE_SPARSE_VERSION 2
+#define MODEL_FILE_LOW_RANK_VERSION 3
+
+/* written as a native uint32; reads back byte-swapped on a host of the other byte order */
+#define MODEL_FILE_BYTE_ORDER 0x01020304u
+
+/* of data_offset; mmap puts the file on a page boundary, so the parameters stay aligned */
+#define MODEL_FILE_ALIGNMENT MAT_ALIGNMENT
+
+struct file_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+
+    /* sizeof(struct file_header) when written, so later versions can grow it */
+    uint32_t header_size;
+
+    uint32_t layer_count;
+    uint32_t input_size;
+
+    uint64_t data_offset;
+    uint64_t data_size;
+
+    /* crc32 of the specs and tensor table, and of the parameter block */
+    uint32_t table_checksum;
+    uint32_t data_checksum;
+};
+
+/* one per matrix, biases before weights for each layer */
+struct file_tensor {
+    /* from data_offset */
+    uint64_t offset;
+
+    uint32_t rows, columns;
+    uint32_t stride;
+
+    /* MAT_TYPE_* */
+    uint32_t type;
+};
+
+struct legacy_header {
+    uint32_t layer_count;
+    uint32_t input_size;
+};
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static size_t get_table_size(uint32_t layer_count) {
+    return layer_count * (sizeof(struct model_layer_spec) + 2 * sizeof(struct file_tensor));
+}
+
+static uint32_t get_checksum(const void* data, size_t size) {
+    return (uint32_t)crc32_z(crc32(0, Z_NULL, 0), data, size);
+}
+
+static void fill_tensor(struct file_tensor* tensor, const matrix_t* mat, const matrix_t* block) {
+    tensor->offset = (uint64_t)((const char*)mat->data - (const char*)block->data);
+    tensor->rows = mat->rows;
+    tensor->columns = mat->columns;
+    tensor->stride = mat->stride;
+    tensor->type = mat->type;
+}
+
+static void fill_weight_tensor(struct file_tensor* tensor, const struct model_layer* layer,
+                               const matrix_t* block) {
+    if (layer->factors) {
+        fill_tensor(tensor, &layer->factors[0], block);
+        tensor->columns = layer->weights->columns;
+        tensor->stride = layer->factors[0].columns;
+        return;
+    }
+
+    if (!layer->sparse) {
+        fill_tensor(tensor, layer->weights, block);
+        return;
+    }
+
+    const sparse_matrix_t* sparse = layer->sparse;
+    tensor->offset = (uint64_t)((const char*)sparse->row_offsets - (const char*)block->data);
+    tensor->rows = sparse->rows;
+    tensor->columns = sparse->columns;
+    tensor->stride = sparse->nonzeros;
+    tensor->type = MAT_TYPE_F32;
+}
+
+/* specs, then the tensor table */
+static void fill_table(const model_t* model, void* table) {
+    struct model_layer_spec* specs = table;
+    get_layer_specs(model, specs);
+
+    struct file_tensor* tensors = (void*)(specs + model->num_layers);
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        const struct model_layer* layer = &model->layers[i];
+
+        fill_tensor(&tensors[i * 2], layer->biases, model->parameters);
+        fill_weight_tensor(&tensors[i * 2 + 1], layer, model->parameters);
+    }
+}
+
+/* checks what can be checked before the model exists. table (specs + tensors) follows header */
+static bool check_header(const struct file_header* header, const void* table, size_t file_size) {
+    if (memcmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        NV_LOG_ERROR("not a model file!");
+        return false;
+    }
+
+    if (header->byte_order != MODEL_FILE_BYTE_ORDER) {
+        NV_LOG_ERROR("model file was written on a host of a different byte order!");
+        return false;
+    }
+
+    if (header->version < 1 || header->version > MODEL_FILE_VERSION ||
+        header->header_size != sizeof(struct file_header)) {
+        NV_LOG_ERROR("unsupported model file version %u!", header->version);
+        return false;
+    }
+
+    size_t metadata_size = sizeof(struct file_header) + get_table_size(header->layer_count);
+    if (header->layer_count < 1 || header->data_offset < metadata_size ||
+        header->data_offset % MODEL_FILE_ALIGNMENT != 0 || header->data_offset > file_size ||
+        header->data_size > file_size - header->data_offset) {
+        NV_LOG_ERROR("model file header is inconsistent with the file!");
+        return false;
+    }
+
+    if (get_checksum(table, get_table_size(header->layer_count)) != header->table_checksum) {
+        NV_LOG_ERROR("model file layer table is corrupt!");
+        return false;
+    }
+
+    return true;
+}
+
+/* the tensor table has to describe exactly the layout the specs produce here */
+static bool check_tensors(const model_t* model, const struct file_header* header,
+                          const struct file_tensor* tensors) {
+    if ((size_t)model->parameters->columns * sizeof(float) != header->data_size) {
+        NV_LOG_ERROR("model file parameter block is %zu bytes; expected %zu!",
+                     (size_t)header->data_size, (size_t)model->parameters->columns * sizeof(float));
 
-        struct model_layer* layer = &model->layers[i];
-        layer->op = layers[i].op;
+        return false;
+    }
 
-        NV_LOG_DEBUG("layer %u: %u>%u, op %u", i, previous_size, current_size, layer->op);
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        struct file_tensor expected[2];
+        fill_tensor(&expected[0], model->layers[i].biases, model->parameters);
+        fill_weight_tensor(&expected[1], &model->layers[i], model->parameters);
 
-        layer->biases = mat_alloc(alloc, current_size, 1);
-        layer->weights = mat_alloc(alloc, current_size, previous_size);
+        if (memcmp(expected, &tensors[i * 2], sizeof(expected)) != 0) {
+            NV_LOG_ERROR("model file tensor table does not match layer %u!", i);
+            return false;
+        }
     }
 
-    return model;
+    return true;
 }
 
-void model_free(model_t* model) {
-    if (!model) {
-        return;
-    }
+/* dense weights (or either factor of low-rank ones) sit in the parameter block's one fp32 row, so
+ * they have to fit 32 bits of elements with room left to pad their rows. past that, measuring the
+ * layout would wrap */
+static bool fits_parameters(uint32_t rows, uint32_t columns) {
+    return (uint64_t)rows * columns <= UINT32_MAX - MAT_ALIGNMENT;
+}
 
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        const struct model_layer* layer = &model->layers[i];
-        mat_free(model->alloc, layer->biases);
-        mat_free(model->alloc, layer->weights);
+/* the extents the layout needs (see layout_parameters), from the sparse and low-rank layers'
+ * weight tensors. the rest of the table is checked against the resulting layout */
+static bool get_file_extents(const struct file_header* header,
+                             const struct model_layer_spec* specs,
+                             const struct file_tensor* tensors, uint32_t* extents) {
+    for (uint32_t i = 0; i < header->layer_count; i++) {
+        extents[i] = 0;
+
+        uint32_t rows = specs[i].size;
+        uint32_t columns = i > 0 ? specs[i - 1].size : header->input_size;
+        uint64_t size = (uint64_t)rows * columns;
+
+        const struct file_tensor* weights = &tensors[i * 2 + 1];
+        if (specs[i].op & LAYER_SPEC_SPARSE) {
+            if (header->version < MODEL_FILE_SPARSE_VERSION || columns > SPARSE_MAX_COLUMNS ||
+                weights->stride > size) {
+                NV_LOG_ERROR("model file has an invalid sparse layer %u!", i);
+                return false;
+            }
+
+            extents[i] = weights->stride;
+        } else if (specs[i].op & LAYER_SPEC_LOW_RANK) {
+            uint32_t rank = weights->stride;
+            if (header->version < MODEL_FILE_LOW_RANK_VERSION || rank < 1 || rank > rows ||
+                rank > columns || !fits_parameters(rows, rank) || !fits_parameters(rank, columns)) {
+                NV_LOG_ERROR("model file has an invalid low-rank layer %u!", i);
+                return false;
+            }
+
+            extents[i] = rank;
+        } else if (!fits_parameters(rows, columns)) {
+            NV_LOG_ERROR("model file layer %u is too large!", i);
+            return false;
+        }
     }
 
-    if (!model->alloc) {
-        nv_free(model);
-    } else {
-        struct nv_allocator alloc;
-        memcpy(&alloc, model->alloc, sizeof(struct nv_allocator));
+    return true;
+}
 
-        if (alloc.free) {
-            alloc.free(alloc.user, model);
-        }
+/* the block the layers lay out to has to be the one the file holds, before any of it is
+ * allocated */
+static bool check_parameters_size(const struct file_header* header,
+                                  const struct model_layer_spec* specs, const uint32_t* extents) {
+    size_t size = layout_parameters(header->input_size, header->layer_count, specs, extents, NULL,
+                                    NULL, NULL);
+
+    if (size != header->data_size || size / sizeof(float) > UINT32_MAX) {
+        NV_LOG_ERROR("model file parameter block is %zu bytes; expected %zu!",
+                     (size_t)header->data_size, size);
+
+        return false;
     }
+
+    return true;
 }
 
-void model_randomize(struct prng* rng, model_t* model) {
+/* the index structure of sparse layers has to be walkable before anything multiplies with it */
+static bool check_sparse_layers(const model_t* model) {
     for (uint32_t i = 0; i < model->num_layers; i++) {
-        struct model_layer* layer = &model->layers[i];
+        const sparse_matrix_t* sparse = model->layers[i].sparse;
+        if (sparse && !sparse_is_valid(sparse)) {
+            NV_LOG_ERROR("model file sparse layer %u is corrupt!", i);
+            return false;
+        }
+    }
 
-        mat_randomize(rng, layer->biases);
-        mat_randomize(rng, layer->weights);
+    return true;
+}
+
+static bool check_data(const model_t* model, const struct file_header* header) {
+    if (get_checksum(model->parameters->data, header->data_size) != header->data_checksum) {
+        NV_LOG_ERROR("model file parameters are corrupt!");
+        return false;
     }
+
+    return true;
 }
 
-static void layer_forwardprop(const struct model_layer* layer, const matrix_t* input,
-                              struct forwardprop_layer_output* output) {
-    /* z_1 = w_1 * a_0 + b_1 */
-    mat_copy(output->z, layer->biases);
-    mat_mul(output->z, layer->weights, input, 0);
+static bool read_matrix_from_file(matrix_t* mat, FILE* f) {
+    size_t row_size = mat_get_element_size(mat) * mat->columns;
+    if (mat_is_contiguous(mat)) {
+        return read_chunk_from_file(f, mat->data, row_size * mat->rows);
+    }
 
-    /* a = A(z) */
-    switch (layer->op) {
-    case LAYER_OP_RELU:
-        mat_relu(output->activations, output->z);
-        break;
-    case LAYER_OP_SIGMOID:
-        mat_relu(output->activations, output->z);
-        break;
-    case LAYER_OP_SOFTMAX:
-        mat_softmax(output->activations, output->z);
-        break;
-    default:
-        if (layer->op != LAYER_OP_NONE) {
-            NV_LOG_WARN("unknown layer op %u; assuming LAYER_OP_NONE", layer->op);
+    /* rows are packed on disk */
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        if (!read_chunk_from_file(f, mat_row_data(mat, y), row_size)) {
+            return false;
         }
-
-        /* copy as is */
-        mat_copy(output->activations, output->z);
-        break;
     }
+
+    return true;
 }
 
-void model_forwardprop(const model_t* model, const matrix_t* input,
-                       struct forwardprop_layer_output* output) {
-    assert(input);
-    assert(output);
+static bool read_layer_from_file(struct model_layer* layer, FILE* f) {
+    /* biases before weights */
+    NV_LOG_TRACE("biases: %ux%u", layer->biases->rows, layer->biases->columns);
+    if (!read_matrix_from_file(layer->biases, f)) {
+        NV_LOG_ERROR("failed to read layer biases!");
+        return false;
+    }
 
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        const matrix_t* layer_input = i > 0 ? output[i - 1].activations : input;
-        layer_forwardprop(&model->layers[i], layer_input, &output[i]);
+    NV_LOG_TRACE("weights: %ux%u", layer->weights->rows, layer->weights->columns);
+    if (!read_matrix_from_file(layer->weights, f)) {
+        NV_LOG_ERROR("failed to read layer weights!");
+        return false;
     }
-}
 
-void model_backprop(const model_t* model, const matrix_t* input, const matrix_t* expected,
-                    const struct forwardprop_layer_output* fp, struct model_layer* deltas) {
-    assert(input);
-    assert(fp);
-    assert(deltas);
+    return true;
+}
 
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        uint32_t layer_index = model->num_layers - (i + 1);
-        const matrix_t* layer_input = i > 0 ? fp[i - 1].activations : input;
+/* anything without the magic lands here, so nothing is allocated until the header and the specs
+ * are known to describe a file of exactly this size */
+static bool check_legacy_header(const struct legacy_header* header, size_t file_size) {
+    size_t specs_size = (size_t)header->layer_count * sizeof(struct model_layer_spec);
+    if (header->layer_count < 1 || header->input_size < 1 ||
+        file_size < sizeof(struct legacy_header) ||
+        specs_size > file_size - sizeof(struct legacy_header)) {
+        NV_LOG_ERROR("model file header is inconsistent with the file!");
+        return false;
     }
+
+    return true;
 }
 
-static bool read_chunk_from_file(FILE* f, void* buffer, size_t size) {
-    while (size > 0) {
-        size_t bytes_read = fread(buffer, 1, size, f);
-        if (bytes_read == 0) {
-            /* EOF */
-            NV_LOG_WARN("failed to read entire chunk from file! (%zu bytes missing)", size);
+static bool check_legacy_specs(const struct legacy_header* header,
+                               const struct model_layer_spec* specs, size_t file_size) {
+    size_t metadata_size =
+        sizeof(struct legacy_header) + header->layer_count * sizeof(struct model_layer_spec);
+
+    /* in 64 bits, a layer's count (under 2^64 for 32-bit sizes) can only overflow the sum, so
+     * it is checked against what is left of the file instead */
+    uint64_t remaining = (file_size - metadata_size) / sizeof(float);
+    uint64_t previous_size = header->input_size;
+
+    for (uint32_t i = 0; i < header->layer_count; i++) {
+        uint64_t size = specs[i].size;
+        uint64_t count = size + size * previous_size;
+
+        if (size < 1 || count > remaining) {
+            NV_LOG_ERROR("model file is %zu bytes; its layers do not fit it!", file_size);
             return false;
         }
 
-        assert(bytes_read <= size);
+        remaining -= count;
+        previous_size = size;
+    }
 
-        buffer += bytes_read;
-        size -= bytes_read;
+    if (remaining > 0) {
+        NV_LOG_ERROR("model file is %zu bytes; its layers do not fit it!", file_size);
+        return false;
     }
 
     return true;
 }
 
-struct initial_header {
-    uint32_t layer_count;
-    uint32_t input_size;
-};
-
-static model_t* create_model_from_header(const struct nv_allocator* alloc, FILE* f) {
-    struct initial_header initial_header;
-    if (!read_chunk_from_file(f, &initial_header, sizeof(struct initial_header))) {
+static model_t* read_legacy_model(const struct nv_allocator* alloc, FILE* f, size_t file_size) {
+    struct legacy_header header;
+    if (!read_chunk_from_file(f, &header, sizeof(struct legacy_header))) {
         NV_LOG_ERROR("failed to read initial header from model file!");
         return NULL;
     }
 
-    NV_LOG_DEBUG("layers: %u", initial_header.layer_count);
-    NV_LOG_DEBUG("input size: %u", initial_header.input_size);
+    NV_LOG_DEBUG("layers: %u", header.layer_count);
+    NV_LOG_DEBUG("input size: %u", header.input_size);
+
+    if (!check_legacy_header(&header, file_size)) {
+        return NULL;
+    }
 
     struct model_layer_spec* layer_specs =
-        nv_alloc(initial_header.layer_count * sizeof(struct model_layer_spec));
+        nv_alloc(header.layer_count * sizeof(struct model_layer_spec));
     assert(layer_specs);
 
     if (!read_chunk_from_file(f, layer_specs,
-                              initial_header.layer_count * sizeof(struct model_layer_spec))) {
+                              header.layer_count * sizeof(struct model_layer_spec))) {
         NV_LOG_ERROR("failed to read layer specs from model file!");
 
         nv_free(layer_specs);
         return NULL;
     }
 
-    model_t* model =
-        model_alloc(alloc, initial_header.input_size, initial_header.layer_count, layer_specs);
+    if (!check_legacy_specs(&header, layer_specs, file_size)) {
+        nv_free(layer_specs);
+        return NULL;
+    }
+
+    model_t* model = model_alloc(alloc, header.input_size, header.layer_count, layer_specs);
 
     nv_free(layer_specs);
     if (!model) {
+        NV_LOG_ERROR("failed to allocate model from file header!");
         return NULL;
     }
 
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        NV_LOG_TRACE("reading layer %u", i);
+
+        struct model_layer* layer = &model->layers[i];
+        if (!read_layer_from_file(layer, f)) {
+            NV_LOG_ERROR("failed to read layer %u from file!", i);
+
+            model_free(model);
+            return NULL;
+        }
+    }
+
     return model;
 }
 
-static bool read_matrix_from_file(matrix_t* mat, FILE* f) {
-    size_t total_size = sizeof(float) * mat->rows * mat->columns;
-    return read_chunk_from_file(f, mat->data, total_size);
+/* header through the tensor table, read into one buffer */
+static void* read_metadata(FILE* f, size_t file_size) {
+    struct file_header header;
+    if (!read_chunk_from_file(f, &header, sizeof(struct file_header))) {
+        NV_LOG_ERROR("failed to read header from model file!");
+        return NULL;
+    }
+
+    size_t table_size = get_table_size(header.layer_count);
+    if (file_size < sizeof(struct file_header) || table_size > file_size) {
+        NV_LOG_ERROR("model file is truncated!");
+        return NULL;
+    }
+
+    void* metadata = nv_alloc(sizeof(struct file_header) + table_size);
+    assert(metadata);
+
+    memcpy(metadata, &header, sizeof(struct file_header));
+    if (!read_chunk_from_file(f, metadata + sizeof(struct file_header), table_size)) {
+        NV_LOG_ERROR("failed to read layer table from model file!");
+
+        nv_free(metadata);
+        return NULL;
+    }
+
+    return metadata;
 }
 
-static bool read_layer_from_file(struct model_layer* layer, FILE* f) {
-    /* biases before weights */
-    NV_LOG_TRACE("biases: %ux%u", layer->biases->rows, layer->biases->columns);
-    if (!read_matrix_from_file(layer->biases, f)) {
-        NV_LOG_ERROR("failed to read layer biases!");
-        return false;
+static model_t* read_model(const struct nv_allocator* alloc, FILE* f, size_t file_size) {
+    void* metadata = read_metadata(f, file_size);
+    if (!metadata) {
+        return NULL;
     }
 
-    NV_LOG_TRACE("weights: %ux%u", layer->weights->rows, layer->weights->columns);
-    if (!read_matrix_from_file(layer->weights, f)) {
-        NV_LOG_ERROR("failed to read layer weights!");
-        return false;
+    const struct file_header* header = metadata;
+    const struct model_layer_spec* specs = metadata + sizeof(struct file_header);
+    const struct file_tensor* tensors = (const void*)(specs + header->layer_count);
+
+    model_t* model = NULL;
+    uint32_t* extents = NULL;
+
+    if (check_header(header, specs, file_size)) {
+        extents = nv_alloc(header->layer_count * sizeof(uint32_t));
+        assert(extents);
+
+        if (get_file_extents(header, specs, tensors, extents) &&
+            check_parameters_size(header, specs, extents)) {
+            model =
+                alloc_model(alloc, header->input_size, header->layer_count, specs, extents);
+        }
     }
 
-    return true;
+    /* the whole parameter block in one read */
+    bool success = model && check_tensors(model, header, tensors) &&
+                   fseek(f, (long)header->data_offset, SEEK_SET) == 0 &&
+                   read_chunk_from_file(f, model->parameters->data, header->data_size) &&
+                   check_data(model, header) && check_sparse_layers(model);
+
+    nv_free(extents);
+    nv_free(metadata);
+    if (!success) {
+        NV_LOG_ERROR("failed to read model file!");
+
+        model_free(model);
+        return NULL;
+    }
+
+    return model;
+}
+
+static bool is_versioned(FILE* f) {
+    char magic[sizeof(((struct file_header*)NULL)->magic)];
+
+    bool versioned = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                     memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0;
+
+    rewind(f);
+    return versioned;
 }
 
 model_t* model_read_from_path(const struct nv_allocator* alloc, const char* path) {
@@ -224,26 +1823,126 @@ model_t* model_read_from_path(const struct nv_allocator* alloc, const char* path
         return NULL;
     }
 
-    model_t* model = create_model_from_header(alloc, f);
-    if (!model) {
-        NV_LOG_ERROR("failed to allocate model from file header!");
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        NV_LOG_ERROR("failed to stat model at path: %s", path);
 
         fclose(f);
         return NULL;
     }
 
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        NV_LOG_TRACE("reading layer %u", i);
+    model_t* model;
+    if (is_versioned(f)) {
+        model = read_model(alloc, f, (size_t)st.st_size);
+    } else {
+        NV_LOG_DEBUG("model file predates versioning");
+        model = read_legacy_model(alloc, f, (size_t)st.st_size);
+    }
 
-        struct model_layer* layer = &model->layers[i];
-        if (!read_layer_from_file(layer, f)) {
-            NV_LOG_ERROR("failed to read layer %u from file!", i);
+    fclose(f);
+    return model;
+}
 
-            fclose(f);
-            model_free(model);
+static model_t* map_model(const struct nv_allocator* alloc, void* mapping, size_t file_size,
+                          uint32_t flags) {
+    const struct file_header* header = mapping;
+    if (file_size < sizeof(struct file_header) ||
+        get_table_size(header->layer_count) > file_size - sizeof(struct file_header)) {
+        NV_LOG_ERROR("model file is truncated!");
+        return NULL;
+    }
 
-            return NULL;
-        }
+    const struct model_layer_spec* specs = mapping + sizeof(struct file_header);
+    const struct file_tensor* tensors = (const void*)(specs + header->layer_count);
+
+    if (!check_header(header, specs, file_size)) {
+        return NULL;
+    }
+
+    uint32_t* extents = nv_alloc(header->layer_count * sizeof(uint32_t));
+    assert(extents);
+
+    model_t* model = NULL;
+    if (get_file_extents(header, specs, tensors, extents)) {
+        model = alloc_model_struct(alloc, header->layer_count, specs);
+    }
+
+    if (!model) {
+        nv_free(extents);
+        return NULL;
+    }
+
+    struct parameter_views views;
+    get_model_views(model, &views);
+
+    /* the last view covers the block where it sits in the mapping */
+    uint32_t block_size = (uint32_t)(header->data_size / sizeof(float));
+    model->parameters = &model->views[header->layer_count * 2];
+    mat_init_view(model->parameters, mapping + header->data_offset, 1, block_size, 0);
+
+    size_t parameters_size =
+        layout_parameters(header->input_size, header->layer_count, specs, extents,
+                          model->parameters->data, &views, model->layers);
+
+    nv_free(extents);
+
+    /* nothing is unmapped until the model is fully checked */
+    bool success = parameters_size <= header->data_size && check_tensors(model, header, tensors) &&
+                   (!(flags & MODEL_MAP_VERIFY) || check_data(model, header)) &&
+                   check_sparse_layers(model);
+
+    if (!success) {
+        model->parameters = NULL;
+        model_free(model);
+
+        return NULL;
+    }
+
+    model->mapping = mapping;
+    model->mapping_size = file_size;
+
+    log_layers(model);
+    return model;
+}
+
+model_t* model_map_from_path(const struct nv_allocator* alloc, const char* path, uint32_t flags) {
+    NV_LOG_DEBUG("mapping model from path: %s", path);
+
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        NV_LOG_ERROR("failed to open model at path: %s", path);
+        return NULL;
+    }
+
+    if (!is_versioned(f)) {
+        fclose(f);
+
+        NV_LOG_INFO("model file %s predates versioning; reading it instead", path);
+        return model_read_from_path(alloc, path);
+    }
+
+    struct stat st;
+    void* mapping = MAP_FAILED;
+
+    /* private either way: writes (if allowed) are copy-on-write and never reach the file, and
+     * untouched pages stay shared with every other process mapping it */
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+        int prot = PROT_READ | ((flags & MODEL_MAP_WRITABLE) ? PROT_WRITE : 0);
+        mapping = mmap(NULL, (size_t)st.st_size, prot, MAP_PRIVATE, fileno(f), 0);
+    }
+
+    /* the mapping outlives the descriptor */
+    fclose(f);
+
+    if (mapping == MAP_FAILED) {
+        NV_LOG_ERROR("failed to map model at path: %s", path);
+        return NULL;
+    }
+
+    model_t* model = map_model(alloc, mapping, (size_t)st.st_size, flags);
+    if (!model) {
+        NV_LOG_ERROR("failed to map model file!");
+        munmap(mapping, (size_t)st.st_size);
     }
 
     return model;
@@ -266,52 +1965,56 @@ static bool write_chunk_to_file(FILE* f, const void* data, size_t size) {
     return true;
 }
 
-static bool write_matrix_to_file(FILE* f, const matrix_t* mat) {
-    size_t total_size = sizeof(float) * mat->rows * mat->columns;
-    return write_chunk_to_file(f, mat->data, total_size);
-}
-
 static bool serialize_model(const model_t* model, FILE* f) {
     assert(model->num_layers > 0);
 
-    /* initial header data */
-    struct initial_header initial_header;
-    initial_header.layer_count = model->num_layers;
-    initial_header.input_size = model->layers[0].weights->columns;
+    size_t table_size = get_table_size(model->num_layers);
+    size_t metadata_size = sizeof(struct file_header) + table_size;
 
-    if (!write_chunk_to_file(f, &initial_header, sizeof(struct initial_header))) {
-        NV_LOG_ERROR("failed to write initial header to file!");
-        return false;
+    struct file_header header;
+    memset(&header, 0, sizeof(struct file_header));
+    memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+
+    /* dense models stay readable by version 1 readers */
+    header.version = 1;
+    if (model_has_low_rank_layers(model)) {
+        header.version = MODEL_FILE_LOW_RANK_VERSION;
+    } else if (model_has_sparse_layers(model)) {
+        header.version = MODEL_FILE_SPARSE_VERSION;
     }
+    header.byte_order = MODEL_FILE_BYTE_ORDER;
+    header.header_size = sizeof(struct file_header);
 
-    /* layer sizes and operations */
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        const struct model_layer* layer = &model->layers[i];
+    header.layer_count = model->num_layers;
+    header.input_size = model_get_input_size(model);
 
-        struct model_layer_spec spec;
-        spec.op = layer->op;
-        spec.size = layer->weights->rows;
+    header.data_offset = align_up(metadata_size, MODEL_FILE_ALIGNMENT);
+    header.data_size = (uint64_t)model->parameters->columns * sizeof(float);
 
-        if (!write_chunk_to_file(f, &spec, sizeof(struct model_layer_spec))) {
-            NV_LOG_ERROR("failed to write layer spec to file!");
-            return false;
-        }
-    }
+    /* the table, padded out to data_offset with zeros */
+    size_t padded_size = header.data_offset - sizeof(struct file_header);
+    void* table = nv_alloc(padded_size);
+    assert(table);
 
-    /* layer data */
-    for (uint32_t i = 0; i < model->num_layers; i++) {
-        const struct model_layer* layer = &model->layers[i];
+    memset(table, 0, padded_size);
+    fill_table(model, table);
 
-        /* biases before weights */
-        if (!write_matrix_to_file(f, layer->biases)) {
-            NV_LOG_ERROR("failed to write layer biases to file!");
-            return false;
-        }
+    header.table_checksum = get_checksum(table, table_size);
+    header.data_checksum = get_checksum(model->parameters->data, header.data_size);
 
-        if (!write_matrix_to_file(f, layer->weights)) {
-            NV_LOG_ERROR("failed to write layer weights to file!");
-            return false;
-        }
+    bool success = write_chunk_to_file(f, &header, sizeof(struct file_header)) &&
+                   write_chunk_to_file(f, table, padded_size);
+
+    nv_free(table);
+    if (!success) {
+        NV_LOG_ERROR("failed to write model header to file!");
+        return false;
+    }
+
+    /* the whole parameter block in one write */
+    if (!write_chunk_to_file(f, model->parameters->data, header.data_size)) {
+        NV_LOG_ERROR("failed to write model parameters to file!");
+        return false;
     }
 
     return true;
@@ -320,14 +2023,36 @@ static bool serialize_model(const model_t* model, FILE* f) {
 bool model_write_to_path(const model_t* model, const char* path) {
     NV_LOG_DEBUG("writing model to path: %s", path);
 
-    FILE* f = fopen(path, "wb");
+    /* written beside the target and renamed over it, so a reader (or a mapping of the old file)
+     * never sees a partial model */
+    size_t path_length = strlen(path);
+    char* temp_path = nv_alloc(path_length + sizeof(".tmp"));
+    assert(temp_path);
+
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE* f = fopen(temp_path, "wb");
     if (!f) {
-        NV_LOG_ERROR("failed to write to model at path: %s", path);
-        return NULL;
+        NV_LOG_ERROR("failed to write to model at path: %s", temp_path);
+
+        nv_free(temp_path);
+        return false;
     }
 
-    bool success = serialize_model(model, f);
-    fclose(f);
+    /* on disk before it replaces anything */
+    bool success = serialize_model(model, f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    success = fclose(f) == 0 && success;
+
+    if (success && rename(temp_path, path) != 0) {
+        NV_LOG_ERROR("failed to move model into place at path: %s", path);
+        success = false;
+    }
+
+    if (!success) {
+        remove(temp_path);
+    }
 
+    nv_free(temp_path);
     return success;
 }
@@ -1,12 +1,19 @@
 #ifndef _MODEL_H
 #define _MODEL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 /* from matrix.h */
 typedef struct matrix matrix_t;
 
+/* from gemm.h */
+typedef struct gemm_plan gemm_plan_t;
+
+/* from sparse.h */
+typedef struct sparse_matrix sparse_matrix_t;
+
 enum {
     LAYER_OP_NONE = 0,
     LAYER_OP_RELU = 1,
@@ -14,6 +21,19 @@ enum {
     LAYER_OP_SOFTMAX = 3,
 };
 
+/* the bits of a spec's op from LAYER_SPEC_TYPE_SHIFT up hold the MAT_TYPE_* its weights are stored
+ * as. older files leave them zero, i.e. fp32 */
+#define LAYER_SPEC_TYPE_SHIFT 16
+#define LAYER_SPEC_OP_MASK ((1u << LAYER_SPEC_TYPE_SHIFT) - 1)
+
+/* set in a spec's op (above the type bits) when the layer's weights are stored sparse. the type is
+ * then that of the values, which are always fp32 */
+#define LAYER_SPEC_SPARSE (1u << 31)
+
+/* set in a spec's op when the layer's weights are stored as two low-rank factors. the type is that
+ * of both factors */
+#define LAYER_SPEC_LOW_RANK (1u << 30)
+
 struct model_layer_spec {
     uint32_t op;
     uint32_t size;
@@ -23,6 +43,15 @@ struct model_layer {
     uint32_t op;
     matrix_t* weights;
     matrix_t* biases;
+
+    /* the weights of a pruned layer (see model_sparsify); NULL for dense layers. when set, weights
+     * only describes the shape: its data is NULL */
+    sparse_matrix_t* sparse;
+
+    /* the weights of a factorized layer (see model_factorize) as two matrices, weights ~ factors[0]
+     * * factors[1]: rows x rank, then rank x columns. NULL for other layers; as with sparse,
+     * weights then only describes the shape (and type) */
+    matrix_t* factors;
 };
 
 struct nv_allocator;
@@ -31,34 +60,208 @@ typedef struct model {
     uint32_t num_layers;
     struct model_layer* layers;
 
+    /* every layer's biases and weights, back to back in one aligned block. the layers' matrices
+     * are views into it (see mat_init_view). it is typed as a single fp32 row, which it only
+     * really is when all weights are fp32; whole-model passes (copies, zeroing, updates) can then
+     * be one sweep */
+    matrix_t* parameters;
+    matrix_t* views;
+    sparse_matrix_t* sparse_views;
+    matrix_t* factor_views;
+
+    /* the file parameters view when the model was mapped (see model_map_from_path); else NULL */
+    void* mapping;
+    size_t mapping_size;
+
     struct nv_allocator* alloc;
 } model_t;
 
 struct forwardprop_layer_output {
+    /* pre-activation values; may be NULL when they are not needed (i.e. no backprop) */
     matrix_t* z;
     matrix_t* activations;
+
+    /* code generated for this layer's product at the batch size these were allocated for; NULL
+     * where none could be, in which case the built-in kernels run */
+    gemm_plan_t* plan;
+
+    /* for low-rank layers, the product with the right factor (rank x batch_size) that the left one
+     * then multiplies, and its plan; otherwise NULL */
+    matrix_t* bottleneck;
+    gemm_plan_t* bottleneck_plan;
 };
 
+/* layers may not be LAYER_SPEC_SPARSE or LAYER_SPEC_LOW_RANK; models only become sparse or
+ * low-rank through model_sparsify and model_factorize */
 model_t* model_alloc(const struct nv_allocator* alloc, uint32_t input_size, uint32_t num_layers,
                      const struct model_layer_spec* layers);
 
 void model_free(model_t* model);
 
+/* a new model with the same layers and parameters */
+model_t* model_clone(const struct nv_allocator* alloc, const model_t* model);
+
+/* copies the parameters of src into dst, which must have the same shape */
+void model_copy(model_t* dst, const model_t* src);
+
 /* from prng.h */
 struct prng;
 
 void model_randomize(struct prng* rng, model_t* model);
 
-struct model_layer* model_alloc_deltas(const model_t* model);
-void model_free_deltas(struct model_layer* deltas);
+/* converts every dense layer's weights to type (MAT_TYPE_*), low-rank factors included. biases and
+ * sparse weights stay fp32. saving the model afterwards keeps the new type */
+void model_set_weight_type(model_t* model, uint32_t type);
+
+/* below this fraction of zeros the dense kernels beat the sparse one, so model_sparsify leaves a
+ * layer dense */
+#define MODEL_SPARSE_MIN_SPARSITY 0.8f
+
+/* magnitude pruning: zeroes the smallest weights of layer index until at least sparsity (a
+ * fraction) of them are zero. the layer must be dense fp32 and its parameters writable */
+void model_prune_layer(model_t* model, uint32_t index, float sparsity);
+
+/* stores every dense fp32 layer with at least MODEL_SPARSE_MIN_SPARSITY zeros in its weights as a
+ * sparse (csr) layer, which forwardprop runs with a sparse kernel. returns how many layers are
+ * sparse afterwards. sparse layers are inference-only: they cannot be trained or quantized */
+uint32_t model_sparsify(model_t* model);
+
+bool model_has_sparse_layers(const model_t* model);
+
+/* the smallest rank at which the factorization of layer index keeps at least energy (a fraction)
+ * of the sum of its weights' squared singular values. the layer must not be sparse or low-rank */
+uint32_t model_get_layer_rank(const model_t* model, uint32_t index, float energy);
+
+/* floating point operations per sample in layer index's products, two per multiply-add. biases
+ * and activations are left out */
+uint64_t model_get_layer_flops(const model_t* model, uint32_t index);
+
+/* replaces the weights of each dense layer i with ranks[i] > 0 by their best approximation of that
+ * rank (a truncated svd), stored as two factors that forwardprop multiplies by in turn, with no
+ * activation in between. layers the factors would not make cheaper are left alone. returns how
+ * many layers are low-rank afterwards; like sparse layers, they are inference-only */
+uint32_t model_factorize(model_t* model, const uint32_t* ranks);
+
+bool model_has_low_rank_layers(const model_t* model);
+
+uint32_t model_get_input_size(const model_t* model);
+uint32_t model_get_output_size(const model_t* model);
+
+enum {
+    /* also allocate z for every layer, which backprop needs */
+    FORWARDPROP_KEEP_Z = (1 << 0),
+};
+
+/* one output per layer, each layer_size x batch_size. alloc may be NULL. each layer's product is
+ * specialized for batch_size here (see gemm_plan_alloc), so allocate once and reuse */
+struct forwardprop_layer_output* model_alloc_forwardprop(const model_t* model,
+                                                         const struct nv_allocator* alloc,
+                                                         uint32_t batch_size, uint32_t flags);
+
+void model_free_forwardprop(const model_t* model, const struct nv_allocator* alloc,
+                            struct forwardprop_layer_output* output);
+
+/* bytes model_alloc_forwardprop takes out of an arena (see arena.h) */
+size_t model_get_forwardprop_size(const model_t* model, uint32_t batch_size, uint32_t flags);
 
+/* input is input_size x batch, one sample per column. every layer becomes a single product over
+ * the whole batch */
 void model_forwardprop(const model_t* model, const matrix_t* input,
                        struct forwardprop_layer_output* output);
 
-void model_backprop(const model_t* model, const matrix_t* input, const matrix_t* expected,
-                    const struct forwardprop_layer_output* fp, struct model_layer* deltas);
+/* scratch for model_infer: two buffers sized for the widest layer, which the layers ping-pong
+ * between. no z is ever kept, so memory is O(widest layer x batch) however deep the model is */
+struct model_inference;
 
+/* for batches of up to batch_size. alloc may be NULL */
+struct model_inference* model_alloc_inference(const model_t* model,
+                                              const struct nv_allocator* alloc,
+                                              uint32_t batch_size);
+
+void model_free_inference(const struct nv_allocator* alloc, struct model_inference* inference);
+
+/* input is input_size x batch (batch up to the inference's batch size), one sample per column.
+ * returns the output (output_size x batch), which lives in inference until its next use */
+const matrix_t* model_infer(const model_t* model, const matrix_t* input,
+                            struct model_inference* inference);
+
+/* batches denser than this (the fraction of nonzero pixels) run the first layer as a dense gemm */
+#define MODEL_SPARSE_INPUT_MAX_DENSITY 0.3f
+
+/* as model_infer, from raw pixels: count images (up to the inference's batch size), one every
+ * stride bytes, scaled to [0, 1] as dataset_get_batch does. zero pixels are skipped in the first
+ * layer unless the batch is too dense. the first layer's weights are copied when the inference is
+ * allocated, so it must be reallocated after they change */
+const matrix_t* model_infer_pixels(const model_t* model, const uint8_t* pixels, size_t stride,
+                                   uint32_t count, struct model_inference* inference);
+
+/* parameter gradients, plus the scratch backprop needs for one batch size. allocated once and
+ * reused for every batch */
+struct model_deltas {
+    uint32_t num_layers;
+    uint32_t batch_size;
+
+    /* gradients, shaped like the model's layers. op is unused */
+    struct model_layer* layers;
+
+    /* backs layers the way model::parameters backs a model's; always fp32, so it is laid out like
+     * the block of a model with fp32 weights */
+    matrix_t* parameters;
+    matrix_t* views;
+
+    /* gradient of the loss with respect to each layer's output, layer_size x batch_size */
+    matrix_t** errors;
+
+    /* code generated for each layer's products at batch_size, as for forwardprop: the weight
+     * gradient and the error passed back. entries may be NULL */
+    gemm_plan_t** gradient_plans;
+    gemm_plan_t** error_plans;
+};
+
+struct model_deltas* model_alloc_deltas(const model_t* model, uint32_t batch_size);
+void model_free_deltas(struct model_deltas* deltas);
+
+void model_zero_deltas(struct model_deltas* deltas);
+
+/* where the caller writes the gradient of the loss with respect to the model's output before
+ * calling model_backprop; output_size x batch_size */
+matrix_t* model_get_output_error(const struct model_deltas* deltas);
+
+enum {
+    /* the output error is with respect to the last layer's z rather than its activations, as
+     * mat_softmax_cross_entropy produces */
+    BACKPROP_OUTPUT_IS_Z = (1 << 0),
+};
+
+/* adds the gradients of the loss over the batch to deltas, working back from the output error.
+ * fp must be the forward pass of input. the output error is overwritten */
+void model_backprop(const model_t* model, const matrix_t* input,
+                    const struct forwardprop_layer_output* fp, struct model_deltas* deltas,
+                    uint32_t flags);
+
+/* parameters -= rate * deltas. weights must be dense fp32 */
+void model_apply_deltas(model_t* model, const struct model_deltas* deltas, float rate);
+
+/* reads every parameter into memory. files written before versioning are still read */
 model_t* model_read_from_path(const struct nv_allocator* alloc, const char* path);
+
+enum {
+    /* map the parameters copy-on-write, e.g. to fine-tune. otherwise they are read-only and any
+     * write faults */
+    MODEL_MAP_WRITABLE = (1 << 0),
+
+    /* check the parameters against the file's checksum, which touches every page. the header and
+     * layer table are always checked */
+    MODEL_MAP_VERIFY = (1 << 1),
+};
+
+/* opens a model without copying its parameters: they stay views into a private mapping of the file,
+ * so opening costs no more than the header and processes share page cache. writes never reach the
+ * file. falls back to model_read_from_path for files written before versioning */
+model_t* model_map_from_path(const struct nv_allocator* alloc, const char* path, uint32_t flags);
+
+/* writes the current, versioned format. the file is synced and then replaces path atomically, so
+ * a crash never leaves a partial model and it is safe to write over a file that is mapped */
 bool model_write_to_path(const model_t* model, const char* path);
 
 #endif
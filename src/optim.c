@@ -0,0 +1,536 @@
+#include "optim.h"
+
+#include "matrix.h"
+#include "model.h"
+#include "cpu.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OPTIM_X86
+#endif
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* most state any optimizer keeps per parameter */
+#define OPTIM_MAX_STATE 2
+
+/* everything an update needs, folded once per step */
+struct optim_step {
+    /* the learning rate; for adam with the bias correction of both moments folded in */
+    float rate;
+    float scale;
+
+    float momentum;
+
+    float beta1, beta2;
+    float epsilon;
+};
+
+/* p: parameters, g: gradients, m and v: state blocks (NULL if unused) */
+typedef void (*update_kernel_t)(const struct optim_step* step, float* p, const float* g, float* m,
+                                float* v, size_t count);
+
+struct optim_kernels {
+    const char* name;
+
+    /* indexed by OPTIM_* */
+    update_kernel_t update[3];
+};
+
+typedef struct optimizer {
+    struct optim_params params;
+    struct optim_step step;
+    uint64_t step_count;
+
+    /* elements per state block; the length of the model's parameter block */
+    size_t count;
+
+    uint32_t state_count;
+    matrix_t* state[OPTIM_MAX_STATE];
+} optimizer_t;
+
+static void sgd_scalar(const struct optim_step* step, float* p, const float* g, float* m, float* v,
+                       size_t count) {
+    float rate = step->rate * step->scale;
+    for (size_t i = 0; i < count; i++) {
+        p[i] -= rate * g[i];
+    }
+}
+
+static void momentum_scalar(const struct optim_step* step, float* p, const float* g, float* m,
+                            float* v, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        m[i] = step->momentum * m[i] + step->scale * g[i];
+        p[i] -= step->rate * m[i];
+    }
+}
+
+static void adam_scalar(const struct optim_step* step, float* p, const float* g, float* m, float* v,
+                        size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float grad = step->scale * g[i];
+
+        m[i] = step->beta1 * m[i] + (1.f - step->beta1) * grad;
+        v[i] = step->beta2 * v[i] + (1.f - step->beta2) * grad * grad;
+
+        p[i] -= step->rate * m[i] / (sqrtf(v[i]) + step->epsilon);
+    }
+}
+
+static const struct optim_kernels s_scalar_kernels = {
+    "scalar",
+    { sgd_scalar, momentum_scalar, adam_scalar },
+};
+
+#ifdef OPTIM_X86
+/* tails are left to the scalar kernels */
+
+__attribute__((target("avx2,fma"))) static void sgd_avx2(const struct optim_step* step, float* p,
+                                                         const float* g, float* m, float* v,
+                                                         size_t count) {
+    __m256 rate = _mm256_set1_ps(-step->rate * step->scale);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 value = _mm256_fmadd_ps(rate, _mm256_loadu_ps(g + i), _mm256_loadu_ps(p + i));
+        _mm256_storeu_ps(p + i, value);
+    }
+
+    sgd_scalar(step, p + i, g + i, NULL, NULL, count - i);
+}
+
+__attribute__((target("avx2,fma"))) static void momentum_avx2(const struct optim_step* step,
+                                                              float* p, const float* g, float* m,
+                                                              float* v, size_t count) {
+    __m256 momentum = _mm256_set1_ps(step->momentum);
+    __m256 scale = _mm256_set1_ps(step->scale);
+    __m256 rate = _mm256_set1_ps(-step->rate);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 grad = _mm256_mul_ps(scale, _mm256_loadu_ps(g + i));
+        __m256 velocity = _mm256_fmadd_ps(momentum, _mm256_loadu_ps(m + i), grad);
+
+        _mm256_storeu_ps(m + i, velocity);
+        _mm256_storeu_ps(p + i, _mm256_fmadd_ps(rate, velocity, _mm256_loadu_ps(p + i)));
+    }
+
+    momentum_scalar(step, p + i, g + i, m + i, NULL, count - i);
+}
+
+__attribute__((target("avx2,fma"))) static void adam_avx2(const struct optim_step* step, float* p,
+                                                          const float* g, float* m, float* v,
+                                                          size_t count) {
+    __m256 beta1 = _mm256_set1_ps(step->beta1);
+    __m256 beta2 = _mm256_set1_ps(step->beta2);
+    __m256 one_minus_beta1 = _mm256_set1_ps(1.f - step->beta1);
+    __m256 one_minus_beta2 = _mm256_set1_ps(1.f - step->beta2);
+
+    __m256 scale = _mm256_set1_ps(step->scale);
+    __m256 rate = _mm256_set1_ps(-step->rate);
+    __m256 epsilon = _mm256_set1_ps(step->epsilon);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 grad = _mm256_mul_ps(scale, _mm256_loadu_ps(g + i));
+
+        __m256 first = _mm256_mul_ps(beta1, _mm256_loadu_ps(m + i));
+        first = _mm256_fmadd_ps(one_minus_beta1, grad, first);
+
+        __m256 second = _mm256_mul_ps(beta2, _mm256_loadu_ps(v + i));
+        second = _mm256_fmadd_ps(one_minus_beta2, _mm256_mul_ps(grad, grad), second);
+
+        __m256 denominator = _mm256_add_ps(_mm256_sqrt_ps(second), epsilon);
+        __m256 delta = _mm256_div_ps(first, denominator);
+
+        _mm256_storeu_ps(m + i, first);
+        _mm256_storeu_ps(v + i, second);
+        _mm256_storeu_ps(p + i, _mm256_fmadd_ps(rate, delta, _mm256_loadu_ps(p + i)));
+    }
+
+    adam_scalar(step, p + i, g + i, m + i, v + i, count - i);
+}
+
+__attribute__((target("avx512f"))) static void sgd_avx512(const struct optim_step* step, float* p,
+                                                          const float* g, float* m, float* v,
+                                                          size_t count) {
+    __m512 rate = _mm512_set1_ps(-step->rate * step->scale);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 value = _mm512_fmadd_ps(rate, _mm512_loadu_ps(g + i), _mm512_loadu_ps(p + i));
+        _mm512_storeu_ps(p + i, value);
+    }
+
+    sgd_scalar(step, p + i, g + i, NULL, NULL, count - i);
+}
+
+__attribute__((target("avx512f"))) static void momentum_avx512(const struct optim_step* step,
+                                                               float* p, const float* g, float* m,
+                                                               float* v, size_t count) {
+    __m512 momentum = _mm512_set1_ps(step->momentum);
+    __m512 scale = _mm512_set1_ps(step->scale);
+    __m512 rate = _mm512_set1_ps(-step->rate);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 grad = _mm512_mul_ps(scale, _mm512_loadu_ps(g + i));
+        __m512 velocity = _mm512_fmadd_ps(momentum, _mm512_loadu_ps(m + i), grad);
+
+        _mm512_storeu_ps(m + i, velocity);
+        _mm512_storeu_ps(p + i, _mm512_fmadd_ps(rate, velocity, _mm512_loadu_ps(p + i)));
+    }
+
+    momentum_scalar(step, p + i, g + i, m + i, NULL, count - i);
+}
+
+__attribute__((target("avx512f"))) static void adam_avx512(const struct optim_step* step, float* p,
+                                                           const float* g, float* m, float* v,
+                                                           size_t count) {
+    __m512 beta1 = _mm512_set1_ps(step->beta1);
+    __m512 beta2 = _mm512_set1_ps(step->beta2);
+    __m512 one_minus_beta1 = _mm512_set1_ps(1.f - step->beta1);
+    __m512 one_minus_beta2 = _mm512_set1_ps(1.f - step->beta2);
+
+    __m512 scale = _mm512_set1_ps(step->scale);
+    __m512 rate = _mm512_set1_ps(-step->rate);
+    __m512 epsilon = _mm512_set1_ps(step->epsilon);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 grad = _mm512_mul_ps(scale, _mm512_loadu_ps(g + i));
+
+        __m512 first = _mm512_mul_ps(beta1, _mm512_loadu_ps(m + i));
+        first = _mm512_fmadd_ps(one_minus_beta1, grad, first);
+
+        __m512 second = _mm512_mul_ps(beta2, _mm512_loadu_ps(v + i));
+        second = _mm512_fmadd_ps(one_minus_beta2, _mm512_mul_ps(grad, grad), second);
+
+        __m512 denominator = _mm512_add_ps(_mm512_sqrt_ps(second), epsilon);
+        __m512 delta = _mm512_div_ps(first, denominator);
+
+        _mm512_storeu_ps(m + i, first);
+        _mm512_storeu_ps(v + i, second);
+        _mm512_storeu_ps(p + i, _mm512_fmadd_ps(rate, delta, _mm512_loadu_ps(p + i)));
+    }
+
+    adam_scalar(step, p + i, g + i, m + i, v + i, count - i);
+}
+
+static const struct optim_kernels s_avx2_kernels = {
+    "avx2",
+    { sgd_avx2, momentum_avx2, adam_avx2 },
+};
+
+static const struct optim_kernels s_avx512_kernels = {
+    "avx512",
+    { sgd_avx512, momentum_avx512, adam_avx512 },
+};
+#endif
+
+static pthread_once_t s_kernels_once = PTHREAD_ONCE_INIT;
+static const struct optim_kernels* s_kernels;
+
+static void select_kernels() {
+    s_kernels = &s_scalar_kernels;
+
+#ifdef OPTIM_X86
+    if (cpu_has_features(CPU_FEATURE_AVX512F)) {
+        s_kernels = &s_avx512_kernels;
+    } else if (cpu_has_features(CPU_FEATURE_AVX2 | CPU_FEATURE_FMA)) {
+        s_kernels = &s_avx2_kernels;
+    }
+#endif
+
+    NV_LOG_DEBUG("optim: using %s update kernels", s_kernels->name);
+}
+
+static const struct optim_kernels* get_kernels() {
+    pthread_once(&s_kernels_once, select_kernels);
+    return s_kernels;
+}
+
+void optim_get_default_params(uint32_t type, struct optim_params* params) {
+    memset(params, 0, sizeof(struct optim_params));
+    params->type = type;
+
+    params->momentum = 0.9f;
+
+    params->beta1 = 0.9f;
+    params->beta2 = 0.999f;
+    params->epsilon = 1e-8f;
+}
+
+static uint32_t get_state_count(uint32_t type) {
+    switch (type) {
+    case OPTIM_MOMENTUM:
+        return 1;
+    case OPTIM_ADAM:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+optimizer_t* optim_alloc(const model_t* model, const struct optim_params* params) {
+    assert(params->type <= OPTIM_ADAM);
+
+    /* gradients are fp32, so updates only line up with an fp32 parameter block */
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        assert(model->layers[i].weights->type == MAT_TYPE_F32);
+    }
+
+    optimizer_t* optimizer = nv_alloc(sizeof(optimizer_t));
+    assert(optimizer);
+    memset(optimizer, 0, sizeof(optimizer_t));
+
+    memcpy(&optimizer->params, params, sizeof(struct optim_params));
+    optimizer->count = model->parameters->columns;
+    optimizer->state_count = get_state_count(params->type);
+
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        matrix_t* state = mat_alloc_ex(NULL, 1, model->parameters->columns, MAT_ALLOC_HUGE_PAGES);
+        assert(state);
+
+        mat_zero(state);
+        optimizer->state[i] = state;
+    }
+
+    return optimizer;
+}
+
+void optim_free(optimizer_t* optimizer) {
+    if (!optimizer) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        mat_free(NULL, optimizer->state[i]);
+    }
+
+    nv_free(optimizer);
+}
+
+const struct optim_params* optim_get_params(const optimizer_t* optimizer) {
+    return &optimizer->params;
+}
+
+void optim_begin_step(optimizer_t* optimizer, float rate) {
+    const struct optim_params* params = &optimizer->params;
+    struct optim_step* step = &optimizer->step;
+
+    optimizer->step_count++;
+
+    step->rate = rate;
+    step->momentum = params->momentum;
+    step->beta1 = params->beta1;
+    step->beta2 = params->beta2;
+    step->epsilon = params->epsilon;
+
+    if (params->type == OPTIM_ADAM) {
+        /* rate * m_hat / (sqrt(v_hat) + eps), with the corrections moved out of the loop */
+        double t = (double)optimizer->step_count;
+        double correction1 = 1.0 - pow(params->beta1, t);
+        double correction2 = sqrt(1.0 - pow(params->beta2, t));
+
+        step->rate = (float)(rate * correction2 / correction1);
+        step->epsilon = (float)(params->epsilon * correction2);
+    }
+}
+
+void optim_update(optimizer_t* optimizer, float* parameters, const float* gradients, size_t begin,
+                  size_t end, float scale) {
+    assert(begin <= end && end <= optimizer->count);
+    assert(optimizer->step_count > 0);
+
+    /* a copy, so parallel ranges never share a writable step */
+    struct optim_step step = optimizer->step;
+    step.scale = scale;
+
+    float* state[OPTIM_MAX_STATE] = { NULL };
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        state[i] = optimizer->state[i]->data + begin;
+    }
+
+    update_kernel_t update = get_kernels()->update[optimizer->params.type];
+    update(&step, parameters + begin, gradients + begin, state[0], state[1], end - begin);
+}
+
+void optim_copy(optimizer_t* dst, const optimizer_t* src) {
+    assert(dst->params.type == src->params.type);
+    assert(dst->count == src->count);
+
+    dst->step = src->step;
+    dst->step_count = src->step_count;
+
+    for (uint32_t i = 0; i < src->state_count; i++) {
+        mat_copy(dst->state[i], src->state[i]);
+    }
+}
+
+/* state files: a header, then each state block in full, in the writer's byte order */
+#define OPTIM_FILE_MAGIC "NVOP"
+#define OPTIM_FILE_VERSION 1
+#define OPTIM_FILE_BYTE_ORDER 0x01020304u
+
+struct state_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+
+    uint32_t type;
+    uint64_t step_count;
+
+    /* elements per block */
+    uint64_t count;
+    uint32_t state_count;
+
+    /* crc32 over every block */
+    uint32_t checksum;
+};
+
+static uint32_t get_state_checksum(const optimizer_t* optimizer) {
+    uLong crc = crc32(0, Z_NULL, 0);
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        crc = crc32_z(crc, (const void*)optimizer->state[i]->data,
+                      optimizer->count * sizeof(float));
+    }
+
+    return (uint32_t)crc;
+}
+
+static bool write_state(const optimizer_t* optimizer, FILE* f) {
+    struct state_header header;
+    memset(&header, 0, sizeof(struct state_header));
+    memcpy(header.magic, OPTIM_FILE_MAGIC, sizeof(header.magic));
+
+    header.version = OPTIM_FILE_VERSION;
+    header.byte_order = OPTIM_FILE_BYTE_ORDER;
+    header.type = optimizer->params.type;
+    header.step_count = optimizer->step_count;
+    header.count = optimizer->count;
+    header.state_count = optimizer->state_count;
+    header.checksum = get_state_checksum(optimizer);
+
+    if (fwrite(&header, sizeof(struct state_header), 1, f) != 1) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        const float* data = optimizer->state[i]->data;
+        if (fwrite(data, sizeof(float), optimizer->count, f) != optimizer->count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool optim_write_to_path(const optimizer_t* optimizer, const char* path) {
+    NV_LOG_DEBUG("writing optimizer state to path: %s", path);
+
+    /* same as model_write_to_path: synced, then renamed over path */
+    size_t path_length = strlen(path);
+    char* temp_path = nv_alloc(path_length + sizeof(".tmp"));
+    assert(temp_path);
+
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE* f = fopen(temp_path, "wb");
+    if (!f) {
+        NV_LOG_ERROR("failed to write optimizer state to path: %s", temp_path);
+
+        nv_free(temp_path);
+        return false;
+    }
+
+    bool success = write_state(optimizer, f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    success = fclose(f) == 0 && success;
+
+    if (success && rename(temp_path, path) != 0) {
+        NV_LOG_ERROR("failed to move optimizer state into place at path: %s", path);
+        success = false;
+    }
+
+    if (!success) {
+        remove(temp_path);
+    }
+
+    nv_free(temp_path);
+    return success;
+}
+
+static bool check_state_header(const optimizer_t* optimizer, const struct state_header* header) {
+    if (memcmp(header->magic, OPTIM_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != OPTIM_FILE_VERSION || header->byte_order != OPTIM_FILE_BYTE_ORDER) {
+        NV_LOG_ERROR("not an optimizer state file this build can read!");
+        return false;
+    }
+
+    if (header->type != optimizer->params.type || header->count != optimizer->count ||
+        header->state_count != optimizer->state_count) {
+        NV_LOG_ERROR("optimizer state does not match the optimizer or model!");
+        return false;
+    }
+
+    return true;
+}
+
+bool optim_read_from_path(optimizer_t* optimizer, const char* path) {
+    NV_LOG_DEBUG("reading optimizer state from path: %s", path);
+
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        NV_LOG_ERROR("failed to open optimizer state at path: %s", path);
+        return false;
+    }
+
+    struct state_header header;
+    bool success = fread(&header, sizeof(struct state_header), 1, f) == 1 &&
+                   check_state_header(optimizer, &header);
+
+    /* read into fresh blocks, so that a bad file leaves the optimizer as it was */
+    matrix_t* state[OPTIM_MAX_STATE] = { NULL };
+    for (uint32_t i = 0; success && i < optimizer->state_count; i++) {
+        state[i] = mat_alloc_ex(NULL, 1, (uint32_t)optimizer->count, MAT_ALLOC_HUGE_PAGES);
+        assert(state[i]);
+
+        success = fread(state[i]->data, sizeof(float), optimizer->count, f) == optimizer->count;
+    }
+
+    fclose(f);
+
+    if (success) {
+        matrix_t* previous[OPTIM_MAX_STATE];
+        memcpy(previous, optimizer->state, sizeof(previous));
+        memcpy(optimizer->state, state, sizeof(state));
+
+        if (get_state_checksum(optimizer) != header.checksum) {
+            NV_LOG_ERROR("optimizer state is corrupt!");
+
+            memcpy(optimizer->state, previous, sizeof(previous));
+            success = false;
+        } else {
+            memcpy(state, previous, sizeof(previous));
+            optimizer->step_count = header.step_count;
+        }
+    }
+
+    /* whichever blocks lost */
+    for (uint32_t i = 0; i < optimizer->state_count; i++) {
+        mat_free(NULL, state[i]);
+    }
+
+    return success;
+}
@@ -0,0 +1,62 @@
+#ifndef _OPTIM_H
+#define _OPTIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* parameter updates. state (momentum's velocity, adam's moments) is kept as blocks laid out like
+ * model::parameters, so every update is elementwise over the parameter block and each kind is a
+ * single fused pass over parameters, gradients and state */
+
+/* from model.h */
+typedef struct model model_t;
+
+enum {
+    OPTIM_SGD = 0,
+    OPTIM_MOMENTUM,
+    OPTIM_ADAM,
+};
+
+struct optim_params {
+    /* OPTIM_* */
+    uint32_t type;
+
+    /* OPTIM_MOMENTUM: v = momentum * v + g */
+    float momentum;
+
+    /* OPTIM_ADAM */
+    float beta1, beta2;
+    float epsilon;
+};
+
+/* the usual defaults for type */
+void optim_get_default_params(uint32_t type, struct optim_params* params);
+
+typedef struct optimizer optimizer_t;
+
+/* state starts at zero, shaped like model's parameter block. model must have dense fp32 weights */
+optimizer_t* optim_alloc(const model_t* model, const struct optim_params* params);
+void optim_free(optimizer_t* optimizer);
+
+const struct optim_params* optim_get_params(const optimizer_t* optimizer);
+
+/* starts a step at the given learning rate; adam's bias correction advances here. call once per
+ * step, before any optim_update */
+void optim_begin_step(optimizer_t* optimizer, float rate);
+
+/* updates elements [begin, end) of the parameter block from gradients (a block laid out the same
+ * way) scaled by scale, e.g. 1 / batch size for a summed gradient. each element is read and
+ * written once, so disjoint ranges of one step can run in parallel */
+void optim_update(optimizer_t* optimizer, float* parameters, const float* gradients, size_t begin,
+                  size_t end, float scale);
+
+/* copies the state (and step count) of src into dst, which must have the same params and shape */
+void optim_copy(optimizer_t* dst, const optimizer_t* src);
+
+/* state files are tied to the model shape they were allocated for. reading fails (leaving
+ * optimizer untouched) if the file does not match optimizer's type and shape */
+bool optim_write_to_path(const optimizer_t* optimizer, const char* path);
+bool optim_read_from_path(optimizer_t* optimizer, const char* path);
+
+#endif
@@ -0,0 +1,207 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+struct pool_worker {
+    thread_pool_t* pool;
+    pthread_t thread;
+    uint32_t index;
+};
+
+typedef struct thread_pool {
+    uint32_t flags;
+    uint32_t thread_count;
+    struct pool_worker* workers;
+
+    /* serializes pool_run callers from different threads */
+    pthread_mutex_t run_mutex;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    uint64_t generation;
+    uint32_t active_workers;
+    bool shutdown;
+
+    /* current job */
+    pool_task_t task;
+    void* user;
+    uint32_t task_count;
+    atomic_uint next_task;
+} thread_pool_t;
+
+static _Thread_local bool s_in_task;
+
+static void run_tasks(thread_pool_t* pool, uint32_t worker) {
+    s_in_task = true;
+
+    if (pool->flags & POOL_STATIC_SCHEDULE) {
+        /* contiguous range per worker */
+        uint64_t count = pool->task_count;
+        uint32_t begin = (uint32_t)(count * worker / pool->thread_count);
+        uint32_t end = (uint32_t)(count * (worker + 1) / pool->thread_count);
+
+        for (uint32_t i = begin; i < end; i++) {
+            pool->task(pool->user, i, worker);
+        }
+    } else {
+        while (true) {
+            uint32_t i = atomic_fetch_add_explicit(&pool->next_task, 1, memory_order_relaxed);
+            if (i >= pool->task_count) {
+                break;
+            }
+
+            pool->task(pool->user, i, worker);
+        }
+    }
+
+    s_in_task = false;
+}
+
+static void* worker_main(void* arg) {
+    struct pool_worker* worker = arg;
+    thread_pool_t* pool = worker->pool;
+
+    uint64_t seen_generation = 0;
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->shutdown && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_tasks(pool, worker->index);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->active_workers == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+thread_pool_t* pool_alloc(uint32_t thread_count, uint32_t flags) {
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    NV_LOG_DEBUG("allocating thread pool with %u threads", thread_count);
+
+    thread_pool_t* pool = nv_alloc(sizeof(thread_pool_t));
+    assert(pool);
+    memset(pool, 0, sizeof(thread_pool_t));
+
+    pool->flags = flags;
+    pool->thread_count = thread_count;
+
+    pthread_mutex_init(&pool->run_mutex, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    /* worker 0 is whoever calls pool_run */
+    uint32_t spawned = thread_count - 1;
+    if (spawned > 0) {
+        pool->workers = nv_alloc(spawned * sizeof(struct pool_worker));
+        assert(pool->workers);
+    }
+
+    for (uint32_t i = 0; i < spawned; i++) {
+        struct pool_worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i + 1;
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            NV_LOG_ERROR("failed to spawn pool worker %u; continuing with %u threads", i + 1,
+                         i + 1);
+
+            pool->thread_count = i + 1;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void pool_free(thread_pool_t* pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i + 1 < pool->thread_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->run_mutex);
+
+    nv_free(pool->workers);
+    nv_free(pool);
+}
+
+uint32_t pool_get_thread_count(const thread_pool_t* pool) { return pool->thread_count; }
+
+void pool_run(thread_pool_t* pool, uint32_t task_count, pool_task_t task, void* user) {
+    if (task_count == 0) {
+        return;
+    }
+
+    /* nested or trivial: no point waking anyone */
+    if (s_in_task || pool->thread_count == 1 || task_count == 1) {
+        for (uint32_t i = 0; i < task_count; i++) {
+            task(user, i, 0);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_mutex);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->user = user;
+    pool->task_count = task_count;
+    atomic_store_explicit(&pool->next_task, 0, memory_order_relaxed);
+
+    pool->active_workers = pool->thread_count - 1;
+    pool->generation++;
+
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_tasks(pool, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->active_workers > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&pool->run_mutex);
+}
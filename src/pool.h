@@ -0,0 +1,28 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct thread_pool thread_pool_t;
+
+enum {
+    /* task i always runs on the same worker for a given task count, instead of workers pulling
+     * tasks off a shared counter */
+    POOL_STATIC_SCHEDULE = (1 << 0),
+};
+
+/* worker is in [0, pool_get_thread_count()); the calling thread participates as worker 0 */
+typedef void (*pool_task_t)(void* user, uint32_t index, uint32_t worker);
+
+/* thread_count includes the calling thread. 0 uses the number of online cpus */
+thread_pool_t* pool_alloc(uint32_t thread_count, uint32_t flags);
+void pool_free(thread_pool_t* pool);
+
+uint32_t pool_get_thread_count(const thread_pool_t* pool);
+
+/* runs task for every index in [0, task_count) and blocks until all are done. calls made from
+ * inside a running task execute serially on the calling thread */
+void pool_run(thread_pool_t* pool, uint32_t task_count, pool_task_t task, void* user);
+
+#endif
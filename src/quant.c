@@ -0,0 +1,468 @@
+#include "quant.h"
+
+#include "matrix.h"
+#include "model.h"
+#include "cpu.h"
+#include "vec.h"
+
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANT_X86
+#endif
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* weight rows and samples are padded to this many bytes, so kernels never need a tail */
+#define QUANT_ALIGNMENT 64
+
+/* samples pushed through a layer together; each weight row is loaded once per group */
+#define QUANT_GROUP 4
+
+struct quant_layer {
+    uint32_t op;
+    uint32_t rows, columns;
+
+    /* bytes between weight rows; columns rounded up to QUANT_ALIGNMENT, padding zeroed */
+    size_t stride;
+
+    int8_t* weights;
+
+    /* weight = scale * q, per row */
+    float* scales;
+
+    /* sum of each row's quantized weights, to take the input zero point back out */
+    int32_t* row_sums;
+    float* biases;
+
+    /* input = input_scale * (q - input_zero_point) */
+    float input_scale;
+    int32_t input_zero_point;
+};
+
+typedef struct quant_model {
+    uint32_t num_layers;
+    struct quant_layer* layers;
+
+    /* widest per-sample buffer any layer reads or writes */
+    size_t max_stride;
+    uint32_t max_rows;
+} quant_model_t;
+
+/* out[s] = sum over i < count of x[s * x_stride + i] * w[i], for QUANT_GROUP samples. count is a
+ * multiple of QUANT_ALIGNMENT */
+typedef void (*quant_dot_t)(const int8_t* w, const uint8_t* x, size_t x_stride, size_t count,
+                            int32_t* out);
+
+struct quant_kernel {
+    const char* name;
+    quant_dot_t dot;
+};
+
+static void dot_scalar(const int8_t* w, const uint8_t* x, size_t x_stride, size_t count,
+                       int32_t* out) {
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        const uint8_t* sample = x + s * x_stride;
+
+        int32_t sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += (int32_t)sample[i] * w[i];
+        }
+
+        out[s] = sum;
+    }
+}
+
+#ifdef QUANT_X86
+/* pmaddubsw would halve the instruction count, but its int16 pair sums saturate for full range
+ * weights (255 * 127 * 2 > 32767). widening to int16 first and using pmaddwd is exact */
+__attribute__((target("avx2"))) static void dot_avx2(const int8_t* w, const uint8_t* x,
+                                                     size_t x_stride, size_t count, int32_t* out) {
+    __m256i acc[QUANT_GROUP];
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        acc[s] = _mm256_setzero_si256();
+    }
+
+    for (size_t i = 0; i < count; i += 16) {
+        __m256i w16 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + i)));
+
+        for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+            const __m128i* src = (const __m128i*)(x + s * x_stride + i);
+            __m256i x16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(src));
+
+            acc[s] = _mm256_add_epi32(acc[s], _mm256_madd_epi16(x16, w16));
+        }
+    }
+
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc[s]),
+                                    _mm256_extracti128_si256(acc[s], 1));
+
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        out[s] = _mm_cvtsi128_si32(sum);
+    }
+}
+
+/* vpdpbusd: u8 x s8 products summed in groups of 4 straight into int32, no saturation */
+__attribute__((target("avx512f,avx512vnni"))) static void dot_vnni(const int8_t* w,
+                                                                   const uint8_t* x,
+                                                                   size_t x_stride, size_t count,
+                                                                   int32_t* out) {
+    __m512i acc[QUANT_GROUP];
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        acc[s] = _mm512_setzero_si512();
+    }
+
+    for (size_t i = 0; i < count; i += 64) {
+        __m512i weights = _mm512_loadu_si512(w + i);
+
+        for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+            __m512i values = _mm512_loadu_si512(x + s * x_stride + i);
+            acc[s] = _mm512_dpbusd_epi32(acc[s], values, weights);
+        }
+    }
+
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        out[s] = _mm512_reduce_add_epi32(acc[s]);
+    }
+}
+#endif
+
+static const struct quant_kernel s_scalar_kernel = { "scalar", dot_scalar };
+
+#ifdef QUANT_X86
+static const struct quant_kernel s_avx2_kernel = { "avx2", dot_avx2 };
+static const struct quant_kernel s_vnni_kernel = { "avx512-vnni", dot_vnni };
+#endif
+
+static pthread_once_t s_kernel_once = PTHREAD_ONCE_INIT;
+static const struct quant_kernel* s_kernel;
+
+static void select_kernel() {
+    s_kernel = &s_scalar_kernel;
+
+#ifdef QUANT_X86
+    if (cpu_has_features(CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512VNNI)) {
+        s_kernel = &s_vnni_kernel;
+    } else if (cpu_has_features(CPU_FEATURE_AVX2)) {
+        s_kernel = &s_avx2_kernel;
+    }
+#endif
+
+    NV_LOG_DEBUG("quant: using %s int8 kernel", s_kernel->name);
+}
+
+static const struct quant_kernel* get_kernel() {
+    pthread_once(&s_kernel_once, select_kernel);
+    return s_kernel;
+}
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static void quantize_weights(struct quant_layer* layer, const matrix_t* weights) {
+    for (uint32_t y = 0; y < layer->rows; y++) {
+        const float* row = mat_row(weights, y);
+
+        float max = 0.f;
+        for (uint32_t x = 0; x < layer->columns; x++) {
+            float magnitude = fabsf(row[x]);
+            max = magnitude > max ? magnitude : max;
+        }
+
+        float scale = max > 0.f ? max / 127.f : 1.f;
+        float inverse = 1.f / scale;
+
+        int8_t* dst = layer->weights + y * layer->stride;
+        int32_t sum = 0;
+
+        for (uint32_t x = 0; x < layer->columns; x++) {
+            long q = lrintf(row[x] * inverse);
+            q = q > 127 ? 127 : (q < -127 ? -127 : q);
+
+            dst[x] = (int8_t)q;
+            sum += (int32_t)q;
+        }
+
+        layer->scales[y] = scale;
+        layer->row_sums[y] = sum;
+    }
+}
+
+/* maps [lo, hi] (widened to include 0, so that 0 is exact) onto [0, 255] */
+static void set_input_range(struct quant_layer* layer, float lo, float hi) {
+    lo = lo < 0.f ? lo : 0.f;
+    hi = hi > 0.f ? hi : 0.f;
+
+    float scale = hi > lo ? (hi - lo) / 255.f : 1.f;
+    layer->input_scale = scale;
+    layer->input_zero_point = (int32_t)lrintf(-lo / scale);
+
+    NV_LOG_DEBUG("quant: input range [%f, %f], scale %f, zero point %d", lo, hi, scale,
+                 layer->input_zero_point);
+}
+
+static void get_range(const matrix_t* mat, float* lo, float* hi) {
+    *lo = INFINITY;
+    *hi = -INFINITY;
+
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        const float* row = mat_row(mat, y);
+        for (uint32_t x = 0; x < mat->columns; x++) {
+            *lo = row[x] < *lo ? row[x] : *lo;
+            *hi = row[x] > *hi ? row[x] : *hi;
+        }
+    }
+}
+
+static void alloc_layer(struct quant_layer* layer, const struct model_layer* source) {
+    const matrix_t* weights = source->weights;
+
+    layer->op = source->op;
+    layer->rows = weights->rows;
+    layer->columns = weights->columns;
+    layer->stride = align_up(weights->columns, QUANT_ALIGNMENT);
+
+    size_t weight_size = layer->stride * layer->rows;
+    layer->weights = nv_alloc(weight_size);
+    layer->scales = nv_alloc(layer->rows * sizeof(float));
+    layer->row_sums = nv_alloc(layer->rows * sizeof(int32_t));
+    layer->biases = nv_alloc(layer->rows * sizeof(float));
+    assert(layer->weights && layer->scales && layer->row_sums && layer->biases);
+
+    memset(layer->weights, 0, weight_size);
+    memcpy(layer->biases, source->biases->data, layer->rows * sizeof(float));
+
+    if (weights->type == MAT_TYPE_F32) {
+        quantize_weights(layer, weights);
+        return;
+    }
+
+    /* half precision weights are widened first */
+    matrix_t* widened = mat_alloc(NULL, weights->rows, weights->columns);
+    assert(widened);
+
+    mat_copy(widened, weights);
+    quantize_weights(layer, widened);
+
+    mat_free(NULL, widened);
+}
+
+quant_model_t* quant_model_alloc(const model_t* model, const matrix_t* calibration) {
+    assert(calibration->rows == model_get_input_size(model));
+
+    if (model_has_sparse_layers(model)) {
+        NV_LOG_ERROR("cannot quantize a model with sparse layers!");
+        return NULL;
+    }
+
+    if (model_has_low_rank_layers(model)) {
+        NV_LOG_ERROR("cannot quantize a model with low-rank layers!");
+        return NULL;
+    }
+
+    quant_model_t* quant = nv_alloc(sizeof(quant_model_t));
+    assert(quant);
+
+    quant->num_layers = model->num_layers;
+    quant->layers = nv_alloc(model->num_layers * sizeof(struct quant_layer));
+    assert(quant->layers);
+
+    quant->max_stride = 0;
+    quant->max_rows = 0;
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        struct quant_layer* layer = &quant->layers[i];
+        alloc_layer(layer, &model->layers[i]);
+
+        quant->max_stride = layer->stride > quant->max_stride ? layer->stride : quant->max_stride;
+        quant->max_rows = layer->rows > quant->max_rows ? layer->rows : quant->max_rows;
+    }
+
+    /* the first layer reads pixels as they are stored */
+    quant->layers[0].input_scale = 1.f / 255.f;
+    quant->layers[0].input_zero_point = 0;
+
+    struct forwardprop_layer_output* fp =
+        model_alloc_forwardprop(model, NULL, calibration->columns, 0);
+
+    model_forwardprop(model, calibration, fp);
+
+    for (uint32_t i = 1; i < model->num_layers; i++) {
+        float lo, hi;
+        get_range(fp[i - 1].activations, &lo, &hi);
+
+        NV_LOG_TRACE("quant: calibrating layer %u", i);
+        set_input_range(&quant->layers[i], lo, hi);
+    }
+
+    model_free_forwardprop(model, NULL, fp);
+    return quant;
+}
+
+void quant_model_free(quant_model_t* model) {
+    if (!model) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        struct quant_layer* layer = &model->layers[i];
+
+        nv_free(layer->weights);
+        nv_free(layer->scales);
+        nv_free(layer->row_sums);
+        nv_free(layer->biases);
+    }
+
+    nv_free(model->layers);
+    nv_free(model);
+}
+
+uint32_t quant_model_get_input_size(const quant_model_t* model) {
+    return model->layers[0].columns;
+}
+
+uint32_t quant_model_get_output_size(const quant_model_t* model) {
+    return model->layers[model->num_layers - 1].rows;
+}
+
+size_t quant_model_get_input_stride(const quant_model_t* model) {
+    return model->layers[0].stride;
+}
+
+/* contiguous; subtracting the max first keeps exp in range */
+static void softmax_vector(float* values, uint32_t count) {
+    const struct vec_kernels* kernels = vec_get_kernels();
+
+    float max = values[0];
+    for (uint32_t i = 1; i < count; i++) {
+        max = values[i] > max ? values[i] : max;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] -= max;
+    }
+
+    kernels->exp(values, values, count);
+    kernels->scale(values, 1.f / kernels->sum(values, count), count);
+}
+
+static void apply_activation(uint32_t op, float* values, uint32_t count) {
+    const struct vec_kernels* kernels = vec_get_kernels();
+
+    switch (op) {
+    case LAYER_OP_RELU:
+        kernels->relu(values, values, count);
+        break;
+    case LAYER_OP_SIGMOID:
+        kernels->sigmoid(values, values, count);
+        break;
+    case LAYER_OP_SOFTMAX:
+        softmax_vector(values, count);
+        break;
+    default:
+        break;
+    }
+}
+
+/* runs one group of samples (x, x_stride apart) through layer; values receives the activated
+ * outputs, layer->rows per sample */
+static void layer_forward(const struct quant_layer* layer, const uint8_t* x, size_t x_stride,
+                          float* values) {
+    const struct quant_kernel* kernel = get_kernel();
+
+    for (uint32_t r = 0; r < layer->rows; r++) {
+        int32_t acc[QUANT_GROUP];
+        kernel->dot(layer->weights + r * layer->stride, x, x_stride, layer->stride, acc);
+
+        /* w * x = (sw * qw) * (sx * (qx - zx)) = sw * sx * (qw . qx - zx * sum(qw)) */
+        float scale = layer->scales[r] * layer->input_scale;
+        int32_t offset = layer->input_zero_point * layer->row_sums[r];
+
+        for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+            values[s * layer->rows + r] = scale * (float)(acc[s] - offset) + layer->biases[r];
+        }
+    }
+
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        apply_activation(layer->op, values + s * layer->rows, layer->rows);
+    }
+}
+
+/* quantizes values for the next layer, whose inputs are stride bytes apart */
+static void requantize(const struct quant_layer* next, const float* values, uint32_t count,
+                       uint8_t* dst, size_t stride) {
+    float inverse = 1.f / next->input_scale;
+
+    for (uint32_t s = 0; s < QUANT_GROUP; s++) {
+        const float* src = values + s * count;
+        uint8_t* sample = dst + s * stride;
+
+        for (uint32_t i = 0; i < count; i++) {
+            long q = lrintf(src[i] * inverse) + next->input_zero_point;
+            sample[i] = (uint8_t)(q > 255 ? 255 : (q < 0 ? 0 : q));
+        }
+    }
+}
+
+void quant_model_forward(const quant_model_t* model, const uint8_t* input, uint32_t batch,
+                         matrix_t* output) {
+    const struct quant_layer* last = &model->layers[model->num_layers - 1];
+
+    assert(output->rows == last->rows);
+    assert(output->columns == batch);
+    assert(output->type == MAT_TYPE_F32);
+
+    size_t input_stride = quant_model_get_input_stride(model);
+
+    /* ping-pong buffers for the values between layers. stale bytes left in a sample's padding
+     * meet zero weights, so they never change the result */
+    size_t buffer_size = QUANT_GROUP * model->max_stride;
+    uint8_t buffers[2][buffer_size];
+    float values[QUANT_GROUP * model->max_rows];
+
+    memset(buffers, 0, sizeof(buffers));
+
+    for (uint32_t n0 = 0; n0 < batch; n0 += QUANT_GROUP) {
+        uint32_t count = batch - n0 < QUANT_GROUP ? batch - n0 : QUANT_GROUP;
+
+        const uint8_t* x = input + n0 * input_stride;
+        if (count < QUANT_GROUP) {
+            /* a short final group is padded out with zero samples */
+            memset(buffers[1], 0, buffer_size);
+            memcpy(buffers[1], x, count * input_stride);
+            x = buffers[1];
+        }
+
+        size_t x_stride = input_stride;
+        for (uint32_t i = 0; i < model->num_layers; i++) {
+            const struct quant_layer* layer = &model->layers[i];
+            layer_forward(layer, x, x_stride, values);
+
+            if (i + 1 < model->num_layers) {
+                const struct quant_layer* next = &model->layers[i + 1];
+
+                uint8_t* dst = buffers[i % 2];
+                requantize(next, values, layer->rows, dst, next->stride);
+
+                x = dst;
+                x_stride = next->stride;
+            }
+        }
+
+        for (uint32_t r = 0; r < last->rows; r++) {
+            float* row = mat_row(output, r) + n0;
+            for (uint32_t s = 0; s < count; s++) {
+                row[s] = values[s * last->rows + r];
+            }
+        }
+    }
+}
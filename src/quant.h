@@ -0,0 +1,39 @@
+#ifndef _QUANT_H
+#define _QUANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* int8 inference. weights are symmetric int8 with one scale per output row; the values a layer
+ * reads are asymmetric uint8 (scale and zero point per layer, calibrated from sample inputs).
+ * products accumulate in int32 and only the epilogue (scales, bias, activation, requantization)
+ * runs in fp32 */
+
+/* from matrix.h */
+typedef struct matrix matrix_t;
+
+/* from model.h */
+typedef struct model model_t;
+
+typedef struct quant_model quant_model_t;
+
+/* quantizes model. calibration (input_size x count, one sample per column, same scaling as the
+ * dataset) is run through the fp32 model to find the range each hidden layer's input covers. the
+ * first layer reads raw pixels, [0, 255] standing for [0, 1]. NULL if model has sparse or low-rank
+ * layers */
+quant_model_t* quant_model_alloc(const model_t* model, const matrix_t* calibration);
+void quant_model_free(quant_model_t* model);
+
+uint32_t quant_model_get_input_size(const quant_model_t* model);
+uint32_t quant_model_get_output_size(const quant_model_t* model);
+
+/* bytes between consecutive samples passed to quant_model_forward; the input size rounded up so
+ * that every sample starts on a cache line. the padding must be zero */
+size_t quant_model_get_input_stride(const quant_model_t* model);
+
+/* input holds batch samples of raw pixels, one every input stride bytes. output is
+ * output_size x batch, one sample per column, as model_forwardprop would produce */
+void quant_model_forward(const quant_model_t* model, const uint8_t* input, uint32_t batch,
+                         matrix_t* output);
+
+#endif
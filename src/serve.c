@@ -0,0 +1,681 @@
+#include "serve.h"
+
+#include "matrix.h"
+#include "model.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* queued images per batch a worker can take, so readers stay ahead of the workers under load but
+ * are held back (and hold back their clients) before memory grows */
+#define SERVER_QUEUE_BATCHES 4
+
+/* a client that has not read its answers after this long is dropped rather than stall a worker */
+#define SERVER_SEND_TIMEOUT 1
+
+/* latencies kept for the percentiles logged at the end; older ones are overwritten */
+#define SERVER_LATENCY_SAMPLES 65536
+
+/* how often the accept loop looks for a signal, in milliseconds */
+#define SERVER_POLL_INTERVAL 100
+
+struct server_connection {
+    int in_fd, out_fd;
+    bool owns_fds;
+
+    /* the sequence the next image gets; only the reader touches it */
+    uint32_t sequence;
+
+    /* the reader and every queued image each hold one (under the server's mutex). the last one out
+     * frees the connection */
+    uint32_t references;
+
+    /* answers are written whole, one at a time. once a write fails the rest are dropped */
+    pthread_mutex_t write_mutex;
+    bool failed;
+
+    server_t* server;
+    struct server_connection* next;
+};
+
+struct server_request {
+    struct server_connection* connection;
+    uint32_t sequence;
+    double arrival;
+};
+
+struct server_worker {
+    server_t* server;
+    pthread_t thread;
+    struct model_inference* inference;
+
+    /* the batch being run: pixels are copied out of the queue so it can refill meanwhile */
+    uint8_t* pixels;
+    struct server_request* requests;
+
+    /* a struct server_response and then output_size floats */
+    void* response;
+};
+
+typedef struct server {
+    const model_t* model;
+    struct server_params params;
+
+    uint32_t input_size, output_size;
+    size_t response_size;
+
+    struct server_worker* workers;
+
+    /* workers whose threads actually started, from the front */
+    uint32_t running_workers;
+
+    pthread_mutex_t mutex;
+
+    /* an image was queued, or the server is stopping */
+    pthread_cond_t ready_cond;
+
+    /* room was made in the queue */
+    pthread_cond_t space_cond;
+
+    /* a connection was freed */
+    pthread_cond_t idle_cond;
+
+    /* a ring of capacity images, count of them from head */
+    uint32_t capacity, head, count;
+    struct server_request* queue;
+    uint8_t* queue_pixels;
+
+    /* open connections, so that stopping can cut their readers off */
+    struct server_connection* connections;
+    uint32_t connection_count;
+
+    bool stopping;
+
+    /* seconds a batch is expected to take, as a moving average */
+    double batch_estimate;
+
+    /* since the last run started */
+    uint64_t served, batches;
+    double* latencies;
+    uint64_t latency_count;
+} server_t;
+
+static volatile sig_atomic_t s_interrupted;
+
+static void handle_signal(int signal) { s_interrupted = 1; }
+
+static double get_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+/* the cond's clock is CLOCK_MONOTONIC, like get_seconds */
+static void wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex, double seconds) {
+    struct timespec deadline;
+    deadline.tv_sec = (time_t)seconds;
+    deadline.tv_nsec = (long)((seconds - (double)deadline.tv_sec) * 1e9);
+
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+
+static void init_monotonic_cond(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+server_t* server_alloc(const model_t* model, const struct server_params* params) {
+    assert(params->max_batch > 0 && params->worker_count > 0);
+
+    server_t* server = nv_alloc(sizeof(server_t));
+    assert(server);
+    memset(server, 0, sizeof(server_t));
+
+    server->model = model;
+    server->params = *params;
+
+    server->input_size = model_get_input_size(model);
+    server->output_size = model_get_output_size(model);
+    server->response_size = sizeof(struct server_response) + server->output_size * sizeof(float);
+
+    server->capacity = params->max_batch * params->worker_count * SERVER_QUEUE_BATCHES;
+    server->queue = nv_alloc(server->capacity * sizeof(struct server_request));
+    server->queue_pixels = nv_alloc((size_t)server->capacity * server->input_size);
+    server->latencies = nv_alloc(SERVER_LATENCY_SAMPLES * sizeof(double));
+    assert(server->queue && server->queue_pixels && server->latencies);
+
+    server->workers = nv_alloc(params->worker_count * sizeof(struct server_worker));
+    assert(server->workers);
+
+    for (uint32_t i = 0; i < params->worker_count; i++) {
+        struct server_worker* worker = &server->workers[i];
+        worker->server = server;
+
+        worker->inference = model_alloc_inference(model, NULL, params->max_batch);
+        worker->pixels = nv_alloc((size_t)params->max_batch * server->input_size);
+        worker->requests = nv_alloc(params->max_batch * sizeof(struct server_request));
+        worker->response = nv_alloc(server->response_size);
+        assert(worker->inference && worker->pixels && worker->requests && worker->response);
+    }
+
+    pthread_mutex_init(&server->mutex, NULL);
+    init_monotonic_cond(&server->ready_cond);
+    pthread_cond_init(&server->space_cond, NULL);
+    pthread_cond_init(&server->idle_cond, NULL);
+
+    return server;
+}
+
+void server_free(server_t* server) {
+    if (!server) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < server->params.worker_count; i++) {
+        struct server_worker* worker = &server->workers[i];
+
+        model_free_inference(NULL, worker->inference);
+        nv_free(worker->pixels);
+        nv_free(worker->requests);
+        nv_free(worker->response);
+    }
+
+    pthread_cond_destroy(&server->idle_cond);
+    pthread_cond_destroy(&server->space_cond);
+    pthread_cond_destroy(&server->ready_cond);
+    pthread_mutex_destroy(&server->mutex);
+
+    nv_free(server->workers);
+    nv_free(server->latencies);
+    nv_free(server->queue_pixels);
+    nv_free(server->queue);
+    nv_free(server);
+}
+
+/* false at end of stream, including one that ends partway through */
+static bool read_full(int fd, void* buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = read(fd, buffer + total, size - total);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            if (total > 0) {
+                NV_LOG_WARN("serve: dropping a partial image of %zu bytes", total);
+            }
+
+            return false;
+        }
+
+        total += (size_t)bytes;
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, const void* buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = write(fd, buffer + total, size - total);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        total += (size_t)bytes;
+    }
+
+    return true;
+}
+
+static struct server_connection* alloc_connection(server_t* server, int in_fd, int out_fd,
+                                                  bool owns_fds) {
+    struct server_connection* connection = nv_alloc(sizeof(struct server_connection));
+    assert(connection);
+    memset(connection, 0, sizeof(struct server_connection));
+
+    connection->in_fd = in_fd;
+    connection->out_fd = out_fd;
+    connection->owns_fds = owns_fds;
+    connection->server = server;
+
+    /* the reader's */
+    connection->references = 1;
+    pthread_mutex_init(&connection->write_mutex, NULL);
+
+    pthread_mutex_lock(&server->mutex);
+    connection->next = server->connections;
+    server->connections = connection;
+    server->connection_count++;
+    pthread_mutex_unlock(&server->mutex);
+
+    return connection;
+}
+
+/* with the server's mutex held */
+static void release_connection(server_t* server, struct server_connection* connection) {
+    assert(connection->references > 0);
+    if (--connection->references > 0) {
+        return;
+    }
+
+    struct server_connection** link = &server->connections;
+    while (*link != connection) {
+        link = &(*link)->next;
+    }
+
+    *link = connection->next;
+    server->connection_count--;
+    pthread_cond_broadcast(&server->idle_cond);
+
+    if (connection->owns_fds) {
+        close(connection->in_fd);
+    }
+
+    pthread_mutex_destroy(&connection->write_mutex);
+    nv_free(connection);
+}
+
+/* queues images from the connection until it ends, waiting for room when the queue is full */
+static void* reader_main(void* arg) {
+    struct server_connection* connection = arg;
+    server_t* server = connection->server;
+
+    uint8_t image[server->input_size];
+    while (read_full(connection->in_fd, image, server->input_size)) {
+        double arrival = get_seconds();
+
+        pthread_mutex_lock(&server->mutex);
+        while (server->count == server->capacity && !server->stopping) {
+            pthread_cond_wait(&server->space_cond, &server->mutex);
+        }
+
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+
+        uint32_t slot = (server->head + server->count) % server->capacity;
+        memcpy(server->queue_pixels + (size_t)slot * server->input_size, image,
+               server->input_size);
+
+        struct server_request* request = &server->queue[slot];
+        request->connection = connection;
+        request->sequence = connection->sequence++;
+        request->arrival = arrival;
+
+        connection->references++;
+        server->count++;
+
+        pthread_cond_signal(&server->ready_cond);
+        pthread_mutex_unlock(&server->mutex);
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    release_connection(server, connection);
+    pthread_mutex_unlock(&server->mutex);
+
+    return NULL;
+}
+
+/* with the server's mutex held. waits for images and then, unless the queue fills first, for the
+ * oldest one's deadline. returns how many were taken into worker; 0 once stopped and drained */
+static uint32_t take_batch(server_t* server, struct server_worker* worker) {
+    uint32_t max_batch = server->params.max_batch;
+    double max_delay = server->params.max_delay * 1e-6;
+
+    while (true) {
+        while (server->count == 0 && !server->stopping) {
+            pthread_cond_wait(&server->ready_cond, &server->mutex);
+        }
+
+        if (server->count == 0) {
+            return 0;
+        }
+
+        /* a batch goes once it is full or the oldest image has no more time to wait */
+        double deadline = server->queue[server->head].arrival + max_delay - server->batch_estimate;
+        if (server->count >= max_batch || server->stopping || get_seconds() >= deadline) {
+            break;
+        }
+
+        /* another worker may take the images meanwhile; everything is looked at again */
+        wait_until(&server->ready_cond, &server->mutex, deadline);
+    }
+
+    uint32_t count = server->count < max_batch ? server->count : max_batch;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = (server->head + i) % server->capacity;
+
+        memcpy(worker->pixels + (size_t)i * server->input_size,
+               server->queue_pixels + (size_t)slot * server->input_size, server->input_size);
+        worker->requests[i] = server->queue[slot];
+    }
+
+    server->head = (server->head + count) % server->capacity;
+    server->count -= count;
+
+    pthread_cond_broadcast(&server->space_cond);
+
+    /* what is left may already be due */
+    if (server->count > 0) {
+        pthread_cond_signal(&server->ready_cond);
+    }
+
+    return count;
+}
+
+static void send_response(server_t* server, struct server_worker* worker,
+                          const struct server_request* request, const matrix_t* output,
+                          uint32_t column) {
+    struct server_response* response = worker->response;
+    float* values = worker->response + sizeof(struct server_response);
+
+    response->sequence = request->sequence;
+    response->label = 0;
+
+    for (uint32_t y = 0; y < server->output_size; y++) {
+        values[y] = mat_row(output, y)[column];
+        if (values[y] > values[response->label]) {
+            response->label = y;
+        }
+    }
+
+    struct server_connection* connection = request->connection;
+    pthread_mutex_lock(&connection->write_mutex);
+
+    if (!connection->failed &&
+        !write_full(connection->out_fd, worker->response, server->response_size)) {
+        NV_LOG_WARN("serve: failed to answer a client; dropping it");
+        connection->failed = true;
+
+        /* ends its reader too */
+        shutdown(connection->in_fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_unlock(&connection->write_mutex);
+}
+
+/* with the server's mutex held */
+static void record_batch(server_t* server, const struct server_worker* worker, uint32_t count,
+                         double started, double finished) {
+    server->batch_estimate += (finished - started - server->batch_estimate) / 8.0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        double latency = finished - worker->requests[i].arrival;
+        server->latencies[server->latency_count++ % SERVER_LATENCY_SAMPLES] = latency;
+
+        release_connection(server, worker->requests[i].connection);
+    }
+
+    server->served += count;
+    server->batches++;
+}
+
+static void* worker_main(void* arg) {
+    struct server_worker* worker = arg;
+    server_t* server = worker->server;
+
+    pthread_mutex_lock(&server->mutex);
+    while (true) {
+        uint32_t count = take_batch(server, worker);
+        if (count == 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&server->mutex);
+
+        double started = get_seconds();
+        const matrix_t* output = model_infer_pixels(server->model, worker->pixels,
+                                                    server->input_size, count, worker->inference);
+
+        for (uint32_t i = 0; i < count; i++) {
+            send_response(server, worker, &worker->requests[i], output, i);
+        }
+
+        double finished = get_seconds();
+
+        pthread_mutex_lock(&server->mutex);
+        record_batch(server, worker, count, started, finished);
+    }
+
+    pthread_mutex_unlock(&server->mutex);
+    return NULL;
+}
+
+/* false if not even one worker could be spawned */
+static bool start_workers(server_t* server) {
+    server->stopping = false;
+    server->served = 0;
+    server->batches = 0;
+    server->latency_count = 0;
+
+    server->running_workers = 0;
+    for (uint32_t i = 0; i < server->params.worker_count; i++) {
+        struct server_worker* worker = &server->workers[i];
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            NV_LOG_ERROR("failed to spawn serve worker %u; continuing with %u workers", i, i);
+            break;
+        }
+
+        server->running_workers++;
+    }
+
+    if (server->running_workers == 0) {
+        return false;
+    }
+
+    NV_LOG_INFO("serve: %u workers, batches of up to %u, %u us deadline",
+                server->running_workers, server->params.max_batch, server->params.max_delay);
+
+    return true;
+}
+
+static int compare_doubles(const void* lhs, const void* rhs) {
+    double a = *(const double*)lhs;
+    double b = *(const double*)rhs;
+
+    return (a > b) - (a < b);
+}
+
+static void log_stats(server_t* server) {
+    uint32_t samples = server->latency_count < SERVER_LATENCY_SAMPLES
+                           ? (uint32_t)server->latency_count
+                           : SERVER_LATENCY_SAMPLES;
+
+    double mean_batch = server->batches > 0 ? (double)server->served / server->batches : 0.0;
+    NV_LOG_INFO("serve: answered %lu images in %lu batches (%.1f per batch)",
+                (unsigned long)server->served, (unsigned long)server->batches, mean_batch);
+
+    if (samples == 0) {
+        return;
+    }
+
+    qsort(server->latencies, samples, sizeof(double), compare_doubles);
+
+    /* nearest-rank */
+    uint32_t p50 = (uint32_t)ceil(0.5 * samples) - 1;
+    uint32_t p99 = (uint32_t)ceil(0.99 * samples) - 1;
+
+    NV_LOG_INFO("serve: latency p50 %.3fms, p99 %.3fms, max %.3fms", server->latencies[p50] * 1e3,
+                server->latencies[p99] * 1e3, server->latencies[samples - 1] * 1e3);
+}
+
+/* once every connection is gone, lets the workers drain the queue and waits for them */
+static void stop_workers(server_t* server) {
+    pthread_mutex_lock(&server->mutex);
+    while (server->connection_count > 0) {
+        pthread_cond_wait(&server->idle_cond, &server->mutex);
+    }
+
+    server->stopping = true;
+    pthread_cond_broadcast(&server->ready_cond);
+    pthread_cond_broadcast(&server->space_cond);
+    pthread_mutex_unlock(&server->mutex);
+
+    for (uint32_t i = 0; i < server->running_workers; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+    }
+
+    server->running_workers = 0;
+    log_stats(server);
+}
+
+/* on failure the connection is released (closing its fd if it owns it) */
+static bool start_reader(struct server_connection* connection) {
+    server_t* server = connection->server;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reader_main, connection) != 0) {
+        NV_LOG_ERROR("failed to spawn serve reader; dropping the connection");
+
+        pthread_mutex_lock(&server->mutex);
+        release_connection(server, connection);
+        pthread_mutex_unlock(&server->mutex);
+
+        return false;
+    }
+
+    /* connections are waited for through the server's count instead */
+    pthread_detach(thread);
+    return true;
+}
+
+bool server_serve_stream(server_t* server, int in_fd, int out_fd) {
+    /* a closed pipe fails the write instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!start_workers(server)) {
+        return false;
+    }
+
+    struct server_connection* connection = alloc_connection(server, in_fd, out_fd, false);
+    bool started = start_reader(connection);
+
+    stop_workers(server);
+    return started;
+}
+
+static int open_socket(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        NV_LOG_ERROR("socket path too long: %s", path);
+        return -1;
+    }
+
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        NV_LOG_ERROR("failed to create socket!");
+        return -1;
+    }
+
+    /* a socket left behind by a server that did not exit cleanly */
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        NV_LOG_ERROR("failed to listen on %s: %s", path, strerror(errno));
+
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool server_listen(server_t* server, const char* path) {
+    int listen_fd = open_socket(path);
+    if (listen_fd < 0) {
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!start_workers(server)) {
+        close(listen_fd);
+        unlink(path);
+
+        return false;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+
+    s_interrupted = 0;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    NV_LOG_INFO("serve: listening on %s", path);
+
+    while (!s_interrupted) {
+        struct pollfd pending = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pending, 1, SERVER_POLL_INTERVAL) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct timeval timeout = { .tv_sec = SERVER_SEND_TIMEOUT, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        start_reader(alloc_connection(server, fd, fd, true));
+    }
+
+    NV_LOG_INFO("serve: stopping");
+    close(listen_fd);
+    unlink(path);
+
+    /* no new images; whatever is queued is still answered */
+    pthread_mutex_lock(&server->mutex);
+    for (struct server_connection* it = server->connections; it; it = it->next) {
+        shutdown(it->in_fd, SHUT_RD);
+    }
+
+    pthread_mutex_unlock(&server->mutex);
+
+    stop_workers(server);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _SERVE_H
+#define _SERVE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* from model.h */
+typedef struct model model_t;
+
+/* the protocol, over a unix stream socket or a pair of pipes. a client sends images as raw pixels,
+ * input_size bytes each with nothing in between, and may send any number before reading. each
+ * image is answered with a struct server_response followed by output_size floats (the model's
+ * output), all in host byte order. answers can come back out of order when several workers are
+ * running; sequence says which image an answer is for, counting from 0 on each connection */
+struct server_response {
+    uint32_t sequence;
+
+    /* the largest output */
+    uint32_t label;
+};
+
+struct server_params {
+    /* images per forward pass */
+    uint32_t max_batch;
+
+    /* how long the oldest queued image may take, in microseconds, waiting for its batch to fill
+     * included. a batch goes early once the time it is expected to take would run past that */
+    uint32_t max_delay;
+
+    /* batches in flight at once, each with its own inference buffers */
+    uint32_t worker_count;
+};
+
+typedef struct server server_t;
+
+/* everything per worker is allocated here, once. model must outlive the server */
+server_t* server_alloc(const model_t* model, const struct server_params* params);
+void server_free(server_t* server);
+
+/* accepts connections on a unix socket at path until SIGINT or SIGTERM, then answers what is
+ * queued and removes the socket. anything already at path is replaced */
+bool server_listen(server_t* server, const char* path);
+
+/* serves a single client reading from in_fd and writing to out_fd, until in_fd ends and every
+ * image it sent has been answered */
+bool server_serve_stream(server_t* server, int in_fd, int out_fd);
+
+#endif
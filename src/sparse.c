@@ -0,0 +1,516 @@
+#include "sparse.h"
+
+#include "matrix.h"
+#include "cpu.h"
+#include "vec.h"
+
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86
+#endif
+
+#include <nyoravim/log.h>
+
+/* output columns (samples) accumulated at once; the partial sums stay in registers while a row's
+ * nonzeros stream past */
+#define SPARSE_CHUNK 32
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+size_t sparse_get_data_size(uint32_t rows, uint32_t nonzeros) {
+    size_t offsets_size = align_up(((size_t)rows + 1) * sizeof(uint32_t), MAT_ALIGNMENT);
+    size_t indices_size = align_up((size_t)nonzeros * sizeof(uint16_t), MAT_ALIGNMENT);
+    size_t values_size = align_up((size_t)nonzeros * sizeof(float), MAT_ALIGNMENT);
+
+    return offsets_size + indices_size + values_size;
+}
+
+void sparse_init_view(sparse_matrix_t* sparse, void* data, uint32_t rows, uint32_t columns,
+                      uint32_t nonzeros) {
+    assert(((uintptr_t)data & (MAT_ALIGNMENT - 1)) == 0);
+    assert(columns <= SPARSE_MAX_COLUMNS);
+
+    size_t offsets_size = align_up(((size_t)rows + 1) * sizeof(uint32_t), MAT_ALIGNMENT);
+    size_t indices_size = align_up((size_t)nonzeros * sizeof(uint16_t), MAT_ALIGNMENT);
+
+    sparse->rows = rows;
+    sparse->columns = columns;
+    sparse->nonzeros = nonzeros;
+
+    sparse->row_offsets = data;
+    sparse->column_indices = data + offsets_size;
+    sparse->values = data + offsets_size + indices_size;
+}
+
+uint32_t sparse_count_nonzeros(const matrix_t* dense) {
+    assert(dense->type == MAT_TYPE_F32);
+
+    uint32_t count = 0;
+    for (uint32_t y = 0; y < dense->rows; y++) {
+        const float* row = mat_row(dense, y);
+        for (uint32_t x = 0; x < dense->columns; x++) {
+            count += row[x] != 0.f ? 1 : 0;
+        }
+    }
+
+    return count;
+}
+
+void sparse_from_dense(sparse_matrix_t* dst, const matrix_t* src) {
+    assert(src->type == MAT_TYPE_F32);
+    assert(dst->rows == src->rows && dst->columns == src->columns);
+
+    uint32_t count = 0;
+    for (uint32_t y = 0; y < src->rows; y++) {
+        dst->row_offsets[y] = count;
+
+        const float* row = mat_row(src, y);
+        for (uint32_t x = 0; x < src->columns; x++) {
+            if (row[x] == 0.f) {
+                continue;
+            }
+
+            assert(count < dst->nonzeros);
+            dst->column_indices[count] = (uint16_t)x;
+            dst->values[count] = row[x];
+
+            count++;
+        }
+    }
+
+    assert(count == dst->nonzeros);
+    dst->row_offsets[src->rows] = count;
+}
+
+void sparse_copy(sparse_matrix_t* dst, const sparse_matrix_t* src) {
+    assert(dst->rows == src->rows && dst->columns == src->columns);
+    assert(dst->nonzeros == src->nonzeros);
+
+    memcpy(dst->row_offsets, src->row_offsets, ((size_t)src->rows + 1) * sizeof(uint32_t));
+    memcpy(dst->column_indices, src->column_indices, (size_t)src->nonzeros * sizeof(uint16_t));
+    memcpy(dst->values, src->values, (size_t)src->nonzeros * sizeof(float));
+}
+
+bool sparse_is_valid(const sparse_matrix_t* sparse) {
+    if (sparse->row_offsets[0] != 0 || sparse->row_offsets[sparse->rows] != sparse->nonzeros) {
+        return false;
+    }
+
+    for (uint32_t y = 0; y < sparse->rows; y++) {
+        if (sparse->row_offsets[y] > sparse->row_offsets[y + 1]) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < sparse->nonzeros; i++) {
+        if (sparse->column_indices[i] >= sparse->columns) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* out[0, count) = the product of row y of weights with columns [x0, x0 + count) of input */
+typedef void (*sparse_row_kernel_t)(const sparse_matrix_t* weights, uint32_t y,
+                                    const matrix_t* input, uint32_t x0, uint32_t count,
+                                    float* out);
+
+static void row_generic(const sparse_matrix_t* weights, uint32_t y, const matrix_t* input,
+                        uint32_t x0, uint32_t count, float* out) {
+    float acc[SPARSE_CHUNK];
+    memset(acc, 0, count * sizeof(float));
+
+    for (uint32_t i = weights->row_offsets[y]; i < weights->row_offsets[y + 1]; i++) {
+        const float* in = mat_row(input, weights->column_indices[i]) + x0;
+        float value = weights->values[i];
+
+        for (uint32_t x = 0; x < count; x++) {
+            acc[x] += value * in[x];
+        }
+    }
+
+    memcpy(out, acc, count * sizeof(float));
+}
+
+#ifdef SPARSE_X86
+__attribute__((target("avx2,fma"))) static void row_avx2(const sparse_matrix_t* weights,
+                                                          uint32_t y, const matrix_t* input,
+                                                          uint32_t x0, uint32_t count,
+                                                          float* out) {
+    uint32_t begin = weights->row_offsets[y];
+    uint32_t end = weights->row_offsets[y + 1];
+
+    /* full chunks, then vectors, then what is left */
+    uint32_t x = 0;
+    for (; x + SPARSE_CHUNK <= count; x += SPARSE_CHUNK) {
+        __m256 acc[4];
+        for (uint32_t j = 0; j < 4; j++) {
+            acc[j] = _mm256_setzero_ps();
+        }
+
+        for (uint32_t i = begin; i < end; i++) {
+            const float* in = mat_row(input, weights->column_indices[i]) + x0 + x;
+            __m256 value = _mm256_set1_ps(weights->values[i]);
+
+            for (uint32_t j = 0; j < 4; j++) {
+                acc[j] = _mm256_fmadd_ps(value, _mm256_loadu_ps(in + j * 8), acc[j]);
+            }
+        }
+
+        for (uint32_t j = 0; j < 4; j++) {
+            _mm256_storeu_ps(out + x + j * 8, acc[j]);
+        }
+    }
+
+    for (; x + 8 <= count; x += 8) {
+        __m256 acc = _mm256_setzero_ps();
+
+        for (uint32_t i = begin; i < end; i++) {
+            const float* in = mat_row(input, weights->column_indices[i]) + x0 + x;
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(weights->values[i]), _mm256_loadu_ps(in), acc);
+        }
+
+        _mm256_storeu_ps(out + x, acc);
+    }
+
+    for (; x < count; x++) {
+        float acc = 0.f;
+
+        for (uint32_t i = begin; i < end; i++) {
+            acc += weights->values[i] * mat_row(input, weights->column_indices[i])[x0 + x];
+        }
+
+        out[x] = acc;
+    }
+}
+#endif
+
+/* out[0, columns->columns) = the sum over i < nonzeros of values[i] times row indices[i] of
+ * columns */
+typedef void (*sparse_column_kernel_t)(const matrix_t* columns, const uint16_t* indices,
+                                       const float* values, uint32_t nonzeros, float* out);
+
+static void column_generic(const matrix_t* columns, const uint16_t* indices, const float* values,
+                           uint32_t nonzeros, float* out) {
+    memset(out, 0, columns->columns * sizeof(float));
+
+    for (uint32_t i = 0; i < nonzeros; i++) {
+        const float* row = mat_row(columns, indices[i]);
+        float value = values[i];
+
+        for (uint32_t x = 0; x < columns->columns; x++) {
+            out[x] += value * row[x];
+        }
+    }
+}
+
+#ifdef SPARSE_X86
+__attribute__((target("avx2,fma"))) static void column_avx2(const matrix_t* columns,
+                                                             const uint16_t* indices,
+                                                             const float* values,
+                                                             uint32_t nonzeros, float* out) {
+    uint32_t count = columns->columns;
+
+    /* as row_avx2, with outputs in place of samples, but eight accumulators: with nothing else
+     * live, that many fma chains fit in registers and hide the latency of each */
+    uint32_t x = 0;
+    for (; x + 64 <= count; x += 64) {
+        __m256 acc[8];
+        for (uint32_t j = 0; j < 8; j++) {
+            acc[j] = _mm256_setzero_ps();
+        }
+
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            const float* row = mat_row(columns, indices[i]) + x;
+            __m256 value = _mm256_set1_ps(values[i]);
+
+            for (uint32_t j = 0; j < 8; j++) {
+                acc[j] = _mm256_fmadd_ps(value, _mm256_loadu_ps(row + j * 8), acc[j]);
+            }
+        }
+
+        for (uint32_t j = 0; j < 8; j++) {
+            _mm256_storeu_ps(out + x + j * 8, acc[j]);
+        }
+    }
+
+    for (; x + 8 <= count; x += 8) {
+        __m256 acc = _mm256_setzero_ps();
+
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            const float* row = mat_row(columns, indices[i]) + x;
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(values[i]), _mm256_loadu_ps(row), acc);
+        }
+
+        _mm256_storeu_ps(out + x, acc);
+    }
+
+    for (; x < count; x++) {
+        float acc = 0.f;
+
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            acc += values[i] * mat_row(columns, indices[i])[x];
+        }
+
+        out[x] = acc;
+    }
+}
+
+__attribute__((target("avx512f"))) static void column_avx512(const matrix_t* columns,
+                                                              const uint16_t* indices,
+                                                              const float* values,
+                                                              uint32_t nonzeros, float* out) {
+    uint32_t count = columns->columns;
+
+    uint32_t x = 0;
+    for (; x + 128 <= count; x += 128) {
+        __m512 acc[8];
+        for (uint32_t j = 0; j < 8; j++) {
+            acc[j] = _mm512_setzero_ps();
+        }
+
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            const float* row = mat_row(columns, indices[i]) + x;
+            __m512 value = _mm512_set1_ps(values[i]);
+
+            for (uint32_t j = 0; j < 8; j++) {
+                acc[j] = _mm512_fmadd_ps(value, _mm512_loadu_ps(row + j * 16), acc[j]);
+            }
+        }
+
+        for (uint32_t j = 0; j < 8; j++) {
+            _mm512_storeu_ps(out + x + j * 16, acc[j]);
+        }
+    }
+
+    for (; x < count; x += 16) {
+        uint32_t remaining = count - x;
+        __mmask16 mask = remaining < 16 ? (__mmask16)((1u << remaining) - 1) : 0xffff;
+
+        __m512 acc = _mm512_setzero_ps();
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            const float* row = mat_row(columns, indices[i]) + x;
+            __m512 in = _mm512_maskz_loadu_ps(mask, row);
+
+            acc = _mm512_fmadd_ps(_mm512_set1_ps(values[i]), in, acc);
+        }
+
+        _mm512_mask_storeu_ps(out + x, mask, acc);
+    }
+}
+#endif
+
+/* the positions of the nonzero bytes among size, in order. returns how many there are */
+typedef uint32_t (*sparse_gather_kernel_t)(const uint8_t* pixels, uint32_t size,
+                                           uint16_t* indices);
+
+static uint32_t gather_generic(const uint8_t* pixels, uint32_t size, uint16_t* indices) {
+    /* written unconditionally and kept only if nonzero: which pixels are set is unpredictable, so
+     * a branch on it mispredicts constantly */
+    uint32_t nonzeros = 0;
+    for (uint32_t j = 0; j < size; j++) {
+        indices[nonzeros] = (uint16_t)j;
+        nonzeros += pixels[j] != 0 ? 1 : 0;
+    }
+
+    return nonzeros;
+}
+
+#ifdef SPARSE_X86
+/* 32 pixels per compare; only the set bits of its mask are visited */
+__attribute__((target("avx2"))) static uint32_t gather_avx2(const uint8_t* pixels, uint32_t size,
+                                                            uint16_t* indices) {
+    __m256i zero = _mm256_setzero_si256();
+
+    uint32_t nonzeros = 0;
+    uint32_t j = 0;
+    for (; j + 32 <= size; j += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(pixels + j));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+
+        while (mask) {
+            indices[nonzeros++] = (uint16_t)(j + (uint32_t)__builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    uint32_t tail = gather_generic(pixels + j, size - j, indices + nonzeros);
+    for (uint32_t i = nonzeros; i < nonzeros + tail; i++) {
+        indices[i] += (uint16_t)j;
+    }
+
+    return nonzeros + tail;
+}
+#endif
+
+static pthread_once_t s_kernel_once = PTHREAD_ONCE_INIT;
+static sparse_row_kernel_t s_row_kernel;
+static sparse_column_kernel_t s_column_kernel;
+static sparse_gather_kernel_t s_gather_kernel;
+
+static void select_kernel() {
+    s_row_kernel = row_generic;
+    s_column_kernel = column_generic;
+    s_gather_kernel = gather_generic;
+    const char* name = "generic";
+
+#ifdef SPARSE_X86
+    if (cpu_has_features(CPU_FEATURE_AVX2 | CPU_FEATURE_FMA)) {
+        s_row_kernel = row_avx2;
+        s_column_kernel = column_avx2;
+        s_gather_kernel = gather_avx2;
+        name = "avx2";
+    }
+
+    /* only the column kernel has a wider version; rows are as wide as the batch, often too narrow
+     * for a full chunk of zmm */
+    if (cpu_has_features(CPU_FEATURE_AVX512F)) {
+        s_column_kernel = column_avx512;
+        name = "avx-512";
+    }
+#endif
+
+    NV_LOG_DEBUG("sparse: using %s kernels", name);
+}
+
+static sparse_row_kernel_t get_row_kernel() {
+    pthread_once(&s_kernel_once, select_kernel);
+    return s_row_kernel;
+}
+
+static sparse_column_kernel_t get_column_kernel() {
+    pthread_once(&s_kernel_once, select_kernel);
+    return s_column_kernel;
+}
+
+static sparse_gather_kernel_t get_gather_kernel() {
+    pthread_once(&s_kernel_once, select_kernel);
+    return s_gather_kernel;
+}
+
+static void activate(const struct vec_kernels* vec, float* values, uint32_t count,
+                     uint32_t activation) {
+    switch (activation) {
+    case MAT_ACTIVATION_RELU:
+        vec->relu(values, values, count);
+        break;
+    case MAT_ACTIVATION_SIGMOID:
+        vec->sigmoid(values, values, count);
+        break;
+    default:
+        break;
+    }
+}
+
+void sparse_mul_bias_activate(matrix_t* output, matrix_t* z, const sparse_matrix_t* weights,
+                              const matrix_t* input, const matrix_t* biases, uint32_t activation) {
+    assert(weights->columns == input->rows);
+    assert(output->rows == weights->rows);
+    assert(output->columns == input->columns);
+
+    assert(output->type == MAT_TYPE_F32 && input->type == MAT_TYPE_F32);
+    assert(biases->rows == output->rows && biases->type == MAT_TYPE_F32);
+
+    if (z) {
+        assert(z->rows == output->rows);
+        assert(z->columns == output->columns);
+        assert(z->type == MAT_TYPE_F32);
+    }
+
+    sparse_row_kernel_t kernel = get_row_kernel();
+    const struct vec_kernels* vec = vec_get_kernels();
+
+    for (uint32_t y = 0; y < output->rows; y++) {
+        float bias = mat_row(biases, y)[0];
+
+        for (uint32_t x0 = 0; x0 < output->columns; x0 += SPARSE_CHUNK) {
+            uint32_t remaining = output->columns - x0;
+            uint32_t count = remaining < SPARSE_CHUNK ? remaining : SPARSE_CHUNK;
+
+            /* finished while the chunk is still in l1, as the dense epilogue does */
+            float* out = mat_row(output, y) + x0;
+            kernel(weights, y, input, x0, count, out);
+
+            for (uint32_t x = 0; x < count; x++) {
+                out[x] += bias;
+            }
+
+            if (z) {
+                memcpy(mat_row(z, y) + x0, out, count * sizeof(float));
+            }
+
+            activate(vec, out, count, activation);
+        }
+    }
+
+    /* normalizes across rows, so only once every row is done */
+    if (activation == MAT_ACTIVATION_SOFTMAX) {
+        mat_softmax(output, output);
+    }
+}
+
+uint32_t sparse_count_pixels(const uint8_t* pixels, uint32_t size, size_t stride, uint32_t count) {
+    uint32_t nonzeros = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* image = pixels + i * stride;
+
+        for (uint32_t j = 0; j < size; j++) {
+            nonzeros += image[j] != 0 ? 1 : 0;
+        }
+    }
+
+    return nonzeros;
+}
+
+void sparse_input_mul_bias_activate(matrix_t* output, const matrix_t* columns,
+                                    const uint8_t* pixels, size_t stride, const matrix_t* biases,
+                                    uint32_t activation) {
+    assert(output->rows == columns->columns);
+    assert(columns->rows <= SPARSE_MAX_COLUMNS && stride >= columns->rows);
+
+    assert(output->type == MAT_TYPE_F32 && columns->type == MAT_TYPE_F32);
+    assert(!biases || (biases->rows == output->rows && biases->type == MAT_TYPE_F32));
+
+    sparse_gather_kernel_t gather = get_gather_kernel();
+    sparse_column_kernel_t kernel = get_column_kernel();
+    const struct vec_kernels* vec = vec_get_kernels();
+
+    uint32_t size = columns->rows;
+    uint16_t indices[size];
+    float values[size];
+
+    /* one sample at a time, its outputs contiguous until they are scattered into its column */
+    float out[output->rows];
+
+    for (uint32_t x = 0; x < output->columns; x++) {
+        const uint8_t* image = pixels + x * stride;
+
+        uint32_t nonzeros = gather(image, size, indices);
+        for (uint32_t i = 0; i < nonzeros; i++) {
+            values[i] = (float)image[indices[i]] / 255;
+        }
+
+        kernel(columns, indices, values, nonzeros, out);
+
+        for (uint32_t y = 0; biases && y < output->rows; y++) {
+            out[y] += mat_row(biases, y)[0];
+        }
+
+        activate(vec, out, output->rows, activation);
+
+        for (uint32_t y = 0; y < output->rows; y++) {
+            mat_row(output, y)[x] = out[y];
+        }
+    }
+
+    if (activation == MAT_ACTIVATION_SOFTMAX) {
+        mat_softmax(output, output);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef _SPARSE_H
+#define _SPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* compressed sparse row (csr) storage for pruned weights: each row's nonzero values, in column
+ * order, with the column each sits in. indices are 16 bits, so a nonzero costs 6 bytes against a
+ * dense element's 4; storage is smaller past a third zeros */
+
+/* the widest matrix a 16-bit column index can address */
+#define SPARSE_MAX_COLUMNS 65536
+
+typedef struct sparse_matrix {
+    uint32_t rows, columns;
+    uint32_t nonzeros;
+
+    /* rows + 1 entries. row y's nonzeros are [row_offsets[y], row_offsets[y + 1]) */
+    uint32_t* row_offsets;
+    uint16_t* column_indices;
+    float* values;
+} sparse_matrix_t;
+
+/* from matrix.h */
+typedef struct matrix matrix_t;
+
+/* bytes of storage a sparse matrix covers: the offsets, indices and values, each starting on a
+ * MAT_ALIGNMENT boundary. a multiple of MAT_ALIGNMENT, so views pack back to back in one block */
+size_t sparse_get_data_size(uint32_t rows, uint32_t nonzeros);
+
+/* points sparse at data, which must be MAT_ALIGNMENT aligned and sparse_get_data_size bytes. as
+ * with mat_init_view, data is not touched and stays owned by the caller */
+void sparse_init_view(sparse_matrix_t* sparse, void* data, uint32_t rows, uint32_t columns,
+                      uint32_t nonzeros);
+
+/* exact zeros are left out; an fp32 dense matrix of any stride */
+uint32_t sparse_count_nonzeros(const matrix_t* dense);
+
+/* fills dst, viewing sparse_count_nonzeros(src) nonzeros of the same shape, from src */
+void sparse_from_dense(sparse_matrix_t* dst, const matrix_t* src);
+
+/* copies values between two sparse matrices of the same shape and nonzero count */
+void sparse_copy(sparse_matrix_t* dst, const sparse_matrix_t* src);
+
+/* true if the offsets are monotonic and within nonzeros and every column index is in range, i.e.
+ * the matrix can be walked without reading out of bounds. for data from a file */
+bool sparse_is_valid(const sparse_matrix_t* sparse);
+
+/* as mat_mul_bias_activate (activation is MAT_ACTIVATION_*), with sparse weights: each output row
+ * only reads the input rows its nonzeros select */
+void sparse_mul_bias_activate(matrix_t* output, matrix_t* z, const sparse_matrix_t* weights,
+                              const matrix_t* input, const matrix_t* biases, uint32_t activation);
+
+/* nonzero bytes among count images of size pixels, one every stride bytes */
+uint32_t sparse_count_pixels(const uint8_t* pixels, uint32_t size, size_t stride, uint32_t count);
+
+/* the other way around: dense weights and sparse input. output (weights' rows x output->columns)
+ * = A(weights * input + biases), where input is raw pixels, one image every stride bytes, scaled to
+ * [0, 1] as dataset_get_batch does. columns is the weights transposed (input size x weights' rows,
+ * fp32), so that each nonzero pixel of a sample adds one contiguous row of it and zero pixels cost
+ * nothing. biases may be NULL */
+void sparse_input_mul_bias_activate(matrix_t* output, const matrix_t* columns,
+                                    const uint8_t* pixels, size_t stride, const matrix_t* biases,
+                                    uint32_t activation);
+
+#endif
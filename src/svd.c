@@ -0,0 +1,224 @@
+#include "svd.h"
+
+#include "matrix.h"
+
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* cyclic jacobi converges quadratically; a few sweeps do for anything well conditioned */
+#define SVD_MAX_SWEEPS 64
+
+/* below this, relative to the diagonal, an off-diagonal element counts as zero */
+#define SVD_EPSILON 1e-15
+
+/* mat as packed doubles, rows x columns */
+static double* widen_matrix(const matrix_t* mat) {
+    double* data = nv_alloc((size_t)mat->rows * mat->columns * sizeof(double));
+    assert(data);
+
+    /* half precision rows are converted one at a time */
+    matrix_t* row = mat_alloc(NULL, 1, mat->columns);
+    assert(row);
+
+    for (uint32_t y = 0; y < mat->rows; y++) {
+        matrix_t source = *mat;
+        source.rows = 1;
+        source.data = mat_row_data(mat, y);
+
+        mat_copy(row, &source);
+
+        for (uint32_t x = 0; x < mat->columns; x++) {
+            data[(size_t)y * mat->columns + x] = row->data[x];
+        }
+    }
+
+    mat_free(NULL, row);
+    return data;
+}
+
+/* rotates a (n x n, symmetric) in place until it is diagonal: a = v * diag(a) * v^T, with v's
+ * columns the eigenvectors */
+static void diagonalize(double* a, double* v, uint32_t n) {
+    memset(v, 0, (size_t)n * n * sizeof(double));
+    for (uint32_t i = 0; i < n; i++) {
+        v[(size_t)i * n + i] = 1.0;
+    }
+
+    uint32_t sweep = 0;
+    for (; sweep < SVD_MAX_SWEEPS; sweep++) {
+        uint32_t rotations = 0;
+
+        for (uint32_t p = 0; p < n; p++) {
+            for (uint32_t q = p + 1; q < n; q++) {
+                double apq = a[(size_t)p * n + q];
+                double app = a[(size_t)p * n + p];
+                double aqq = a[(size_t)q * n + q];
+
+                if (fabs(apq) <= SVD_EPSILON * sqrt(fabs(app * aqq)) || apq == 0.0) {
+                    continue;
+                }
+
+                /* the smaller root of t^2 + 2 theta t - 1 = 0 zeroes a_pq with the least turn */
+                double theta = (aqq - app) / (2.0 * apq);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+
+                /* a = j^T a j, columns then rows; v = v j */
+                for (uint32_t k = 0; k < n; k++) {
+                    double akp = a[(size_t)k * n + p];
+                    double akq = a[(size_t)k * n + q];
+
+                    a[(size_t)k * n + p] = c * akp - s * akq;
+                    a[(size_t)k * n + q] = s * akp + c * akq;
+                }
+
+                for (uint32_t k = 0; k < n; k++) {
+                    double apk = a[(size_t)p * n + k];
+                    double aqk = a[(size_t)q * n + k];
+
+                    a[(size_t)p * n + k] = c * apk - s * aqk;
+                    a[(size_t)q * n + k] = s * apk + c * aqk;
+                }
+
+                for (uint32_t k = 0; k < n; k++) {
+                    double vkp = v[(size_t)k * n + p];
+                    double vkq = v[(size_t)k * n + q];
+
+                    v[(size_t)k * n + p] = c * vkp - s * vkq;
+                    v[(size_t)k * n + q] = s * vkp + c * vkq;
+                }
+
+                rotations++;
+            }
+        }
+
+        if (rotations == 0) {
+            break;
+        }
+    }
+
+    if (sweep == SVD_MAX_SWEEPS) {
+        NV_LOG_WARN("svd: no convergence after %u sweeps", sweep);
+    } else {
+        NV_LOG_TRACE("svd: %ux%u converged in %u sweeps", n, n, sweep);
+    }
+}
+
+void svd_decompose(const matrix_t* mat, matrix_t* u, float* values, matrix_t* vt) {
+    uint32_t rows = mat->rows;
+    uint32_t columns = mat->columns;
+
+    /* the gram matrix is taken on the short side */
+    bool wide = rows <= columns;
+    uint32_t k = wide ? rows : columns;
+
+    assert(!u == !vt);
+    assert(!u || (u->rows == rows && u->columns == k && u->type == MAT_TYPE_F32));
+    assert(!vt || (vt->rows == k && vt->columns == columns && vt->type == MAT_TYPE_F32));
+
+    double* w = widen_matrix(mat);
+    double* gram = nv_alloc((size_t)k * k * sizeof(double));
+    double* vectors = nv_alloc((size_t)k * k * sizeof(double));
+    double* eigenvalues = nv_alloc(k * sizeof(double));
+    uint32_t* order = nv_alloc(k * sizeof(uint32_t));
+    assert(gram && vectors && eigenvalues && order);
+
+    /* w w^T or w^T w */
+    uint32_t inner = wide ? columns : rows;
+    for (uint32_t i = 0; i < k; i++) {
+        for (uint32_t j = 0; j <= i; j++) {
+            double sum = 0.0;
+            for (uint32_t l = 0; l < inner; l++) {
+                double a = wide ? w[(size_t)i * columns + l] : w[(size_t)l * columns + i];
+                double b = wide ? w[(size_t)j * columns + l] : w[(size_t)l * columns + j];
+
+                sum += a * b;
+            }
+
+            gram[(size_t)i * k + j] = sum;
+            gram[(size_t)j * k + i] = sum;
+        }
+    }
+
+    diagonalize(gram, vectors, k);
+
+    for (uint32_t i = 0; i < k; i++) {
+        eigenvalues[i] = gram[(size_t)i * k + i];
+        order[i] = i;
+    }
+
+    /* descending; k is small, so a selection sort */
+    for (uint32_t i = 0; i < k; i++) {
+        uint32_t best = i;
+        for (uint32_t j = i + 1; j < k; j++) {
+            if (eigenvalues[order[j]] > eigenvalues[order[best]]) {
+                best = j;
+            }
+        }
+
+        uint32_t swap = order[i];
+        order[i] = order[best];
+        order[best] = swap;
+    }
+
+    double largest = 0.0;
+    for (uint32_t j = 0; j < k; j++) {
+        /* rounding can leave a zero eigenvalue slightly negative */
+        double lambda = eigenvalues[order[j]];
+        double sigma = sqrt(lambda > 0.0 ? lambda : 0.0);
+
+        largest = j == 0 ? sigma : largest;
+        values[j] = (float)sigma;
+
+        if (!u) {
+            continue;
+        }
+
+        /* the other side's vector is w's image of this one over sigma; nothing meaningful is left
+         * of it when sigma is lost in rounding */
+        bool degenerate = sigma <= largest * 1e-12;
+
+        for (uint32_t y = 0; y < rows; y++) {
+            double value;
+            if (wide) {
+                value = vectors[(size_t)y * k + order[j]];
+            } else {
+                double sum = 0.0;
+                for (uint32_t x = 0; x < columns; x++) {
+                    sum += w[(size_t)y * columns + x] * vectors[(size_t)x * k + order[j]];
+                }
+
+                value = degenerate ? 0.0 : sum / sigma;
+            }
+
+            mat_row(u, y)[j] = (float)value;
+        }
+
+        for (uint32_t x = 0; x < columns; x++) {
+            double value;
+            if (wide) {
+                double sum = 0.0;
+                for (uint32_t y = 0; y < rows; y++) {
+                    sum += vectors[(size_t)y * k + order[j]] * w[(size_t)y * columns + x];
+                }
+
+                value = degenerate ? 0.0 : sum / sigma;
+            } else {
+                value = vectors[(size_t)x * k + order[j]];
+            }
+
+            mat_row(vt, j)[x] = (float)value;
+        }
+    }
+
+    nv_free(order);
+    nv_free(eigenvalues);
+    nv_free(vectors);
+    nv_free(gram);
+    nv_free(w);
+}
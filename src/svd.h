@@ -0,0 +1,17 @@
+#ifndef _SVD_H
+#define _SVD_H
+
+#include <stdint.h>
+
+/* from matrix.h */
+typedef struct matrix matrix_t;
+
+/* the singular value decomposition mat = u * diag(values) * vt of a matrix of any type, through
+ * the eigendecomposition (cyclic jacobi, in double precision) of the smaller of its two gram
+ * matrices. with k = min(rows, columns): u is rows x k, vt is k x columns, both fp32, and values
+ * has k entries in descending order. squaring the matrix costs the smallest values their relative
+ * accuracy, which is fine for truncating them away. u and vt may be NULL when only the values are
+ * wanted */
+void svd_decompose(const matrix_t* mat, matrix_t* u, float* values, matrix_t* vt);
+
+#endif
@@ -0,0 +1,316 @@
+#include "train.h"
+
+#include "matrix.h"
+#include "model.h"
+#include "pool.h"
+#include "arena.h"
+#include "optim.h"
+
+#include "data/dataset.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <nyoravim/mem.h>
+#include <nyoravim/log.h>
+
+/* everything one shard of a batch needs, allocated once */
+struct trainer_shard {
+    /* range of the batch this shard covers */
+    uint32_t offset, size;
+
+    matrix_t* images;
+    uint8_t* labels;
+
+    struct forwardprop_layer_output* fp;
+    struct model_deltas* deltas;
+
+    /* summed over the shard (over all of its steps when asynchronous) */
+    float loss;
+    bool loaded;
+};
+
+typedef struct trainer {
+    model_t* model;
+    optimizer_t* optimizer;
+    thread_pool_t* pool;
+
+    uint32_t batch_size;
+    uint32_t task_count;
+
+    uint32_t shard_count;
+    struct trainer_shard* shards;
+
+    /* backs every shard's images, labels and forward outputs */
+    arena_t* arena;
+
+    /* the step in flight */
+    const dataset_t* data;
+    const uint32_t* indices;
+    float scale;
+
+    /* samples in flight when asynchronous */
+    uint32_t count;
+} trainer_t;
+
+static size_t get_shard_size(const model_t* model, uint32_t size, uint32_t image_size) {
+    size_t total = model_get_forwardprop_size(model, size, FORWARDPROP_KEEP_Z);
+    total += arena_get_footprint(mat_get_alloc_size(image_size, size, 0));
+    total += arena_get_footprint(size);
+
+    return total;
+}
+
+static void alloc_shard(trainer_t* trainer, struct trainer_shard* shard, uint32_t image_size) {
+    struct nv_allocator alloc;
+    arena_get_allocator(trainer->arena, &alloc);
+
+    shard->images = mat_alloc(&alloc, image_size, shard->size);
+    shard->labels = alloc.alloc(alloc.user, shard->size);
+    assert(shard->images && shard->labels);
+
+    shard->fp = model_alloc_forwardprop(trainer->model, &alloc, shard->size, FORWARDPROP_KEEP_Z);
+    shard->deltas = model_alloc_deltas(trainer->model, shard->size);
+}
+
+trainer_t* trainer_alloc(model_t* model, optimizer_t* optimizer, thread_pool_t* pool,
+                         uint32_t batch_size, uint32_t image_size) {
+    assert(batch_size > 0);
+    assert(model->layers[model->num_layers - 1].op == LAYER_OP_SOFTMAX);
+
+    trainer_t* trainer = nv_alloc(sizeof(trainer_t));
+    assert(trainer);
+    memset(trainer, 0, sizeof(trainer_t));
+
+    trainer->model = model;
+    trainer->optimizer = optimizer;
+    trainer->pool = pool;
+    trainer->batch_size = batch_size;
+    trainer->task_count = pool ? pool_get_thread_count(pool) : 1;
+
+    /* one shard per thread, as even as possible */
+    trainer->shard_count = trainer->task_count < batch_size ? trainer->task_count : batch_size;
+    trainer->shards = nv_alloc(trainer->shard_count * sizeof(struct trainer_shard));
+    assert(trainer->shards);
+
+    size_t arena_size = 0;
+    for (uint32_t i = 0; i < trainer->shard_count; i++) {
+        struct trainer_shard* shard = &trainer->shards[i];
+        memset(shard, 0, sizeof(struct trainer_shard));
+
+        uint32_t base = batch_size / trainer->shard_count;
+        uint32_t extra = batch_size % trainer->shard_count;
+
+        shard->size = base + (i < extra ? 1 : 0);
+        shard->offset = i * base + (i < extra ? i : extra);
+
+        arena_size += get_shard_size(model, shard->size, image_size);
+    }
+
+    trainer->arena = arena_alloc(arena_size);
+    assert(trainer->arena);
+
+    for (uint32_t i = 0; i < trainer->shard_count; i++) {
+        alloc_shard(trainer, &trainer->shards[i], image_size);
+    }
+
+    /* the update is applied in place, as one sweep over the parameter block */
+    for (uint32_t i = 0; i < model->num_layers; i++) {
+        assert(model->layers[i].weights->type == MAT_TYPE_F32 && !model->layers[i].sparse &&
+               !model->layers[i].factors);
+    }
+
+    NV_LOG_DEBUG("trainer: batches of %u over %u shards", batch_size, trainer->shard_count);
+    return trainer;
+}
+
+void trainer_free(trainer_t* trainer) {
+    if (!trainer) {
+        return;
+    }
+
+    struct nv_allocator alloc;
+    arena_get_allocator(trainer->arena, &alloc);
+
+    /* the forward pass's matrices are in the arena, but not its generated code */
+    for (uint32_t i = 0; i < trainer->shard_count; i++) {
+        model_free_forwardprop(trainer->model, &alloc, trainer->shards[i].fp);
+        model_free_deltas(trainer->shards[i].deltas);
+    }
+
+    /* the rest of each shard lives in the arena */
+    arena_free(trainer->arena);
+
+    nv_free(trainer->shards);
+    nv_free(trainer);
+}
+
+/* forward and backward over shard->size samples at indices. returns the summed loss */
+static float compute_gradients(trainer_t* trainer, struct trainer_shard* shard,
+                               const uint32_t* indices) {
+    const model_t* model = trainer->model;
+
+    shard->loaded = dataset_get_batch(trainer->data, indices, shard->size, shard->images,
+                                      shard->labels);
+
+    if (!shard->loaded) {
+        return 0.f;
+    }
+
+    /* products issued from here run on this thread; the pool is busy with the other shards */
+    model_forwardprop(model, shard->images, shard->fp);
+
+    const matrix_t* logits = shard->fp[model->num_layers - 1].z;
+    matrix_t* error = model_get_output_error(shard->deltas);
+    float loss = mat_softmax_cross_entropy(error, NULL, logits, shard->labels) * shard->size;
+
+    model_zero_deltas(shard->deltas);
+    model_backprop(model, shard->images, shard->fp, shard->deltas, BACKPROP_OUTPUT_IS_Z);
+
+    return loss;
+}
+
+static void run_shard(void* user, uint32_t index, uint32_t worker) {
+    trainer_t* trainer = user;
+    struct trainer_shard* shard = &trainer->shards[index];
+
+    shard->loss = compute_gradients(trainer, shard, trainer->indices + shard->offset);
+}
+
+/* each task owns a contiguous range of whole cache lines of the parameter block, so no two touch
+ * the same memory. the range's gradients are summed over every shard into shard 0's, then the
+ * optimizer steps the matching parameters */
+static void reduce_range(void* user, uint32_t index, uint32_t worker) {
+    trainer_t* trainer = user;
+
+    /* both blocks are whole cache lines long */
+    static const uint32_t line = MAT_ALIGNMENT / sizeof(float);
+    uint32_t lines = trainer->model->parameters->columns / line;
+
+    size_t begin = (uint64_t)lines * index / trainer->task_count * line;
+    size_t end = (uint64_t)lines * (index + 1) / trainer->task_count * line;
+
+    float* sum = trainer->shards[0].deltas->parameters->data;
+    for (uint32_t i = 1; i < trainer->shard_count; i++) {
+        const float* gradient = trainer->shards[i].deltas->parameters->data;
+
+        for (size_t x = begin; x < end; x++) {
+            sum[x] += gradient[x];
+        }
+    }
+
+    optim_update(trainer->optimizer, trainer->model->parameters->data, sum, begin, end,
+                 trainer->scale);
+}
+
+static void run_tasks(trainer_t* trainer, uint32_t count, pool_task_t task) {
+    if (trainer->pool) {
+        pool_run(trainer->pool, count, task, trainer);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        task(trainer, i, 0);
+    }
+}
+
+/* dst -= scale * gradient, skipping zero gradients so that lines nobody needs to change (e.g. the
+ * weights of blank pixels) are never dirtied under the other workers. plain racy read-modify-write:
+ * concurrent updates to the same weight may be lost, which hogwild accepts */
+static void apply_racy(float* dst, const float* gradient, size_t count, float scale) {
+    for (size_t x = 0; x < count; x++) {
+        float g = gradient[x];
+        if (g == 0.f) {
+            continue;
+        }
+
+        float value;
+        __atomic_load(&dst[x], &value, __ATOMIC_RELAXED);
+
+        value -= scale * g;
+        __atomic_store(&dst[x], &value, __ATOMIC_RELAXED);
+    }
+}
+
+static void run_async_shard(void* user, uint32_t index, uint32_t worker) {
+    trainer_t* trainer = user;
+    struct trainer_shard* shard = &trainer->shards[index];
+
+    /* this shard's slice of the samples, as whole steps */
+    uint32_t begin = (uint32_t)((uint64_t)trainer->count * index / trainer->shard_count);
+    uint32_t end = (uint32_t)((uint64_t)trainer->count * (index + 1) / trainer->shard_count);
+
+    float scale = trainer->scale / shard->size;
+
+    shard->loss = 0.f;
+    shard->loaded = true;
+
+    for (uint32_t offset = begin; offset + shard->size <= end; offset += shard->size) {
+        shard->loss += compute_gradients(trainer, shard, trainer->indices + offset);
+        if (!shard->loaded) {
+            return;
+        }
+
+        /* one sweep over the whole block; it shares the model's layout */
+        apply_racy(trainer->model->parameters->data, shard->deltas->parameters->data,
+                   trainer->model->parameters->columns, scale);
+    }
+}
+
+float trainer_run_async(trainer_t* trainer, const dataset_t* data, const uint32_t* indices,
+                        uint32_t count, float rate) {
+    /* racing updates to optimizer state as well would be unbounded; plain sgd only */
+    assert(optim_get_params(trainer->optimizer)->type == OPTIM_SGD);
+
+    trainer->data = data;
+    trainer->indices = indices;
+    trainer->count = count;
+    trainer->scale = rate;
+
+    run_tasks(trainer, trainer->shard_count, run_async_shard);
+
+    float loss = 0.f;
+    uint32_t trained = 0;
+
+    for (uint32_t i = 0; i < trainer->shard_count; i++) {
+        const struct trainer_shard* shard = &trainer->shards[i];
+        if (!shard->loaded) {
+            NV_LOG_ERROR("failed to load a batch of shard %u!", i);
+            return -1.f;
+        }
+
+        uint32_t begin = (uint32_t)((uint64_t)count * i / trainer->shard_count);
+        uint32_t end = (uint32_t)((uint64_t)count * (i + 1) / trainer->shard_count);
+
+        loss += shard->loss;
+        trained += (end - begin) / shard->size * shard->size;
+    }
+
+    return trained > 0 ? loss / trained : 0.f;
+}
+
+float trainer_step(trainer_t* trainer, const dataset_t* data, const uint32_t* indices,
+                   float rate) {
+    trainer->data = data;
+    trainer->indices = indices;
+
+    run_tasks(trainer, trainer->shard_count, run_shard);
+
+    float loss = 0.f;
+    for (uint32_t i = 0; i < trainer->shard_count; i++) {
+        const struct trainer_shard* shard = &trainer->shards[i];
+        if (!shard->loaded) {
+            NV_LOG_ERROR("failed to load shard %u of batch!", i);
+            return -1.f;
+        }
+
+        loss += shard->loss;
+    }
+
+    /* the gradients are summed over the batch; step by their mean */
+    trainer->scale = 1.f / trainer->batch_size;
+    optim_begin_step(trainer->optimizer, rate);
+    run_tasks(trainer, trainer->task_count, reduce_range);
+
+    return loss / trainer->batch_size;
+}
@@ -0,0 +1,45 @@
+#ifndef _TRAIN_H
+#define _TRAIN_H
+
+#include <stdint.h>
+
+/* from model.h */
+typedef struct model model_t;
+
+/* from optim.h */
+typedef struct optimizer optimizer_t;
+
+/* from pool.h */
+typedef struct thread_pool thread_pool_t;
+
+/* from data/dataset.h */
+typedef struct dataset dataset_t;
+
+typedef struct trainer trainer_t;
+
+/* synchronous data-parallel training. every step's batch is split into one shard per pool
+ * thread, and each shard runs forward and backward on its own buffers and deltas. the shard
+ * gradients are then summed (always in shard order, so results do not depend on scheduling) and
+ * fed to optimizer in the same parallel pass. batch_size is fixed for the trainer's lifetime; pool
+ * may be NULL */
+trainer_t* trainer_alloc(model_t* model, optimizer_t* optimizer, thread_pool_t* pool,
+                         uint32_t batch_size, uint32_t image_size);
+
+void trainer_free(trainer_t* trainer);
+
+/* one optimizer step over the batch_size samples at indices, at learning rate rate. returns the
+ * mean loss, or a negative value if the batch could not be loaded (the model is then left
+ * untouched) */
+float trainer_step(trainer_t* trainer, const dataset_t* data, const uint32_t* indices, float rate);
+
+/* hogwild-style asynchronous sgd over count samples at indices; the optimizer must be OPTIM_SGD.
+ * each shard works through its own slice in steps of its shard size and applies every step's
+ * gradients straight to the shared model, with no locks and no reduction. those updates race with
+ * the other shards' reads and updates: stores are relaxed atomics, so a read sees some whole value,
+ * but an update can be lost or a forward pass can mix weights from different steps. sgd tolerates
+ * this; results are not reproducible. returns the mean loss, or a negative value if a batch failed
+ * to load */
+float trainer_run_async(trainer_t* trainer, const dataset_t* data, const uint32_t* indices,
+                        uint32_t count, float rate);
+
+#endif
@@ -0,0 +1,94 @@
+#include "vec.h"
+
+#include "cpu.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#include <nyoravim/log.h>
+
+static void relu_scalar(float* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float in = src[i];
+        dst[i] = in > 0 ? in : 0.f;
+    }
+}
+
+static void sigmoid_scalar(float* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = 1.f / (1.f + expf(-src[i]));
+    }
+}
+
+static void exp_scalar(float* dst, const float* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = expf(src[i]);
+    }
+}
+
+static void exp_shifted_scalar(float* dst, const float* src, const float* shift, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = expf(src[i] - shift[i]);
+    }
+}
+
+static void scale_scalar(float* dst, float scalar, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] *= scalar;
+    }
+}
+
+static float sum_scalar(const float* src, size_t count) {
+    float sum = 0.f;
+    for (size_t i = 0; i < count; i++) {
+        sum += src[i];
+    }
+
+    return sum;
+}
+
+static void cross_entropy_scalar(float* dst, const float* x, const float* y, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = x[i] == 0.f ? 0.f : x[i] * -logf(y[i]);
+    }
+}
+
+static const struct vec_kernels s_reference_kernels = {
+    .name = "scalar",
+    .relu = relu_scalar,
+    .sigmoid = sigmoid_scalar,
+    .exp = exp_scalar,
+    .exp_shifted = exp_shifted_scalar,
+    .scale = scale_scalar,
+    .sum = sum_scalar,
+    .cross_entropy = cross_entropy_scalar,
+};
+
+const struct vec_kernels* vec_get_reference_kernels() { return &s_reference_kernels; }
+
+static pthread_once_t s_kernels_once = PTHREAD_ONCE_INIT;
+static const struct vec_kernels* s_kernels;
+
+static void select_kernels() {
+    const struct vec_kernels* kernels = NULL;
+
+    if (cpu_has_features(CPU_FEATURE_AVX512F)) {
+        kernels = vec_get_avx512_kernels();
+    }
+
+    if (!kernels && cpu_has_features(CPU_FEATURE_AVX2 | CPU_FEATURE_FMA)) {
+        kernels = vec_get_avx2_kernels();
+    }
+
+    if (!kernels && cpu_has_features(CPU_FEATURE_SSE2)) {
+        kernels = vec_get_sse2_kernels();
+    }
+
+    s_kernels = kernels ? kernels : &s_reference_kernels;
+    NV_LOG_DEBUG("vec: using %s elementwise kernels", s_kernels->name);
+}
+
+const struct vec_kernels* vec_get_kernels() {
+    pthread_once(&s_kernels_once, select_kernels);
+    return s_kernels;
+}
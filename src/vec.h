@@ -0,0 +1,35 @@
+#ifndef _VEC_H
+#define _VEC_H
+
+#include <stddef.h>
+
+/* elementwise kernels over contiguous float arrays. dst may alias src */
+struct vec_kernels {
+    const char* name;
+
+    void (*relu)(float* dst, const float* src, size_t count);
+    void (*sigmoid)(float* dst, const float* src, size_t count);
+    void (*exp)(float* dst, const float* src, size_t count);
+
+    /* dst = exp(src - shift), shift elementwise */
+    void (*exp_shifted)(float* dst, const float* src, const float* shift, size_t count);
+
+    void (*scale)(float* dst, float scalar, size_t count);
+    float (*sum)(const float* src, size_t count);
+
+    /* dst = x == 0 ? 0 : x * -log(y) */
+    void (*cross_entropy)(float* dst, const float* x, const float* y, size_t count);
+};
+
+/* picked once from cpuid on first use */
+const struct vec_kernels* vec_get_kernels();
+
+/* plain libm implementation; the vectorized kernels approximate this */
+const struct vec_kernels* vec_get_reference_kernels();
+
+/* implemented in vec_x86.c. each returns NULL if unavailable at compile time */
+const struct vec_kernels* vec_get_sse2_kernels();
+const struct vec_kernels* vec_get_avx2_kernels();
+const struct vec_kernels* vec_get_avx512_kernels();
+
+#endif
@@ -0,0 +1,657 @@
+#include "vec.h"
+
+#include <string.h>
+
+/* cephes-style exp/log approximations (as popularized by sse_mathfun), accurate to a couple of
+ * ulp over the clamped range. exp saturates at e^88 instead of overflowing to inf, and log clamps
+ * its input to the smallest normal float, so log(0) yields roughly -87.3 instead of -inf */
+
+#define EXP_HI 88.f
+#define EXP_LO -87.3365478515625f
+
+#define LOG2EF 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+#define SQRTHF 0.707106781186547524f
+#define MIN_NORM 1.17549435e-38f
+
+#define LOG_P0 7.0376836292e-2f
+#define LOG_P1 -1.1514610310e-1f
+#define LOG_P2 1.1676998740e-1f
+#define LOG_P3 -1.2420140846e-1f
+#define LOG_P4 1.4249322787e-1f
+#define LOG_P5 -1.6668057665e-1f
+#define LOG_P6 2.0000714765e-1f
+#define LOG_P7 -2.4999993993e-1f
+#define LOG_P8 3.3333331174e-1f
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* ---- sse2 ---- */
+
+__attribute__((target("sse2"))) static inline __m128 exp_sse2(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(EXP_LO)), _mm_set1_ps(EXP_HI));
+
+    __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(LOG2EF)));
+    __m128 fn = _mm_cvtepi32_ps(n);
+
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(LN2_HI)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fn, _mm_set1_ps(LN2_LO)));
+
+    __m128 p = _mm_set1_ps(EXP_P0);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P1));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P2));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P3));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P4));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P5));
+    p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), _mm_add_ps(r, _mm_set1_ps(1.f)));
+
+    __m128i pow2n = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(pow2n));
+}
+
+__attribute__((target("sse2"))) static inline __m128 log_sse2(__m128 x) {
+    x = _mm_max_ps(x, _mm_set1_ps(MIN_NORM));
+
+    __m128i bits = _mm_castps_si128(x);
+    __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126));
+    __m128 e = _mm_cvtepi32_ps(exponent);
+
+    /* mantissa in [0.5, 1) */
+    __m128 m = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000))),
+                         _mm_set1_ps(0.5f));
+
+    /* shift into [sqrt(0.5), sqrt(2)) */
+    __m128 mask = _mm_cmplt_ps(m, _mm_set1_ps(SQRTHF));
+    __m128 tmp = _mm_and_ps(m, mask);
+    m = _mm_sub_ps(m, _mm_set1_ps(1.f));
+    e = _mm_sub_ps(e, _mm_and_ps(_mm_set1_ps(1.f), mask));
+    m = _mm_add_ps(m, tmp);
+
+    __m128 z = _mm_mul_ps(m, m);
+
+    __m128 y = _mm_set1_ps(LOG_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P5));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P6));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P7));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(LOG_P8));
+    y = _mm_mul_ps(_mm_mul_ps(y, m), z);
+
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(LN2_LO)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+
+    __m128 result = _mm_add_ps(m, y);
+    return _mm_add_ps(result, _mm_mul_ps(e, _mm_set1_ps(LN2_HI)));
+}
+
+__attribute__((target("sse2"))) static inline __m128 sigmoid_sse2(__m128 x) {
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 e = exp_sse2(_mm_sub_ps(_mm_setzero_ps(), x));
+    return _mm_div_ps(one, _mm_add_ps(one, e));
+}
+
+__attribute__((target("sse2"))) static inline __m128 cross_entropy_sse2(__m128 x, __m128 y) {
+    __m128 is_zero = _mm_cmpeq_ps(x, _mm_setzero_ps());
+    __m128 value = _mm_mul_ps(x, _mm_sub_ps(_mm_setzero_ps(), log_sse2(y)));
+    return _mm_andnot_ps(is_zero, value);
+}
+
+/* tails go through a zero-padded register so they see the same approximation */
+__attribute__((target("sse2"))) static inline __m128 load_tail_sse2(const float* src,
+                                                                     size_t count) {
+    float buffer[4] = { 0.f };
+    memcpy(buffer, src, count * sizeof(float));
+    return _mm_loadu_ps(buffer);
+}
+
+__attribute__((target("sse2"))) static inline void store_tail_sse2(float* dst, __m128 value,
+                                                                    size_t count) {
+    float buffer[4];
+    _mm_storeu_ps(buffer, value);
+    memcpy(dst, buffer, count * sizeof(float));
+}
+
+__attribute__((target("sse2"))) static void relu_sse2(float* dst, const float* src,
+                                                       size_t count) {
+    __m128 zero = _mm_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_max_ps(_mm_loadu_ps(src + i), zero));
+    }
+
+    if (i < count) {
+        store_tail_sse2(dst + i, _mm_max_ps(load_tail_sse2(src + i, count - i), zero), count - i);
+    }
+}
+
+__attribute__((target("sse2"))) static void sigmoid_sse2_kernel(float* dst, const float* src,
+                                                                 size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, sigmoid_sse2(_mm_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        store_tail_sse2(dst + i, sigmoid_sse2(load_tail_sse2(src + i, count - i)), count - i);
+    }
+}
+
+__attribute__((target("sse2"))) static void exp_sse2_kernel(float* dst, const float* src,
+                                                             size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, exp_sse2(_mm_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        store_tail_sse2(dst + i, exp_sse2(load_tail_sse2(src + i, count - i)), count - i);
+    }
+}
+
+__attribute__((target("sse2"))) static void exp_shifted_sse2(float* dst, const float* src,
+                                                              const float* shift, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_sub_ps(_mm_loadu_ps(src + i), _mm_loadu_ps(shift + i));
+        _mm_storeu_ps(dst + i, exp_sse2(x));
+    }
+
+    if (i < count) {
+        __m128 x = _mm_sub_ps(load_tail_sse2(src + i, count - i),
+                              load_tail_sse2(shift + i, count - i));
+        store_tail_sse2(dst + i, exp_sse2(x), count - i);
+    }
+}
+
+__attribute__((target("sse2"))) static void scale_sse2(float* dst, float scalar, size_t count) {
+    __m128 s = _mm_set1_ps(scalar);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), s));
+    }
+
+    for (; i < count; i++) {
+        dst[i] *= scalar;
+    }
+}
+
+__attribute__((target("sse2"))) static float sum_sse2(const float* src, size_t count) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_loadu_ps(src + i));
+        acc1 = _mm_add_ps(acc1, _mm_loadu_ps(src + i + 4));
+    }
+
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_ps(acc0, _mm_loadu_ps(src + i));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++) {
+        sum += src[i];
+    }
+
+    return sum;
+}
+
+__attribute__((target("sse2"))) static void cross_entropy_sse2_kernel(float* dst, const float* x,
+                                                                       const float* y,
+                                                                       size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, cross_entropy_sse2(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+
+    if (i < count) {
+        __m128 value =
+            cross_entropy_sse2(load_tail_sse2(x + i, count - i), load_tail_sse2(y + i, count - i));
+        store_tail_sse2(dst + i, value, count - i);
+    }
+}
+
+static const struct vec_kernels s_sse2_kernels = {
+    .name = "sse2",
+    .relu = relu_sse2,
+    .sigmoid = sigmoid_sse2_kernel,
+    .exp = exp_sse2_kernel,
+    .exp_shifted = exp_shifted_sse2,
+    .scale = scale_sse2,
+    .sum = sum_sse2,
+    .cross_entropy = cross_entropy_sse2_kernel,
+};
+
+/* ---- avx2 + fma ---- */
+
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+AVX2_TARGET static inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+
+    __m256 fn = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2EF)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256i n = _mm256_cvtps_epi32(fn);
+
+    __m256 r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(LN2_HI), x);
+    r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(LN2_LO), r);
+
+    __m256 p = _mm256_set1_ps(EXP_P0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+    p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.f)));
+
+    __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+}
+
+AVX2_TARGET static inline __m256 log_avx2(__m256 x) {
+    x = _mm256_max_ps(x, _mm256_set1_ps(MIN_NORM));
+
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i exponent = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+    __m256 e = _mm256_cvtepi32_ps(exponent);
+
+    __m256 m = _mm256_or_ps(_mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000))),
+                            _mm256_set1_ps(0.5f));
+
+    __m256 mask = _mm256_cmp_ps(m, _mm256_set1_ps(SQRTHF), _CMP_LT_OQ);
+    __m256 tmp = _mm256_and_ps(m, mask);
+    m = _mm256_sub_ps(m, _mm256_set1_ps(1.f));
+    e = _mm256_sub_ps(e, _mm256_and_ps(_mm256_set1_ps(1.f), mask));
+    m = _mm256_add_ps(m, tmp);
+
+    __m256 z = _mm256_mul_ps(m, m);
+
+    __m256 y = _mm256_set1_ps(LOG_P0);
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P1));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P2));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P3));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P4));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P5));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P6));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P7));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(LOG_P8));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+
+    y = _mm256_fmadd_ps(e, _mm256_set1_ps(LN2_LO), y);
+    y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+
+    __m256 result = _mm256_add_ps(m, y);
+    return _mm256_fmadd_ps(e, _mm256_set1_ps(LN2_HI), result);
+}
+
+AVX2_TARGET static inline __m256 sigmoid_avx2(__m256 x) {
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 e = exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x));
+    return _mm256_div_ps(one, _mm256_add_ps(one, e));
+}
+
+AVX2_TARGET static inline __m256 cross_entropy_avx2(__m256 x, __m256 y) {
+    __m256 is_zero = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    __m256 value = _mm256_mul_ps(x, _mm256_sub_ps(_mm256_setzero_ps(), log_avx2(y)));
+    return _mm256_andnot_ps(is_zero, value);
+}
+
+AVX2_TARGET static inline __m256 load_tail_avx2(const float* src, size_t count) {
+    float buffer[8] = { 0.f };
+    memcpy(buffer, src, count * sizeof(float));
+    return _mm256_loadu_ps(buffer);
+}
+
+AVX2_TARGET static inline void store_tail_avx2(float* dst, __m256 value, size_t count) {
+    float buffer[8];
+    _mm256_storeu_ps(buffer, value);
+    memcpy(dst, buffer, count * sizeof(float));
+}
+
+AVX2_TARGET static void relu_avx2(float* dst, const float* src, size_t count) {
+    __m256 zero = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_max_ps(_mm256_loadu_ps(src + i), zero));
+    }
+
+    if (i < count) {
+        store_tail_avx2(dst + i, _mm256_max_ps(load_tail_avx2(src + i, count - i), zero),
+                        count - i);
+    }
+}
+
+AVX2_TARGET static void sigmoid_avx2_kernel(float* dst, const float* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, sigmoid_avx2(_mm256_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        store_tail_avx2(dst + i, sigmoid_avx2(load_tail_avx2(src + i, count - i)), count - i);
+    }
+}
+
+AVX2_TARGET static void exp_avx2_kernel(float* dst, const float* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, exp_avx2(_mm256_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        store_tail_avx2(dst + i, exp_avx2(load_tail_avx2(src + i, count - i)), count - i);
+    }
+}
+
+AVX2_TARGET static void exp_shifted_avx2(float* dst, const float* src, const float* shift,
+                                         size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_sub_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(shift + i));
+        _mm256_storeu_ps(dst + i, exp_avx2(x));
+    }
+
+    if (i < count) {
+        __m256 x = _mm256_sub_ps(load_tail_avx2(src + i, count - i),
+                                 load_tail_avx2(shift + i, count - i));
+        store_tail_avx2(dst + i, exp_avx2(x), count - i);
+    }
+}
+
+AVX2_TARGET static void scale_avx2(float* dst, float scalar, size_t count) {
+    __m256 s = _mm256_set1_ps(scalar);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), s));
+    }
+
+    for (; i < count; i++) {
+        dst[i] *= scalar;
+    }
+}
+
+AVX2_TARGET static float sum_avx2(const float* src, size_t count) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(src + i));
+        acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(src + i + 8));
+    }
+
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(src + i));
+    }
+
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++) {
+        sum += src[i];
+    }
+
+    return sum;
+}
+
+AVX2_TARGET static void cross_entropy_avx2_kernel(float* dst, const float* x, const float* y,
+                                                  size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i,
+                         cross_entropy_avx2(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+
+    if (i < count) {
+        __m256 value =
+            cross_entropy_avx2(load_tail_avx2(x + i, count - i), load_tail_avx2(y + i, count - i));
+        store_tail_avx2(dst + i, value, count - i);
+    }
+}
+
+static const struct vec_kernels s_avx2_kernels = {
+    .name = "avx2",
+    .relu = relu_avx2,
+    .sigmoid = sigmoid_avx2_kernel,
+    .exp = exp_avx2_kernel,
+    .exp_shifted = exp_shifted_avx2,
+    .scale = scale_avx2,
+    .sum = sum_avx2,
+    .cross_entropy = cross_entropy_avx2_kernel,
+};
+
+/* ---- avx-512 ---- */
+
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+AVX512_TARGET static inline __m512 exp_avx512(__m512 x) {
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+
+    __m512 fn = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2EF)),
+                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512i n = _mm512_cvtps_epi32(fn);
+
+    __m512 r = _mm512_fnmadd_ps(fn, _mm512_set1_ps(LN2_HI), x);
+    r = _mm512_fnmadd_ps(fn, _mm512_set1_ps(LN2_LO), r);
+
+    __m512 p = _mm512_set1_ps(EXP_P0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+    p = _mm512_fmadd_ps(_mm512_mul_ps(p, r), r, _mm512_add_ps(r, _mm512_set1_ps(1.f)));
+
+    __m512i pow2n = _mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(pow2n));
+}
+
+AVX512_TARGET static inline __m512 log_avx512(__m512 x) {
+    x = _mm512_max_ps(x, _mm512_set1_ps(MIN_NORM));
+
+    __m512i bits = _mm512_castps_si512(x);
+    __m512i exponent = _mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(126));
+    __m512 e = _mm512_cvtepi32_ps(exponent);
+
+    __m512i mantissa = _mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(~0x7f800000)),
+                                       _mm512_castps_si512(_mm512_set1_ps(0.5f)));
+    __m512 m = _mm512_castsi512_ps(mantissa);
+
+    __mmask16 mask = _mm512_cmp_ps_mask(m, _mm512_set1_ps(SQRTHF), _CMP_LT_OQ);
+    __m512 tmp = _mm512_maskz_mov_ps(mask, m);
+    m = _mm512_sub_ps(m, _mm512_set1_ps(1.f));
+    e = _mm512_mask_sub_ps(e, mask, e, _mm512_set1_ps(1.f));
+    m = _mm512_add_ps(m, tmp);
+
+    __m512 z = _mm512_mul_ps(m, m);
+
+    __m512 y = _mm512_set1_ps(LOG_P0);
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P1));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P2));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P3));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P4));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P5));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P6));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P7));
+    y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(LOG_P8));
+    y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+
+    y = _mm512_fmadd_ps(e, _mm512_set1_ps(LN2_LO), y);
+    y = _mm512_fnmadd_ps(z, _mm512_set1_ps(0.5f), y);
+
+    __m512 result = _mm512_add_ps(m, y);
+    return _mm512_fmadd_ps(e, _mm512_set1_ps(LN2_HI), result);
+}
+
+AVX512_TARGET static inline __m512 sigmoid_avx512(__m512 x) {
+    __m512 one = _mm512_set1_ps(1.f);
+    __m512 e = exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x));
+    return _mm512_div_ps(one, _mm512_add_ps(one, e));
+}
+
+AVX512_TARGET static inline __m512 cross_entropy_avx512(__m512 x, __m512 y) {
+    __mmask16 nonzero = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    __m512 value = _mm512_mul_ps(x, _mm512_sub_ps(_mm512_setzero_ps(), log_avx512(y)));
+    return _mm512_maskz_mov_ps(nonzero, value);
+}
+
+/* tails use masked loads and stores */
+AVX512_TARGET static inline __mmask16 tail_mask(size_t count) {
+    return (__mmask16)((1u << count) - 1);
+}
+
+AVX512_TARGET static void relu_avx512(float* dst, const float* src, size_t count) {
+    __m512 zero = _mm512_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_max_ps(_mm512_loadu_ps(src + i), zero));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+        __m512 value = _mm512_max_ps(_mm512_maskz_loadu_ps(mask, src + i), zero);
+        _mm512_mask_storeu_ps(dst + i, mask, value);
+    }
+}
+
+AVX512_TARGET static void sigmoid_avx512_kernel(float* dst, const float* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i, sigmoid_avx512(_mm512_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+        __m512 value = sigmoid_avx512(_mm512_maskz_loadu_ps(mask, src + i));
+        _mm512_mask_storeu_ps(dst + i, mask, value);
+    }
+}
+
+AVX512_TARGET static void exp_avx512_kernel(float* dst, const float* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i, exp_avx512(_mm512_loadu_ps(src + i)));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+        __m512 value = exp_avx512(_mm512_maskz_loadu_ps(mask, src + i));
+        _mm512_mask_storeu_ps(dst + i, mask, value);
+    }
+}
+
+AVX512_TARGET static void exp_shifted_avx512(float* dst, const float* src, const float* shift,
+                                             size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 x = _mm512_sub_ps(_mm512_loadu_ps(src + i), _mm512_loadu_ps(shift + i));
+        _mm512_storeu_ps(dst + i, exp_avx512(x));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+        __m512 x = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, src + i),
+                                 _mm512_maskz_loadu_ps(mask, shift + i));
+        _mm512_mask_storeu_ps(dst + i, mask, exp_avx512(x));
+    }
+}
+
+AVX512_TARGET static void scale_avx512(float* dst, float scalar, size_t count) {
+    __m512 s = _mm512_set1_ps(scalar);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(dst + i), s));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+        __m512 value = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, dst + i), s);
+        _mm512_mask_storeu_ps(dst + i, mask, value);
+    }
+}
+
+AVX512_TARGET static float sum_avx512(const float* src, size_t count) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(src + i));
+        acc1 = _mm512_add_ps(acc1, _mm512_loadu_ps(src + i + 16));
+    }
+
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(src + i));
+    }
+
+    if (i < count) {
+        acc1 = _mm512_add_ps(acc1, _mm512_maskz_loadu_ps(tail_mask(count - i), src + i));
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+AVX512_TARGET static void cross_entropy_avx512_kernel(float* dst, const float* x, const float* y,
+                                                      size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i,
+                         cross_entropy_avx512(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+
+    if (i < count) {
+        __mmask16 mask = tail_mask(count - i);
+
+        /* masked-off lanes of y load as 0, which log clamps rather than faulting on */
+        __m512 value = cross_entropy_avx512(_mm512_maskz_loadu_ps(mask, x + i),
+                                            _mm512_maskz_loadu_ps(mask, y + i));
+        _mm512_mask_storeu_ps(dst + i, mask, value);
+    }
+}
+
+static const struct vec_kernels s_avx512_kernels = {
+    .name = "avx512",
+    .relu = relu_avx512,
+    .sigmoid = sigmoid_avx512_kernel,
+    .exp = exp_avx512_kernel,
+    .exp_shifted = exp_shifted_avx512,
+    .scale = scale_avx512,
+    .sum = sum_avx512,
+    .cross_entropy = cross_entropy_avx512_kernel,
+};
+
+const struct vec_kernels* vec_get_sse2_kernels() { return &s_sse2_kernels; }
+const struct vec_kernels* vec_get_avx2_kernels() { return &s_avx2_kernels; }
+const struct vec_kernels* vec_get_avx512_kernels() { return &s_avx512_kernels; }
+#else
+const struct vec_kernels* vec_get_sse2_kernels() { return NULL; }
+const struct vec_kernels* vec_get_avx2_kernels() { return NULL; }
+const struct vec_kernels* vec_get_avx512_kernels() { return NULL; }
+#endif